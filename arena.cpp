@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <sys/mman.h>
+
+#include "arena.hpp"
+
+static const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+static size_t align_up(size_t value, size_t alignment) { return ((value + alignment - 1) & ~(alignment - 1)); }
+
+
+
+void* t_arena::allocate(size_t num_bytes, size_t alignment) {
+	if (m_blocks.empty() || align_up(m_blocks.back().m_used, alignment) + num_bytes > m_blocks.back().m_size) {
+		if (!alloc_block(num_bytes + alignment)) {
+			throw std::bad_alloc();
+		}
+	}
+
+	t_block& block = m_blocks.back();
+
+	const size_t offset = align_up(block.m_used, alignment);
+
+	m_num_bytes_used += ((offset + num_bytes) - block.m_used);
+	block.m_used = offset + num_bytes;
+
+	return (block.m_data + offset);
+}
+
+bool t_arena::alloc_block(size_t min_size) {
+	t_block block;
+	block.m_data = 0;
+	block.m_size = std::max(m_block_size, min_size);
+	block.m_used = 0;
+
+	void* data = MAP_FAILED;
+
+	if (m_huge_pages) {
+		block.m_size = align_up(block.m_size, HUGE_PAGE_SIZE);
+
+		#ifdef MAP_HUGETLB
+		// explicit huge pages only work if the admin reserved some
+		data = mmap(0, block.m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		#endif
+	}
+
+	if (data == MAP_FAILED) {
+		if ((data = mmap(0, block.m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			return false;
+
+		#ifdef MADV_HUGEPAGE
+		// otherwise fall back to transparent huge pages
+		if (m_huge_pages) {
+			madvise(data, block.m_size, MADV_HUGEPAGE);
+		}
+		#endif
+	}
+
+	block.m_data = reinterpret_cast<uint8_t*>(data);
+	m_blocks.push_back(block);
+	return true;
+}
+
+t_arena& t_arena::fork() {
+	m_children.push_back(new t_arena(m_block_size, m_huge_pages));
+	return *m_children.back();
+}
+
+void t_arena::release() {
+	for (size_t n = 0; n < m_children.size(); n++) {
+		delete m_children[n];
+	}
+
+	for (size_t n = 0; n < m_blocks.size(); n++) {
+		munmap(m_blocks[n].m_data, m_blocks[n].m_size);
+	}
+
+	m_children.clear();
+	m_blocks.clear();
+
+	m_num_bytes_used = 0;
+}
+
+
+size_t t_arena::num_bytes_used() const {
+	size_t num_bytes = m_num_bytes_used;
+
+	for (size_t n = 0; n < m_children.size(); n++) {
+		num_bytes += m_children[n]->num_bytes_used();
+	}
+
+	return num_bytes;
+}
+
+size_t t_arena::num_bytes_reserved() const {
+	size_t num_bytes = 0;
+
+	for (size_t n = 0; n < m_blocks.size(); n++) {
+		num_bytes += m_blocks[n].m_size;
+	}
+	for (size_t n = 0; n < m_children.size(); n++) {
+		num_bytes += m_children[n]->num_bytes_reserved();
+	}
+
+	return num_bytes;
+}
+
+size_t t_arena::num_blocks() const {
+	size_t num_blocks = m_blocks.size();
+
+	for (size_t n = 0; n < m_children.size(); n++) {
+		num_blocks += m_children[n]->num_blocks();
+	}
+
+	return num_blocks;
+}
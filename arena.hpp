@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// bump-pointer allocator that owns all memory of a scene's
+// acceleration structure; objects are carved out of large
+// blocks and released together, never individually
+//
+// NOTE: only trivially destructible types may be created
+// here since release() does not run any destructors
+//
+class t_arena {
+public:
+	t_arena(size_t block_size = (size_t(16) << 20), bool huge_pages = false) {
+		m_block_size = block_size;
+		m_huge_pages = huge_pages;
+		m_num_bytes_used = 0;
+	}
+
+	t_arena(const t_arena&) = delete;
+	~t_arena() { release(); }
+
+	t_arena& operator = (const t_arena&) = delete;
+
+	void* allocate(size_t num_bytes, size_t alignment = 16);
+
+	// creates a sub-arena with the same settings, owned (and released) by
+	// this one; lets another thread allocate without any synchronization
+	//
+	// NOTE: must be called by the thread that currently owns this arena
+	t_arena& fork();
+
+	template<typename t_type> t_type* create() {
+		static_assert(std::is_trivially_destructible<t_type>::value, "arena objects are never destructed");
+		return (new (allocate(sizeof(t_type), alignof(t_type))) t_type());
+	}
+
+	template<typename t_type> t_type* create_array(size_t num_elems) {
+		static_assert(std::is_trivially_destructible<t_type>::value, "arena objects are never destructed");
+
+		t_type* elems = reinterpret_cast<t_type*>(allocate(sizeof(t_type) * num_elems, alignof(t_type)));
+
+		for (size_t n = 0; n < num_elems; n++) {
+			new (&elems[n]) t_type();
+		}
+
+		return elems;
+	}
+
+	// returns every block to the OS at once
+	void release();
+
+	void set_huge_pages(bool huge_pages) { m_huge_pages = huge_pages; }
+	bool use_huge_pages() const { return m_huge_pages; }
+
+	size_t num_bytes_used() const;
+	size_t num_bytes_reserved() const;
+	size_t num_blocks() const;
+
+private:
+	struct t_block {
+	public:
+		uint8_t* m_data;
+
+		size_t m_size;
+		size_t m_used;
+	};
+
+	bool alloc_block(size_t min_size);
+
+private:
+	std::vector<t_block> m_blocks;
+	std::vector<t_arena*> m_children;
+
+	size_t m_block_size;
+	size_t m_num_bytes_used;
+
+	bool m_huge_pages;
+};
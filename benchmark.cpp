@@ -0,0 +1,1093 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "benchmark.hpp"
+#include "camera.hpp"
+#include "common.hpp"
+#include "cost_map.hpp"
+#include "directional_light.hpp"
+#include "kdtree_cell_scene.hpp"
+#include "parallel.hpp"
+#include "renderer.hpp"
+#include "sample_layout.hpp"
+#include "terrain_generator.hpp"
+
+// resident ("VmRSS") or peak resident ("VmHWM") bytes of the process, 0
+// where /proc is not available
+static size_t get_resident_bytes(const char* key) {
+	FILE* file = fopen("/proc/self/status", "r");
+
+	if (file == 0)
+		return 0;
+
+	char line[256];
+	size_t num_kb = 0;
+
+	while (fgets(line, sizeof(line), file) != 0) {
+		if (strncmp(line, key, strlen(key)) == 0 && line[strlen(key)] == ':') {
+			num_kb = strtoul(line + strlen(key) + 1, 0, 10);
+			break;
+		}
+	}
+
+	fclose(file);
+	return (num_kb << 10);
+}
+
+// restarts VmHWM from the current VmRSS (linux 4.0+), so peaks can be
+// measured per build
+static bool reset_peak_resident_bytes() {
+	FILE* file = fopen("/proc/self/clear_refs", "w");
+
+	if (file == 0)
+		return false;
+
+	const bool ok = (fputs("5", file) >= 0);
+	return ((fclose(file) == 0) && ok);
+}
+
+// counts the (last-level) cache misses of the calling thread through
+// perf_event_open; every count is -1 where the kernel does not allow it
+class t_cache_miss_counter {
+public:
+	t_cache_miss_counter() {
+		m_fd = -1;
+
+		#if defined(__linux__)
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		m_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		#endif
+	}
+
+	~t_cache_miss_counter() {
+		#if defined(__linux__)
+		if (m_fd >= 0)
+			close(m_fd);
+		#endif
+	}
+
+	void start() {
+		#if defined(__linux__)
+		if (m_fd >= 0) {
+			ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		#endif
+	}
+
+	// misses since start()
+	int64_t stop() {
+		int64_t count = -1;
+
+		#if defined(__linux__)
+		if (m_fd >= 0) {
+			ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+			if (read(m_fd, &count, sizeof(count)) != ssize_t(sizeof(count)))
+				count = -1;
+		}
+		#endif
+
+		return count;
+	}
+
+private:
+	int m_fd;
+};
+
+
+
+// key=value arguments of a benchmark mode
+class t_benchmark_args {
+public:
+	t_benchmark_args(int argc, char** argv) {
+		for (int n = 0; n < argc; n++) {
+			const char* sep = strchr(argv[n], '=');
+
+			if (sep == 0) {
+				fprintf(stderr, "[%s] ignoring argument \"%s\" (expected key=value)\n", __FUNCTION__, argv[n]);
+				continue;
+			}
+
+			m_values[std::string(argv[n], sep - argv[n])] = sep + 1;
+		}
+	}
+
+	std::string get_string(const char* key, const char* def) const {
+		const std::map<std::string, std::string>::const_iterator it = m_values.find(key);
+		return ((it != m_values.end())? it->second: def);
+	}
+
+	size_t get_size(const char* key, size_t def) const {
+		const std::string str = get_string(key, "");
+		return (str.empty()? def: strtoul(str.c_str(), 0, 10));
+	}
+
+	float get_float(const char* key, float def) const {
+		const std::string str = get_string(key, "");
+		return (str.empty()? def: strtof(str.c_str(), 0));
+	}
+
+	// comma-separated list, e.g. "1,2,4"
+	std::vector<size_t> get_sizes(const char* key, const std::vector<size_t>& def) const {
+		const std::string str = get_string(key, "");
+
+		if (str.empty())
+			return def;
+
+		std::vector<size_t> sizes;
+
+		for (const char* s = str.c_str(); *s != 0; ) {
+			char* end = 0;
+			sizes.push_back(strtoul(s, &end, 10));
+
+			if (end == s)
+				break;
+
+			s = end + (*end == ',');
+		}
+
+		return sizes;
+	}
+
+private:
+	std::map<std::string, std::string> m_values;
+};
+
+
+
+struct t_trace_stats {
+public:
+	t_trace_stats() {
+		m_primary_time = 0;
+		m_shadow_time = 0;
+		m_num_primary_rays = 0;
+		m_num_shadow_rays = 0;
+		m_imbalance = 0.0;
+	}
+
+	double primary_rate() const { return (m_num_primary_rays / std::max(m_primary_time * 1e-9, 1e-9)); }
+	double shadow_rate() const { return (m_num_shadow_rays / std::max(m_shadow_time * 1e-9, 1e-9)); }
+
+public:
+	// wall-clock time of each phase, ns
+	int64_t m_primary_time;
+	int64_t m_shadow_time;
+
+	size_t m_num_primary_rays;
+	size_t m_num_shadow_rays;
+
+	// slowest over mean busy-time of the image-tiles (primary rays); values
+	// well above 1 mean the static split rather than the scene limits scaling
+	double m_imbalance;
+};
+
+// traces <num_frames> frames of <view_size_x> x <view_size_y> pixels with
+// one thread per image-tile (laid out like the renderer's), first all
+// primary rays and then the shadow rays of their hits, timing both phases;
+// the frustum is given by the camera's fov and <aspect>, so taller images
+// sample the same view more densely
+//
+// an untimed frame runs first, to page in tiles and warm up the caches
+static t_trace_stats trace_frames(
+	const t_scene& scene,
+	const t_camera& camera,
+	const t_vector& light_dir,
+	size_t view_size_x,
+	size_t view_size_y,
+	float aspect,
+	size_t num_threads,
+	size_t num_frames
+) {
+	size_t num_tiles_x = 0;
+	size_t num_tiles_y = 0;
+
+	t_renderer::get_thread_grid(num_threads, num_tiles_x, num_tiles_y);
+
+	const size_t num_tiles = num_tiles_x * num_tiles_y;
+
+	const float fscale = camera.get_fov_scale();
+
+	// shadow-ray origins, for hits facing the light
+	std::vector<t_vector> shadow_origins(view_size_x * view_size_y);
+	std::vector<uint8_t> shadow_flags(view_size_x * view_size_y);
+
+	std::vector<size_t> num_primary_rays(num_tiles, 0);
+	std::vector<size_t> num_shadow_rays(num_tiles, 0);
+	std::vector<int64_t> busy_times(num_tiles, 0);
+
+	t_trace_stats stats;
+
+	// same (truncating) split as t_renderer::spawn_threads
+	const auto get_tile_bounds = [&](size_t idx, size_t& xmin, size_t& xmax, size_t& ymin, size_t& ymax) {
+		const size_t x = idx % num_tiles_x;
+		const size_t y = idx / num_tiles_x;
+
+		xmin = (view_size_x / num_tiles_x) * (x + 0); xmax = (view_size_x / num_tiles_x) * (x + 1);
+		ymin = (view_size_y / num_tiles_y) * (y + 0); ymax = (view_size_y / num_tiles_y) * (y + 1);
+	};
+
+	for (size_t frame = 0; frame <= num_frames; frame++) {
+		const int64_t primary_tick = get_tick();
+
+		fork_join(num_tiles, num_tiles, [&](size_t idx, size_t) {
+			const int64_t tile_tick = get_tick();
+
+			size_t xmin, xmax, ymin, ymax;
+			get_tile_bounds(idx, xmin, xmax, ymin, ymax);
+
+			for (size_t y = ymin; y < ymax; y++) {
+				for (size_t x = xmin; x < xmax; x++) {
+					const t_vector pxl_ray_dir = camera.get_pixel_dir(x, y, fscale, view_size_x, view_size_y, aspect);
+
+					const t_ray_intersection hit = scene.intersect_ray(t_ray(camera.pos(), pxl_ray_dir));
+
+					shadow_origins[y * view_size_x + x] = hit.pos();
+					shadow_flags[y * view_size_x + x] = (hit.valid() && (hit.gn() * light_dir) > 0.0f);
+				}
+			}
+
+			num_primary_rays[idx] += ((xmax - xmin) * (ymax - ymin));
+			busy_times[idx] += (get_tick() - tile_tick);
+		});
+
+		stats.m_primary_time += (get_tick() - primary_tick);
+
+		const int64_t shadow_tick = get_tick();
+
+		fork_join(num_tiles, num_tiles, [&](size_t idx, size_t) {
+			size_t xmin, xmax, ymin, ymax;
+			get_tile_bounds(idx, xmin, xmax, ymin, ymax);
+
+			for (size_t y = ymin; y < ymax; y++) {
+				for (size_t x = xmin; x < xmax; x++) {
+					if (!shadow_flags[y * view_size_x + x])
+						continue;
+
+					scene.trace_shadow_ray(t_ray(shadow_origins[y * view_size_x + x], light_dir));
+					num_shadow_rays[idx] += 1;
+				}
+			}
+		});
+
+		stats.m_shadow_time += (get_tick() - shadow_tick);
+
+		if (frame > 0)
+			continue;
+
+		// discard the warm-up
+		std::fill(num_primary_rays.begin(), num_primary_rays.end(), 0);
+		std::fill(num_shadow_rays.begin(), num_shadow_rays.end(), 0);
+		std::fill(busy_times.begin(), busy_times.end(), 0);
+
+		stats = t_trace_stats();
+	}
+
+	const int64_t max_busy_time = *std::max_element(busy_times.begin(), busy_times.end());
+	const double sum_busy_time = std::accumulate(busy_times.begin(), busy_times.end(), 0.0);
+
+	for (size_t idx = 0; idx < num_tiles; idx++) {
+		stats.m_num_primary_rays += num_primary_rays[idx];
+		stats.m_num_shadow_rays += num_shadow_rays[idx];
+	}
+
+	stats.m_imbalance = max_busy_time / std::max(sum_busy_time / num_tiles, 1.0);
+	return stats;
+}
+
+
+
+// sweeps map size x thread count for each scene type; every scene is built
+// with as many threads as it is traced with, and efficiencies are relative
+// to the first thread count (ideally 1) of the same scene and map size
+//
+// procedural maps keep benchmarks reproducible at any size; heights and the
+// camera scale with the map so every size shows the same kind of view
+static int run_scaling_benchmark(const t_benchmark_args& args, FILE* csv) {
+	const size_t max_threads = std::max(size_t(boost::thread::hardware_concurrency()), size_t(1));
+
+	std::vector<size_t> def_thread_counts;
+	std::vector<size_t> def_map_sizes = {256, 1024, 4096, 16384};
+	std::vector<size_t> def_scene_types = {SCENETYPE_LINEAR, SCENETYPE_QUADTREE, SCENETYPE_KDTREE, SCENETYPE_BVH4, SCENETYPE_CONE_STEP};
+
+	for (size_t n = 1; n < max_threads; n *= 2)
+		def_thread_counts.push_back(n);
+
+	def_thread_counts.push_back(max_threads);
+
+	const std::vector<size_t> thread_counts = args.get_sizes("threads", def_thread_counts);
+	const std::vector<size_t> map_sizes = args.get_sizes("sizes", def_map_sizes);
+	const std::vector<size_t> scene_types = args.get_sizes("scenes", def_scene_types);
+
+	const size_t view_size_x = args.get_size("view_x", 512);
+	const size_t view_size_y = args.get_size("view_y", 384);
+	const size_t num_frames = std::max(args.get_size("frames", 4), size_t(1));
+
+	// linear scenes test every cell for every ray
+	const size_t max_linear_size = args.get_size("linear_max", 64);
+
+	const t_terrain_generator generator(args.get_size("seed", 1), t_terrain_generator::TERRAIN_TYPE_ERODED);
+	const t_vector light_dir = t_vector(1.0f, 0.5f, 1.0f).normalize_xyz();
+
+	fprintf(csv, "scene,map_size,scaling,threads,view_x,view_y,build_ms,scene_bytes,");
+	fprintf(csv, "primary_rays,primary_rays_per_s,shadow_rays,shadow_rays_per_s,");
+	fprintf(csv, "build_efficiency,primary_efficiency,shadow_efficiency,tile_imbalance\n");
+
+	for (size_t map_size: map_sizes) {
+		t_heightmap heightmap;
+
+		// the map is shared by all points, generate it only if one needs it
+		for (size_t scene_type: scene_types) {
+			if (scene_type == SCENETYPE_LINEAR && map_size > max_linear_size) {
+				fprintf(stderr, "[%s] skipping linear scene for %lux%lu map (linear_max=%lu)\n", __FUNCTION__, map_size, map_size, max_linear_size);
+				continue;
+			}
+
+			if (heightmap.width() != map_size) {
+				const int64_t gen_tick = get_tick();
+
+				generator.generate(heightmap, map_size, map_size, map_size * 0.125f, max_threads);
+				fprintf(stderr, "[%s] generated %lux%lu map in %gms\n", __FUNCTION__, map_size, map_size, (get_tick() - gen_tick) * 1e-6);
+			}
+
+			t_camera camera;
+
+			camera.pos() = t_vector(map_size * 0.05f, map_size * 0.05f, map_size * 0.2f);
+			camera.fov() = M_PI / 3.0f;
+			camera.update(t_vector(1.0f, 1.0f, -0.4f).normalize_xyz());
+
+			// baselines for the efficiencies, [0] strong and [1] weak
+			double base_build_rate = 0.0;
+			double base_primary_rates[2] = {0.0, 0.0};
+			double base_shadow_rates[2] = {0.0, 0.0};
+
+			for (size_t num_threads: thread_counts) {
+				t_scene* scene = t_renderer::create_scene(scene_type);
+
+				if (scene == 0 || num_threads == 0)
+					break;
+
+				scene->set_num_build_threads(num_threads);
+				scene->assign_light_source(new t_directional_light(light_dir, t_color(1.0f, 1.0f, 1.0f)));
+
+				const int64_t build_tick = get_tick();
+				scene->assign_heightmap(heightmap);
+				const int64_t build_time = get_tick() - build_tick;
+
+				// what the scene holds, not what its arena reserved up front
+				const size_t scene_bytes = scene->get_arena().num_bytes_used() + scene->num_heightmap_bytes();
+
+				// per-thread rates; the first thread count defines 100%
+				const double build_rate = 1.0 / (build_time * 1e-9 * num_threads);
+
+				if (base_build_rate == 0.0)
+					base_build_rate = build_rate;
+
+				for (size_t weak = 0; weak < 2; weak++) {
+					// weak scaling keeps the rays per thread constant
+					const size_t num_rows = weak? (view_size_y * num_threads / thread_counts[0]): view_size_y;
+
+					fprintf(stderr, "[%s] scene %lu, %lux%lu map, %lu threads, %lux%lu pixels\n", __FUNCTION__, scene_type, map_size, map_size, num_threads, view_size_x, num_rows);
+
+					const t_trace_stats stats = trace_frames(*scene, camera, light_dir, view_size_x, num_rows, view_size_x * 1.0f / view_size_y, num_threads, num_frames);
+
+					const double primary_rate = stats.primary_rate() / num_threads;
+					const double shadow_rate = stats.shadow_rate() / num_threads;
+
+					if (base_primary_rates[weak] == 0.0) {
+						base_primary_rates[weak] = primary_rate;
+						base_shadow_rates[weak] = shadow_rate;
+					}
+
+					fprintf(csv, "%lu,%lu,%s,%lu,%lu,%lu,%g,%lu,", scene_type, map_size, (weak? "weak": "strong"), num_threads, view_size_x, num_rows, build_time * 1e-6, scene_bytes);
+					fprintf(csv, "%lu,%g,%lu,%g,", stats.m_num_primary_rays, stats.primary_rate(), stats.m_num_shadow_rays, stats.shadow_rate());
+					fprintf(csv, "%.3f,%.3f,%.3f,%.3f\n", build_rate / base_build_rate, primary_rate / base_primary_rates[weak], shadow_rate / std::max(base_shadow_rates[weak], 1e-9), stats.m_imbalance);
+					// keep partial sweeps
+					fflush(csv);
+				}
+
+				delete scene;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+
+// builds each scene type (and kd-trees in both split modes) from the same
+// procedural maps; reports the fastest of <repeat> builds, the memory held by
+// the scene (its arena and the process' resident growth) and the peak during
+// the build (incl. temporaries), and the shape of the built tree
+static int run_build_benchmark(const t_benchmark_args& args, FILE* csv) {
+	const size_t max_threads = std::max(size_t(boost::thread::hardware_concurrency()), size_t(1));
+
+	std::vector<size_t> def_map_sizes = {256, 1024, 4096};
+	std::vector<size_t> def_scene_types = {SCENETYPE_LINEAR, SCENETYPE_QUADTREE, SCENETYPE_KDTREE, SCENETYPE_BVH4, SCENETYPE_CONE_STEP};
+
+	const std::vector<size_t> map_sizes = args.get_sizes("sizes", def_map_sizes);
+	const std::vector<size_t> scene_types = args.get_sizes("scenes", def_scene_types);
+
+	const size_t num_threads = std::max(args.get_size("threads", max_threads), size_t(1));
+	const size_t num_repeats = std::max(args.get_size("repeat", 1), size_t(1));
+	const size_t leaf_size = std::max(args.get_size("leaf_size", 1), size_t(1));
+	const float planar_error = std::max(args.get_float("planar_error", 0.0f), 0.0f);
+
+	const t_terrain_generator generator(args.get_size("seed", 1), t_terrain_generator::TERRAIN_TYPE_ERODED);
+
+	if (!reset_peak_resident_bytes())
+		fprintf(stderr, "[%s] can not reset the peak resident size, peak_bytes only grows\n", __FUNCTION__);
+
+	fprintf(csv, "scene,split_mode,leaf_size,planar_error,map_size,threads,build_ms,arena_bytes_used,arena_bytes_reserved,resident_bytes,peak_bytes,");
+	fprintf(csv, "nodes,leaves,max_depth,mean_leaf_depth,leaf_depths\n");
+
+	for (size_t map_size: map_sizes) {
+		t_heightmap heightmap;
+		generator.generate(heightmap, map_size, map_size, map_size * 0.125f, max_threads);
+
+		for (size_t scene_type: scene_types) {
+			const bool kd_tree = (scene_type == SCENETYPE_KDTREE || scene_type == SCENETYPE_TILED_KDTREE);
+
+			for (int split_mode = SPLIT_MODE_EVEN; split_mode <= (kd_tree? SPLIT_MODE_COST: SPLIT_MODE_EVEN); split_mode++) {
+				int64_t build_time = 0;
+
+				size_t resident_bytes = 0;
+				size_t peak_bytes = 0;
+
+				size_t arena_bytes_used = 0;
+				size_t arena_bytes_reserved = 0;
+
+				t_scene_stats stats;
+
+				for (size_t n = 0; n < num_repeats; n++) {
+					t_scene* scene = t_renderer::create_scene(scene_type);
+
+					if (scene == 0)
+						break;
+
+					scene->set_num_build_threads(num_threads);
+					scene->set_split_mode(split_mode);
+					scene->set_leaf_size(leaf_size);
+					scene->set_planar_error(planar_error);
+
+					const size_t base_bytes = get_resident_bytes("VmRSS");
+
+					reset_peak_resident_bytes();
+
+					const int64_t build_tick = get_tick();
+					scene->assign_heightmap(heightmap);
+					const int64_t cur_build_time = get_tick() - build_tick;
+
+					if (n == 0 || cur_build_time < build_time)
+						build_time = cur_build_time;
+
+					// the scene also holds a copy of the heightmap
+					const size_t cur_bytes = get_resident_bytes("VmRSS");
+					const size_t max_bytes = get_resident_bytes("VmHWM");
+
+					resident_bytes = cur_bytes - std::min(base_bytes, cur_bytes);
+					peak_bytes = max_bytes - std::min(base_bytes, max_bytes);
+
+					arena_bytes_used = scene->get_arena().num_bytes_used();
+					arena_bytes_reserved = scene->get_arena().num_bytes_reserved();
+
+					stats = t_scene_stats();
+					scene->get_stats(stats);
+
+					delete scene;
+				}
+
+				size_t max_depth = 0;
+				double sum_depths = 0.0;
+				std::string leaf_depths;
+
+				for (size_t depth = 0; depth < stats.m_leaf_depths.size(); depth++) {
+					if (stats.m_leaf_depths[depth] == 0)
+						continue;
+
+					max_depth = depth;
+					sum_depths += (depth * 1.0 * stats.m_leaf_depths[depth]);
+					leaf_depths += (leaf_depths.empty()? "": ";") + std::to_string(depth) + ":" + std::to_string(stats.m_leaf_depths[depth]);
+				}
+
+				fprintf(stderr, "[%s] scene %lu, split-mode %d, %lux%lu map: %gms\n", __FUNCTION__, scene_type, split_mode, map_size, map_size, build_time * 1e-6);
+
+				fprintf(csv, "%lu,%s,%lu,%g,%lu,%lu,%g,", scene_type, ((split_mode == SPLIT_MODE_COST)? "cost": "even"), leaf_size, planar_error, map_size, num_threads, build_time * 1e-6);
+				fprintf(csv, "%lu,%lu,%lu,%lu,", arena_bytes_used, arena_bytes_reserved, resident_bytes, peak_bytes);
+				fprintf(csv, "%lu,%lu,%lu,%.2f,%s\n", stats.m_num_nodes, stats.m_num_leaves, max_depth, sum_depths / std::max(stats.m_num_leaves, size_t(1)), leaf_depths.c_str());
+				fflush(csv);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+
+// runs func(i) for i in [0, num_ops) <num_repeats> times and returns the
+// fastest pass in ns per op; func returns a value that is summed into
+// <checksum> so the work can not be optimized away
+template<typename t_func>
+static double time_kernel(size_t num_ops, size_t num_repeats, double& checksum, const t_func& func) {
+	int64_t min_time = 0;
+
+	for (size_t n = 0; n < num_repeats; n++) {
+		double sum = 0.0;
+
+		const int64_t tick = get_tick();
+
+		for (size_t i = 0; i < num_ops; i++) {
+			sum += func(i);
+		}
+
+		const int64_t time = get_tick() - tick;
+
+		if (n == 0 || time < min_time)
+			min_time = time;
+
+		checksum = sum;
+	}
+
+	return (min_time / std::max(double(num_ops), 1.0));
+}
+
+// times the innermost routines in isolation, each over a fixed set of
+// <rays=N> inputs (seed=S) and reported as the fastest of <repeat=R> passes
+//
+// "coherent" inputs are the rays of a camera in scan-order, paired with the
+// cells (or nodes) they cross in memory order; "incoherent" ones have random
+// origins and directions, paired with random cells (or nodes)
+static int run_kernel_benchmark(const t_benchmark_args& args, FILE* csv) {
+	typedef t_kdtree_cell_scene_node<t_tri_cell> t_node;
+
+	const size_t num_rays = std::max(args.get_size("rays", 1 << 16), size_t(1));
+	const size_t num_repeats = std::max(args.get_size("repeat", 5), size_t(1));
+	const size_t map_size = 257;
+
+	std::mt19937 rng(args.get_size("seed", 1));
+	std::uniform_real_distribution<float> rnd(0.0f, 1.0f);
+
+	t_heightmap heightmap;
+	t_terrain_generator(1, t_terrain_generator::TERRAIN_TYPE_ERODED).generate(heightmap, map_size, map_size, 32.0f);
+
+	const size_t num_cells_x = map_size - 1;
+	const size_t num_cells = num_cells_x * num_cells_x;
+
+	std::vector<t_tri_cell> cells(num_cells);
+	std::vector<t_node> nodes;
+
+	for (size_t n = 0; n < num_cells; n++) {
+		cells[n].set_from_heightmap(heightmap, n % num_cells_x, n / num_cells_x);
+	}
+
+	nodes.reserve(num_cells * 2 - 1);
+	t_node::create_from_heightmap(nodes, &cells[0], num_cells_x, heightmap, 0, num_cells_x, 0, num_cells_x);
+
+	std::vector<size_t> inner_nodes;
+
+	for (size_t n = 0; n < nodes.size(); n++) {
+		if (!nodes[n].is_leaf()) {
+			inner_nodes.push_back(n);
+		}
+	}
+
+	fprintf(csv, "kernel,distribution,ops,ns_per_op,checksum\n");
+
+	const auto report = [&](const char* kernel, const char* distribution, size_t num_ops, double ns_per_op, double checksum) {
+		fprintf(csv, "%s,%s,%lu,%.3f,%g\n", kernel, distribution, num_ops, ns_per_op, checksum);
+		fflush(csv);
+	};
+
+	for (int coherent = 1; coherent >= 0; coherent--) {
+		const char* distribution = coherent? "coherent": "incoherent";
+
+		// a ray, its (slope) equivalent, and the cell, node and map position it is paired with
+		std::vector<t_ray> rays(num_rays);
+		std::vector<t_ray> slope_rays(num_rays);
+		std::vector<uint32_t> cell_indices(num_rays);
+		std::vector<uint32_t> node_indices(num_rays);
+		std::vector<t_vector> positions(num_rays);
+
+		const t_vector cam_pos = t_vector(-16.0f, -16.0f, 64.0f);
+
+		for (size_t i = 0; i < num_rays; i++) {
+			const size_t cell = coherent? (i % num_cells): (rng() % num_cells);
+			const float cx = (cell % num_cells_x) + rnd(rng);
+			const float cy = (cell / num_cells_x) + rnd(rng);
+
+			const t_vector target = t_vector(cx, cy, heightmap.at(cx, cy));
+			const t_vector origin = coherent? cam_pos: t_vector(rnd(rng) * num_cells_x, rnd(rng) * num_cells_x, 40.0f + rnd(rng) * 64.0f);
+
+			t_vector dir = (target - origin).normalize_xyz();
+
+			rays[i] = t_ray(origin, dir);
+			slope_rays[i] = t_ray(origin, dir / dir.magnitude_xy());
+			cell_indices[i] = cell;
+			node_indices[i] = coherent? inner_nodes[i % inner_nodes.size()]: inner_nodes[rng() % inner_nodes.size()];
+			positions[i] = target;
+		}
+
+		double checksum = 0.0;
+		double ns_per_op = 0.0;
+
+		ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+			return (cells[cell_indices[i]].trace_ray(rays[i], cell_indices[i]).time());
+		});
+		report("t_tri_cell::trace_ray", distribution, num_rays, ns_per_op, checksum);
+
+		ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+			return (cells[cell_indices[i]].trace_slope_ray(slope_rays[i], cell_indices[i]).time());
+		});
+		report("t_tri_cell::trace_slope_ray", distribution, num_rays, ns_per_op, checksum);
+
+		ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+			float tmin = 0.0f;
+			float tmax = 0.0f;
+
+			return (rays[i].time_in_rect(tmin, tmax, 0, num_cells_x, 0, num_cells_x)? (tmax - tmin): 0.0f);
+		});
+		report("t_ray::time_in_rect", distribution, num_rays, ns_per_op, checksum);
+
+		ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+			const t_node* min_child = 0;
+			const t_node* max_child = 0;
+			float t_split = 0.0f;
+
+			nodes[node_indices[i]].find_split(rays[i], min_child, max_child, t_split);
+			return (t_split + (min_child - max_child));
+		});
+		report("t_kdtree_cell_scene_node::find_split", distribution, num_rays, ns_per_op, checksum);
+
+		ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+			return (t_tri_cell::shading_normal(heightmap, positions[i]).z());
+		});
+		report("t_tri_cell::shading_normal", distribution, num_rays, ns_per_op, checksum);
+
+		// whole traversals from the root, divided by the nodes they visit
+		t_trace_counters counters;
+
+		for (size_t i = 0; i < num_rays; i++) {
+			float tmin = 0.0f;
+			float tmax = 0.0f;
+
+			if (rays[i].time_in_rect(tmin, tmax, 0, num_cells_x, 0, num_cells_x)) {
+				nodes[0].trace_ray(count_cells(t_cell_grid<t_tri_cell>(&cells[0], num_cells_x), counters), 0, rays[i], tmin, tmax, std::min(rays[i].point(tmin).z(), rays[i].point(tmax).z()));
+			}
+		}
+
+		const size_t num_visits = counters.m_num_nodes;
+
+		ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+			float tmin = 0.0f;
+			float tmax = 0.0f;
+
+			if (!rays[i].time_in_rect(tmin, tmax, 0, num_cells_x, 0, num_cells_x))
+				return 0.0f;
+
+			return (nodes[0].trace_ray(t_cell_grid<t_tri_cell>(&cells[0], num_cells_x), 0, rays[i], tmin, tmax, std::min(rays[i].point(tmin).z(), rays[i].point(tmax).z())).time());
+		});
+		report("t_kdtree_cell_scene_node::trace_ray", distribution, num_visits, ns_per_op * num_rays / std::max(num_visits, size_t(1)), checksum);
+
+		ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+			float tmin = 0.0f;
+			float tmax = 0.0f;
+
+			if (!rays[i].time_in_rect(tmin, tmax, 0, num_cells_x, 0, num_cells_x))
+				return 0.0f;
+
+			return (nodes[0].trace_ray_stack(t_cell_grid<t_tri_cell>(&cells[0], num_cells_x), 0, rays[i], tmin, tmax, std::min(rays[i].point(tmin).z(), rays[i].point(tmax).z())).time());
+		});
+		report("t_kdtree_cell_scene_node::trace_ray_stack", distribution, num_visits, ns_per_op * num_rays / std::max(num_visits, size_t(1)), checksum);
+	}
+
+	// inputs of the vector kernels are always random
+	std::vector<t_vector> vectors(num_rays);
+	std::vector<float> angles(num_rays);
+
+	for (size_t i = 0; i < num_rays; i++) {
+		vectors[i] = t_vector(rnd(rng) - 0.5f, rnd(rng) - 0.5f, rnd(rng) - 0.5f);
+		angles[i] = rnd(rng) * 6.2831853f;
+	}
+
+	double checksum = 0.0;
+	double ns_per_op = 0.0;
+
+	ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+		t_vector v = vectors[i];
+		return (v.normalize_xyz().x());
+	});
+	report("t_vector::normalize_xyz", "random", num_rays, ns_per_op, checksum);
+
+	ns_per_op = time_kernel(num_rays, num_repeats, checksum, [&](size_t i) {
+		t_vector v = vectors[i];
+		return (v.rotate_z(angles[i]).x());
+	});
+	report("t_vector::rotate_z", "random", num_rays, ns_per_op, checksum);
+
+	return 0;
+}
+
+
+
+// renders the per-pixel cost of one view (like the renderer's heatmap mode)
+// of a procedural map of size=N for every metric in metrics=nodes,cells,...
+// and scene=S (SCENETYPE_*, kd-trees and BVHs with leaves of up to leaf_size=N
+// cells per side, kd-trees with planar leaves within planar_error=E), saving each as
+// <image>_<metric>.png if image= is given; reports the distribution of the
+// costs over the pixels
+static int run_heatmap_benchmark(const t_benchmark_args& args, FILE* csv) {
+	const size_t max_threads = std::max(size_t(boost::thread::hardware_concurrency()), size_t(1));
+	const size_t num_threads = std::max(args.get_size("threads", max_threads), size_t(1));
+
+	const size_t scene_type = args.get_size("scene", SCENETYPE_KDTREE);
+	const size_t map_size = args.get_size("size", 1024);
+	const size_t leaf_size = std::max(args.get_size("leaf_size", 1), size_t(1));
+	const float planar_error = std::max(args.get_float("planar_error", 0.0f), 0.0f);
+	const size_t view_size_x = args.get_size("view_x", 512);
+	const size_t view_size_y = args.get_size("view_y", 384);
+
+	const std::string image_name = args.get_string("image", "");
+	const std::string metric_names = args.get_string("metrics", "nodes,cells,shadow,time");
+
+	const t_terrain_generator generator(args.get_size("seed", 1), t_terrain_generator::TERRAIN_TYPE_ERODED);
+	const t_vector light_dir = t_vector(1.0f, 0.5f, 1.0f).normalize_xyz();
+
+	t_heightmap heightmap;
+	generator.generate(heightmap, map_size, map_size, map_size * 0.125f, max_threads);
+
+	t_scene* scene = t_renderer::create_scene(scene_type);
+
+	if (scene == 0) {
+		fprintf(stderr, "[%s] unknown scene type %lu\n", __FUNCTION__, scene_type);
+		return 1;
+	}
+
+	scene->set_num_build_threads(num_threads);
+	scene->set_leaf_size(leaf_size);
+	scene->set_planar_error(planar_error);
+	scene->assign_light_source(new t_directional_light(light_dir, t_color(1.0f, 1.0f, 1.0f)));
+	scene->assign_heightmap(heightmap);
+
+	// same view as the scaling benchmark
+	t_camera camera;
+
+	camera.pos() = t_vector(map_size * 0.05f, map_size * 0.05f, map_size * 0.2f);
+	camera.fov() = M_PI / 3.0f;
+	camera.update(t_vector(1.0f, 1.0f, -0.4f).normalize_xyz());
+
+	const float fscale = camera.get_fov_scale();
+	const float aspect = view_size_x * 1.0f / view_size_y;
+
+	t_cost_map cost_map;
+	cost_map.resize(view_size_x, view_size_y);
+
+	fprintf(csv, "scene,map_size,leaf_size,planar_error,metric,view_x,view_y,mean,p50,p90,p99,max,image\n");
+
+	for (const char* s = metric_names.c_str(); *s != 0; ) {
+		const char* end = strchr(s, ',');
+		const std::string name = (end != 0)? std::string(s, end - s): std::string(s);
+
+		s = (end != 0)? (end + 1): (s + name.size());
+
+		const int metric = t_cost_map::parse_metric(name.c_str());
+
+		if (metric < 0) {
+			fprintf(stderr, "[%s] ignoring unknown metric \"%s\"\n", __FUNCTION__, name.c_str());
+			continue;
+		}
+
+		cost_map.set_metric(metric);
+
+		for_each_band(view_size_y, num_threads, [&](size_t ymin, size_t ymax) {
+			for (size_t y = ymin; y < ymax; y++) {
+				for (size_t x = 0; x < view_size_x; x++) {
+					const t_vector pxl_ray_dir = camera.get_pixel_dir(x, y, fscale, view_size_x, view_size_y, aspect);
+
+					cost_map.trace_pixel(*scene, x, y, t_ray(camera.pos(), pxl_ray_dir));
+				}
+			}
+		});
+
+		double sum_cost = 0.0;
+		float max_cost = 0.0f;
+
+		for (size_t y = 0; y < view_size_y; y++) {
+			for (size_t x = 0; x < view_size_x; x++) {
+				sum_cost += cost_map.get_cost(x, y);
+				max_cost = std::max(max_cost, cost_map.get_cost(x, y));
+			}
+		}
+
+		std::string file_name;
+
+		if (!image_name.empty()) {
+			file_name = image_name + "_" + name + ".png";
+
+			if (!cost_map.write_image(file_name.c_str(), cost_map.get_scale()))
+				file_name.clear();
+		}
+
+		fprintf(csv, "%lu,%lu,%lu,%g,%s,%lu,%lu,", scene_type, map_size, leaf_size, planar_error, name.c_str(), view_size_x, view_size_y);
+		fprintf(csv, "%g,%g,%g,%g,%g,%s\n", sum_cost / (view_size_x * view_size_y), cost_map.get_scale(50), cost_map.get_scale(90), cost_map.get_scale(99), max_cost, file_name.c_str());
+		fflush(csv);
+	}
+
+	delete scene;
+	return 0;
+}
+
+
+
+// compares every t_sample_layout for the heightmap (of a procedural map of
+// size=N) and for the image-chunks (of view_x by view_y pixels); each row is
+// the fastest of repeat=R passes in ns per op, and the cache misses per op
+// over all passes (-1 if they can not be counted)
+//
+//   map, quads-walk:   the four corners of the cells along random walks, as
+//                      cells are rebuilt along a ray's path
+//   map, quads-random: the same for cells picked at random
+//   map, build:        a (compact, cost-split) kd-tree scene, per cell
+//   map, trace:        a single-threaded frame of that scene, per pixel;
+//                      compact scenes read the heightmap for every cell
+//   image, rows:       packing the pixels of every chunk row by row, the
+//                      order of the ray-tracer
+//   image, columns:    the same column by column, the order of the column-
+//                      tracers
+//   image, present:    copying every chunk into the (row-major) image
+static int run_layout_benchmark(const t_benchmark_args& args, FILE* csv) {
+	const size_t map_size = std::max(args.get_size("size", 2049), size_t(2));
+	const size_t view_size_x = std::max(args.get_size("view_x", 1024), size_t(1));
+	const size_t view_size_y = std::max(args.get_size("view_y", 768), size_t(1));
+	const size_t chunk_size = std::max(args.get_size("chunk_size", 32), size_t(1));
+	const size_t num_ops = std::max(args.get_size("ops", 1 << 20), size_t(1));
+	const size_t num_repeats = std::max(args.get_size("repeat", 5), size_t(1));
+
+	std::mt19937 rng(args.get_size("seed", 1));
+
+	const t_terrain_generator generator(args.get_size("seed", 1), t_terrain_generator::TERRAIN_TYPE_ERODED);
+	const t_vector light_dir = t_vector(1.0f, 0.5f, 1.0f).normalize_xyz();
+
+	t_heightmap source;
+	generator.generate(source, map_size, map_size, map_size * 0.125f);
+
+	const size_t num_cells_x = map_size - 1;
+
+	// lower-left corners of the cells
+	std::vector<uint32_t> walk_cells(num_ops);
+	std::vector<uint32_t> random_cells(num_ops);
+
+	for (size_t i = 0, x = 0, y = 0; i < num_ops; i++) {
+		// restart now and then, so walks cover the map
+		if ((i % 1024) == 0) {
+			x = rng() % num_cells_x;
+			y = rng() % num_cells_x;
+		}
+
+		switch (rng() % 4) {
+			case 0: { x = std::min(x + 1, num_cells_x - 1); } break;
+			case 1: { x = (x > 0)? (x - 1): x; } break;
+			case 2: { y = std::min(y + 1, num_cells_x - 1); } break;
+			case 3: { y = (y > 0)? (y - 1): y; } break;
+		}
+
+		walk_cells[i] = y * num_cells_x + x;
+		random_cells[i] = rng() % (num_cells_x * num_cells_x);
+	}
+
+	t_camera camera;
+
+	camera.pos() = t_vector(map_size * 0.05f, map_size * 0.05f, map_size * 0.2f);
+	camera.fov() = M_PI / 3.0f;
+	camera.update(t_vector(1.0f, 1.0f, -0.4f).normalize_xyz());
+	camera.set_image_size(view_size_x, view_size_y);
+
+	t_cache_miss_counter counter;
+
+	fprintf(csv, "target,layout,pattern,ops,ns_per_op,misses_per_op,checksum\n");
+
+	// <num_misses> were counted over <num_passes> passes of <ops> ops
+	const auto report = [&](const char* target, int layout, const char* pattern, size_t ops, size_t num_passes, double ns_per_op, int64_t num_misses, double checksum) {
+		const double misses_per_op = (num_misses < 0)? -1.0: (num_misses / std::max(double(ops * num_passes), 1.0));
+
+		fprintf(csv, "%s,%s,%s,%lu,%.3f,%.4f,%g\n", target, t_sample_layout::get_type_name(layout), pattern, ops, ns_per_op, misses_per_op, checksum);
+		fflush(csv);
+	};
+
+	for (int layout = 0; layout < t_sample_layout::LAYOUT_COUNT; layout++) {
+		t_heightmap heightmap = source;
+		heightmap.set_layout(layout);
+
+		double checksum = 0.0;
+		double ns_per_op = 0.0;
+
+		const auto sum_quad = [&](uint32_t cell) {
+			const size_t x = cell % num_cells_x;
+			const size_t y = cell / num_cells_x;
+
+			return (heightmap.at(x, y) + heightmap.at(x + 1, y) + heightmap.at(x, y + 1) + heightmap.at(x + 1, y + 1));
+		};
+
+		counter.start();
+		ns_per_op = time_kernel(num_ops, num_repeats, checksum, [&](size_t i) { return sum_quad(walk_cells[i]); });
+		report("map", layout, "quads-walk", num_ops, num_repeats, ns_per_op, counter.stop(), checksum);
+
+		counter.start();
+		ns_per_op = time_kernel(num_ops, num_repeats, checksum, [&](size_t i) { return sum_quad(random_cells[i]); });
+		report("map", layout, "quads-random", num_ops, num_repeats, ns_per_op, counter.stop(), checksum);
+
+		t_scene* scene = t_renderer::create_scene(SCENETYPE_KDTREE);
+
+		scene->set_compact_heights(true);
+		scene->set_split_mode(SPLIT_MODE_COST);
+		scene->set_heightmap_layout(layout);
+		scene->assign_light_source(new t_directional_light(light_dir, t_color(1.0f, 1.0f, 1.0f)));
+
+		counter.start();
+		const int64_t build_tick = get_tick();
+		scene->assign_heightmap(source);
+		const int64_t build_time = get_tick() - build_tick;
+		report("map", layout, "build", num_cells_x * num_cells_x, 1, build_time / double(num_cells_x * num_cells_x), counter.stop(), 0.0);
+
+		counter.start();
+		const t_trace_stats stats = trace_frames(*scene, camera, light_dir, view_size_x, view_size_y, view_size_x * 1.0f / view_size_y, 1, num_repeats);
+		// the counter also saw the warm-up frame
+		report("map", layout, "trace", stats.m_num_primary_rays / num_repeats, num_repeats + 1, (stats.m_primary_time + stats.m_shadow_time) / std::max(double(stats.m_num_primary_rays), 1.0), counter.stop(), stats.m_num_shadow_rays);
+
+		delete scene;
+	}
+
+	for (int layout = 0; layout < t_sample_layout::LAYOUT_COUNT; layout++) {
+		std::vector<t_image_chunk> chunks;
+		std::vector<uint32_t> pixels;
+
+		size_t num_pixels = 0;
+
+		for (size_t x = 0; x < view_size_x; x += chunk_size) {
+			chunks.push_back(t_image_chunk(x, std::min(x + chunk_size, view_size_x), 0, view_size_y, static_cast<uint32_t*>(0), layout));
+			num_pixels += chunks.back().num_pixels();
+		}
+
+		pixels.resize(num_pixels);
+
+		for (size_t n = 0, offset = 0; n < chunks.size(); n++) {
+			chunks[n].m_pixels = &pixels[offset];
+			offset += chunks[n].num_pixels();
+		}
+
+		const size_t num_image_pixels = view_size_x * view_size_y;
+
+		double checksum = 0.0;
+		double ns_per_op = 0.0;
+
+		// one op is a whole frame here, reported per pixel; the checksum keeps
+		// the writes from being optimized away
+		counter.start();
+		ns_per_op = time_kernel(1, num_repeats, checksum, [&](size_t) {
+			for (size_t n = 0; n < chunks.size(); n++) {
+				for (size_t y = chunks[n].m_ymin; y < chunks[n].m_ymax; y++) {
+					for (size_t x = chunks[n].m_xmin; x < chunks[n].m_xmax; x++) {
+						chunks[n].set_pixel(x, y, uint32_t(x ^ y));
+					}
+				}
+			}
+
+			return double(pixels[0]);
+		});
+		report("image", layout, "rows", num_image_pixels, num_repeats, ns_per_op / num_image_pixels, counter.stop(), checksum);
+
+		counter.start();
+		ns_per_op = time_kernel(1, num_repeats, checksum, [&](size_t) {
+			for (size_t n = 0; n < chunks.size(); n++) {
+				for (size_t x = chunks[n].m_xmin; x < chunks[n].m_xmax; x++) {
+					for (size_t y = chunks[n].m_ymin; y < chunks[n].m_ymax; y++) {
+						chunks[n].set_pixel(x, y, uint32_t(x + y));
+					}
+				}
+			}
+
+			return double(pixels[0]);
+		});
+		report("image", layout, "columns", num_image_pixels, num_repeats, ns_per_op / num_image_pixels, counter.stop(), checksum);
+
+		counter.start();
+		ns_per_op = time_kernel(1, num_repeats, checksum, [&](size_t) {
+			for (size_t n = 0; n < chunks.size(); n++) {
+				camera.set_image_chunk(chunks[n]);
+			}
+
+			return double(camera.get_image_pixel(view_size_x - 1, view_size_y - 1));
+		});
+		report("image", layout, "present", num_image_pixels, num_repeats, ns_per_op / num_image_pixels, counter.stop(), checksum);
+	}
+
+	return 0;
+}
+
+
+
+int run_benchmark(int argc, char** argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s --benchmark <scaling|build|kernels|heatmap|layout> [key=value ...]\n", argv[0]);
+		return 1;
+	}
+
+	const std::string mode = argv[2];
+	const t_benchmark_args args(argc - 3, argv + 3);
+	const std::string out_name = args.get_string("out", "");
+
+	FILE* csv = out_name.empty()? stdout: fopen(out_name.c_str(), "w");
+
+	if (csv == 0) {
+		fprintf(stderr, "[%s] failed to create %s\n", __FUNCTION__, out_name.c_str());
+		return 1;
+	}
+
+	int ret = 1;
+
+	if (mode == "scaling") {
+		ret = run_scaling_benchmark(args, csv);
+	} else if (mode == "build") {
+		ret = run_build_benchmark(args, csv);
+	} else if (mode == "kernels") {
+		ret = run_kernel_benchmark(args, csv);
+	} else if (mode == "heatmap") {
+		ret = run_heatmap_benchmark(args, csv);
+	} else if (mode == "layout") {
+		ret = run_layout_benchmark(args, csv);
+	} else {
+		fprintf(stderr, "[%s] unknown benchmark \"%s\"\n", __FUNCTION__, mode.c_str());
+	}
+
+	if (csv != stdout)
+		fclose(csv);
+
+	return ret;
+}
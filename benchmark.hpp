@@ -0,0 +1,34 @@
+#pragma once
+
+// headless benchmark modes, run as "prayground --benchmark <mode> [key=value ...]"
+// and writing one CSV row per measured point (to stdout unless out=<file>)
+//
+//   scaling: sweeps procedural maps of every size in sizes=256,1024,...
+//            over each of threads=1,2,4,... and scenes=0,1,2,4,5 (SCENETYPE_*);
+//            records build-time, scene memory, primary and shadow rays/s
+//            and the parallel efficiency relative to the first thread count,
+//            both for a fixed image (strong) and for an image that grows
+//            with the number of threads (weak); see run_scaling_benchmark
+//
+//   build:   builds every scene type (kd-trees with even and cost splits)
+//            from the same maps with threads=N, kd-tree and BVH leaves of up
+//            to leaf_size=N cells per side and planar leaves within planar_error=E;
+//            records build-time, arena, resident and peak bytes, node and leaf
+//            counts and the depth histogram of the leaves; see run_build_benchmark
+//
+//   kernels: ns/op of the innermost routines (cell and kd-node tests,
+//            time_in_rect, shading_normal, vector ops) on fixed-seed
+//            coherent and incoherent inputs; see run_kernel_benchmark
+//
+//   heatmap: per-pixel cost (metrics=nodes,cells,shadow,time) of one view of
+//            a procedural map for scene=S; records the mean and percentiles
+//            of each and saves it as a heat-ramp image if image=<prefix>;
+//            see run_heatmap_benchmark
+//
+//   layout:  linear, blocked and Z-order (t_sample_layout) heightmaps and
+//            image-chunks under the access patterns of the builders, the
+//            tracers and the present step; records ns/op and cache misses
+//            per op; see run_layout_benchmark
+//
+// takes the full command-line, returns the process exit code
+int run_benchmark(int argc, char** argv);
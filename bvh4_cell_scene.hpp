@@ -0,0 +1,636 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cell.hpp"
+#include "ray.hpp"
+#include "ray_intersection.hpp"
+#include "heightmap.hpp"
+#include "parallel.hpp"
+#include "scene.hpp"
+#include "scene_cache.hpp"
+
+// node of a 4-ary bounding volume hierarchy over blocks of cells: the boxes
+// of all four children are stored side by side (one row per bound) so a ray
+// tests them together, with one SIMD operation per bound where supported
+//
+// children are either inner nodes or leaves over a block of cells; unlike a
+// kd-tree node, every box also bounds its children in z, so one test prunes
+// a child both on its footprint and on its height range
+//
+template <class t_cell_type>
+class alignas(16) t_bvh4_cell_scene_node {
+public:
+	enum {
+		BOUND_XMIN = 0,
+		BOUND_XMAX = 1,
+		BOUND_YMIN = 2,
+		BOUND_YMAX = 3,
+		BOUND_ZMIN = 4,
+		BOUND_ZMAX = 5,
+		BOUND_COUNT = 6,
+	};
+
+	// references to children; a leaf is LEAF_BIT plus the index of its
+	// lower-left cell, an inner node is its offset from the parent
+	static const uint32_t LEAF_BIT = uint32_t(1) << 31;
+	static const uint32_t EMPTY_CHILD = 0;
+
+	t_bvh4_cell_scene_node() {
+		// empty slots have inverted boxes which no ray ever enters
+		for (size_t i = 0; i < 4; i++) {
+			set_child(i, EMPTY_CHILD, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX);
+		}
+	}
+
+	// traces a ray into the scene; returns the intersection
+	//
+	// <cells> is what the leaves index, a t_cell_grid or a stand-in such as
+	// t_heightmap_cells that rebuilds the cells on the fly; the children of
+	// each node are visited in order of where <ray> enters them, and as they
+	// do not overlap (in x and y) the first leaf hit has the nearest hit
+	template<typename t_cell_array>
+	t_ray_hit trace_ray(const t_cell_array& cells, t_const_ray ray, float tmin, float tmax) const {
+		const t_ray_consts consts(ray);
+
+		t_stack_entry stack[MAX_STACK_DEPTH];
+		size_t depth = 0;
+
+		t_stack_entry entry(0, tmin, tmax, 0, 0);
+
+		for (;;) {
+			if ((entry.m_ref & LEAF_BIT) != 0) {
+				const size_t idx = entry.m_ref & ~LEAF_BIT;
+				const t_ray_hit result = trace_cell_block(cells, idx % cells.xsize(), idx / cells.xsize(), entry.m_xsize, entry.m_ysize, ray, entry.m_tmin, entry.m_tmax);
+
+				if (result.valid())
+					return result;
+				if (depth == 0)
+					break;
+
+				entry = stack[--depth];
+				continue;
+			}
+
+			const t_bvh4_cell_scene_node<t_cell_type>& node = this[entry.m_ref];
+
+			count_node_visit(cells);
+
+			float t0[4];
+			float t1[4];
+
+			const uint32_t mask = node.intersect_children(consts, entry.m_tmin, entry.m_tmax, 0.0f, t0, t1);
+
+			if (mask == 0) {
+				if (depth == 0)
+					break;
+
+				entry = stack[--depth];
+				continue;
+			}
+
+			// sort the children far-to-near, push all but the nearest and
+			// continue with that one
+			uint32_t order[4];
+			size_t num_hits = 0;
+
+			for (uint32_t i = 0; i < 4; i++) {
+				if ((mask & (1u << i)) == 0)
+					continue;
+
+				size_t n = num_hits++;
+
+				for (; n > 0 && t0[order[n - 1]] < t0[i]; n--) {
+					order[n] = order[n - 1];
+				}
+
+				order[n] = i;
+			}
+
+			for (size_t n = 0; n < (num_hits - 1); n++) {
+				stack[depth++] = node.get_stack_entry(order[n], entry.m_ref, t0[order[n]], t1[order[n]]);
+			}
+
+			entry = node.get_stack_entry(order[num_hits - 1], entry.m_ref, t0[order[num_hits - 1]], t1[order[num_hits - 1]]);
+		}
+
+		return (t_ray_hit());
+	}
+
+	// traces a shadow ray; returns true iff there is a collision
+	//
+	// children are visited in any order; one that the ray passes entirely
+	// below (within its box) blocks it without testing any cells, one that
+	// the ray passes entirely above is skipped
+	template<typename t_cell_array>
+	bool trace_shadow_ray(const t_cell_array& cells, t_const_ray ray, float tmin, float tmax) const {
+		const t_ray_consts consts(ray);
+
+		uint32_t stack[MAX_STACK_DEPTH];
+		size_t depth = 0;
+
+		stack[depth++] = 0;
+
+		while (depth > 0) {
+			const uint32_t ref = stack[--depth];
+			const t_bvh4_cell_scene_node<t_cell_type>& node = this[ref];
+
+			count_node_visit(cells);
+
+			float t0[4];
+			float t1[4];
+
+			uint32_t below = 0;
+			const uint32_t mask = node.intersect_children(consts, tmin, tmax, RAY_TEST_EPSILON, t0, t1, &below);
+
+			if (below != 0)
+				return true;
+
+			for (uint32_t i = 0; i < 4; i++) {
+				if ((mask & (1u << i)) == 0)
+					continue;
+
+				if ((node.m_children[i] & LEAF_BIT) == 0) {
+					stack[depth++] = ref + node.m_children[i];
+					continue;
+				}
+
+				const size_t idx = node.m_children[i] & ~LEAF_BIT;
+
+				if (trace_shadow_cell_block(cells, idx % cells.xsize(), idx / cells.xsize(), node.child_xsize(i), node.child_ysize(i), ray, t0[i], t1[i]))
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+
+	// appends the node over the cells [xmin, xmax) x [ymin, ymax) and all
+	// of its subtrees to <nodes> and fills the cells of its leaves (unless
+	// <cells> is null); the node splits its block at the middle of each side
+	// longer than <leaf_size>, and children within it in both sides become
+	// leaves
+	static void create_from_heightmap(
+		std::vector< t_bvh4_cell_scene_node<t_cell_type> >& nodes,
+		t_cell_type* cells,
+		size_t cells_xsize,
+		const t_heightmap& heightmap,
+		size_t xmin,
+		size_t xmax,
+		size_t ymin,
+		size_t ymax,
+		size_t leaf_size,
+		size_t num_tasks = 1
+	) {
+		const size_t idx = nodes.size();
+
+		nodes.push_back(t_bvh4_cell_scene_node<t_cell_type>());
+
+		leaf_size = std::min(leaf_size, size_t(MAX_LEAF_SIZE));
+
+		const size_t xmid = ((xmax - xmin) > leaf_size)? ((xmin + xmax) / 2): xmax;
+		const size_t ymid = ((ymax - ymin) > leaf_size)? ((ymin + ymax) / 2): ymax;
+
+		const size_t xs[3] = {xmin, xmid, xmax};
+		const size_t ys[3] = {ymin, ymid, ymax};
+
+		// child rectangles {xmin, xmax, ymin, ymax}
+		size_t rects[4][4];
+		size_t num_children = 0;
+
+		for (size_t j = 0; j < 2; j++) {
+			for (size_t i = 0; i < 2; i++) {
+				if (xs[i] == xs[i + 1] || ys[j] == ys[j + 1])
+					continue;
+
+				rects[num_children][0] = xs[i];
+				rects[num_children][1] = xs[i + 1];
+				rects[num_children][2] = ys[j];
+				rects[num_children][3] = ys[j + 1];
+				num_children++;
+			}
+		}
+
+		const auto is_leaf_rect = [&](const size_t rect[4]) {
+			return ((rect[1] - rect[0]) <= leaf_size && (rect[3] - rect[2]) <= leaf_size);
+		};
+
+		uint32_t refs[4];
+		float heights[4][2];
+
+		for (size_t i = 0; i < num_children; i++) {
+			if (is_leaf_rect(rects[i])) {
+				refs[i] = create_leaf(cells, cells_xsize, heightmap, rects[i], heights[i]);
+			}
+		}
+
+		// subtrees below this size are not worth a thread
+		if (num_tasks > 1 && ((xmax - xmin) * (ymax - ymin)) >= MIN_PARALLEL_BUILD_CELLS) {
+			std::vector< t_bvh4_cell_scene_node<t_cell_type> > sub_trees[4];
+
+			fork_join(num_children, num_tasks, [&](size_t i, size_t num_sub_tasks) {
+				if (!is_leaf_rect(rects[i])) {
+					sub_trees[i].reserve(num_subtree_nodes(rects[i], leaf_size));
+					create_from_heightmap(sub_trees[i], cells, cells_xsize, heightmap, rects[i][0], rects[i][1], rects[i][2], rects[i][3], leaf_size, num_sub_tasks);
+				}
+			});
+
+			for (size_t i = 0; i < num_children; i++) {
+				if (!is_leaf_rect(rects[i])) {
+					refs[i] = nodes.size() - idx;
+					nodes.insert(nodes.end(), sub_trees[i].begin(), sub_trees[i].end());
+				}
+			}
+		} else {
+			for (size_t i = 0; i < num_children; i++) {
+				if (!is_leaf_rect(rects[i])) {
+					refs[i] = nodes.size() - idx;
+					create_from_heightmap(nodes, cells, cells_xsize, heightmap, rects[i][0], rects[i][1], rects[i][2], rects[i][3], leaf_size);
+				}
+			}
+		}
+
+		for (size_t i = 0; i < num_children; i++) {
+			if (!is_leaf_rect(rects[i])) {
+				nodes[idx + refs[i]].get_height_range(heights[i][0], heights[i][1]);
+			}
+
+			nodes[idx].set_child(i, refs[i], rects[i][0], rects[i][1], rects[i][2], rects[i][3], heights[i][0], heights[i][1]);
+		}
+	}
+
+	// a subtree with n leaves has about n/3 inner nodes (exact for a
+	// power-of-two block)
+	static size_t num_subtree_nodes(const size_t rect[4], size_t leaf_size = 1) {
+		const size_t num_leaves_x = (rect[1] - rect[0] + leaf_size - 1) / leaf_size;
+		const size_t num_leaves_y = (rect[3] - rect[2] + leaf_size - 1) / leaf_size;
+		return ((num_leaves_x * num_leaves_y + 2) / 3);
+	}
+
+	uint32_t get_child(size_t i) const { return m_children[i]; }
+
+	bool is_empty_child(size_t i) const { return (m_children[i] == EMPTY_CHILD); }
+	bool is_leaf_child(size_t i) const { return ((m_children[i] & LEAF_BIT) != 0); }
+
+	// size in cells of child <i>
+	size_t child_xsize(size_t i) const { return (m_bounds[BOUND_XMAX][i] - m_bounds[BOUND_XMIN][i]); }
+	size_t child_ysize(size_t i) const { return (m_bounds[BOUND_YMAX][i] - m_bounds[BOUND_YMIN][i]); }
+
+	void get_height_range(float& min_height, float& max_height) const {
+		min_height = std::min(std::min(m_bounds[BOUND_ZMIN][0], m_bounds[BOUND_ZMIN][1]), std::min(m_bounds[BOUND_ZMIN][2], m_bounds[BOUND_ZMIN][3]));
+		max_height = std::max(std::max(m_bounds[BOUND_ZMAX][0], m_bounds[BOUND_ZMAX][1]), std::max(m_bounds[BOUND_ZMAX][2], m_bounds[BOUND_ZMAX][3]));
+	}
+
+private:
+	// per-ray constants of the box tests; zero direction components are
+	// replaced by tiny ones so no test ever computes 0 * inf
+	struct t_ray_consts {
+	public:
+		t_ray_consts(t_const_ray ray) {
+			const float dirs[3] = {ray.dir().x(), ray.dir().y(), ray.dir().z()};
+
+			for (size_t n = 0; n < 3; n++) {
+				const float dir = (std::fabs(dirs[n]) < 1e-20f)? 1e-20f: dirs[n];
+
+				m_inv_dir[n] = 1.0f / dir;
+				m_near[n] = (dir > 0.0f)? (BOUND_XMIN + n * 2): (BOUND_XMAX + n * 2);
+			}
+
+			m_pos[0] = ray.pos().x();
+			m_pos[1] = ray.pos().y();
+			m_pos[2] = ray.pos().z();
+			m_dir_z = ray.dir().z();
+		}
+
+		float m_pos[3];
+		float m_inv_dir[3];
+		float m_dir_z;
+
+		// row of the bound each axis enters the boxes through (the
+		// exit is the other one of its pair)
+		size_t m_near[3];
+	};
+
+	// a node or leaf left for later by trace_ray; leaves keep their size,
+	// nodes are referenced from the root
+	struct t_stack_entry {
+	public:
+		t_stack_entry() {}
+		t_stack_entry(uint32_t ref, float tmin, float tmax, uint32_t xsize, uint32_t ysize) {
+			m_ref = ref;
+			m_tmin = tmin;
+			m_tmax = tmax;
+			m_xsize = xsize;
+			m_ysize = ysize;
+		}
+
+		uint32_t m_ref;
+
+		float m_tmin;
+		float m_tmax;
+
+		uint32_t m_xsize;
+		uint32_t m_ysize;
+	};
+
+	t_stack_entry get_stack_entry(size_t i, uint32_t ref, float tmin, float tmax) const {
+		if (is_leaf_child(i))
+			return (t_stack_entry(m_children[i], tmin, tmax, child_xsize(i), child_ysize(i)));
+
+		return (t_stack_entry(ref + m_children[i], tmin, tmax, 0, 0));
+	}
+
+	// tests the segment [tmin, tmax] of the ray against all four children;
+	// returns the mask of those whose footprint it crosses (over [t0, t1])
+	// not entirely above their top minus <epsilon>, and sets <below> to the
+	// mask of those it crosses entirely below their bottom plus <epsilon>
+	uint32_t intersect_children(const t_ray_consts& consts, float tmin, float tmax, float epsilon, float t0[4], float t1[4], uint32_t* below = 0) const {
+		const size_t near_x = consts.m_near[0];
+		const size_t near_y = consts.m_near[1];
+
+		#if defined(__SSE2__)
+		const __m128 pos_x = _mm_set1_ps(consts.m_pos[0]);
+		const __m128 pos_y = _mm_set1_ps(consts.m_pos[1]);
+		const __m128 pos_z = _mm_set1_ps(consts.m_pos[2]);
+		const __m128 inv_x = _mm_set1_ps(consts.m_inv_dir[0]);
+		const __m128 inv_y = _mm_set1_ps(consts.m_inv_dir[1]);
+		const __m128 dir_z = _mm_set1_ps(consts.m_dir_z);
+		const __m128 eps = _mm_set1_ps(epsilon);
+
+		const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(m_bounds[near_x]), pos_x), inv_x);
+		const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(m_bounds[near_x ^ 1]), pos_x), inv_x);
+		const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(m_bounds[near_y]), pos_y), inv_y);
+		const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(m_bounds[near_y ^ 1]), pos_y), inv_y);
+
+		const __m128 tn = _mm_max_ps(_mm_max_ps(tx0, ty0), _mm_set1_ps(tmin));
+		const __m128 tf = _mm_min_ps(_mm_min_ps(tx1, ty1), _mm_set1_ps(tmax));
+
+		const __m128 z0 = _mm_add_ps(pos_z, _mm_mul_ps(dir_z, tn));
+		const __m128 z1 = _mm_add_ps(pos_z, _mm_mul_ps(dir_z, tf));
+
+		const __m128 hit = _mm_and_ps(_mm_cmple_ps(tn, tf), _mm_cmple_ps(_mm_min_ps(z0, z1), _mm_sub_ps(_mm_load_ps(m_bounds[BOUND_ZMAX]), eps)));
+
+		_mm_storeu_ps(t0, tn);
+		_mm_storeu_ps(t1, tf);
+
+		if (below != 0)
+			*below = _mm_movemask_ps(_mm_and_ps(hit, _mm_cmplt_ps(_mm_max_ps(z0, z1), _mm_add_ps(_mm_load_ps(m_bounds[BOUND_ZMIN]), eps))));
+
+		return (_mm_movemask_ps(hit));
+
+		#else
+		uint32_t mask = 0;
+
+		if (below != 0)
+			*below = 0;
+
+		for (size_t i = 0; i < 4; i++) {
+			const float tx0 = (m_bounds[near_x    ][i] - consts.m_pos[0]) * consts.m_inv_dir[0];
+			const float tx1 = (m_bounds[near_x ^ 1][i] - consts.m_pos[0]) * consts.m_inv_dir[0];
+			const float ty0 = (m_bounds[near_y    ][i] - consts.m_pos[1]) * consts.m_inv_dir[1];
+			const float ty1 = (m_bounds[near_y ^ 1][i] - consts.m_pos[1]) * consts.m_inv_dir[1];
+
+			t0[i] = std::max(std::max(tx0, ty0), tmin);
+			t1[i] = std::min(std::min(tx1, ty1), tmax);
+
+			const float z0 = consts.m_pos[2] + consts.m_dir_z * t0[i];
+			const float z1 = consts.m_pos[2] + consts.m_dir_z * t1[i];
+
+			if (!(t0[i] <= t1[i]) || !(std::min(z0, z1) <= (m_bounds[BOUND_ZMAX][i] - epsilon)))
+				continue;
+
+			mask |= (1u << i);
+
+			if (below != 0 && std::max(z0, z1) < (m_bounds[BOUND_ZMIN][i] + epsilon))
+				*below |= (1u << i);
+		}
+
+		return mask;
+		#endif
+	}
+
+	void set_child(size_t i, uint32_t ref, float xmin, float xmax, float ymin, float ymax, float zmin, float zmax) {
+		m_children[i] = ref;
+		m_bounds[BOUND_XMIN][i] = xmin;
+		m_bounds[BOUND_XMAX][i] = xmax;
+		m_bounds[BOUND_YMIN][i] = ymin;
+		m_bounds[BOUND_YMAX][i] = ymax;
+		m_bounds[BOUND_ZMIN][i] = zmin;
+		m_bounds[BOUND_ZMAX][i] = zmax;
+	}
+
+	// fills the cells of a leaf and its height range; returns its reference
+	static uint32_t create_leaf(t_cell_type* cells, size_t cells_xsize, const t_heightmap& heightmap, const size_t rect[4], float heights[2]) {
+		heights[0] = FLT_MAX;
+		heights[1] = -FLT_MAX;
+
+		for (size_t y = rect[2]; y < rect[3]; y++) {
+			for (size_t x = rect[0]; x < rect[1]; x++) {
+				t_cell_type cell;
+				cell.set_from_heightmap(heightmap, x, y);
+
+				if (cells != 0)
+					cells[y * cells_xsize + x] = cell;
+
+				heights[0] = std::min(heights[0], cell.get_min_height());
+				heights[1] = std::max(heights[1], cell.get_max_height());
+			}
+		}
+
+		return (LEAF_BIT | uint32_t(rect[2] * cells_xsize + rect[0]));
+	}
+
+private:
+	static const size_t MIN_PARALLEL_BUILD_CELLS = 64 * 64;
+
+	// every level halves the sides of the blocks, so a tree over the
+	// at most 2^31 cells that LEAF_BIT leaves room for is at most 31
+	// levels deep and trace_ray stacks at most 3 children per level
+	static const size_t MAX_STACK_DEPTH = 3 * 31 + 4;
+
+	static const size_t MAX_LEAF_SIZE = size_t(1) << 15;
+
+	// nodes live in one flat array, every subtree directly following its
+	// parent; bounds are in grid coordinates, one row per BOUND_* and one
+	// column per child
+	float m_bounds[BOUND_COUNT][4];
+
+	uint32_t m_children[4];
+};
+
+
+
+template <class t_cell_type>
+class t_bvh4_cell_scene: public t_scene {
+public:
+	static_assert(t_cell_interface<t_cell_type>::value, "not a cell-type");
+
+	typedef t_bvh4_cell_scene_node<t_cell_type> t_node;
+
+	t_bvh4_cell_scene() {
+		m_xmax = 0;
+		m_ymax = 0;
+		m_nodes = 0;
+		m_cells = 0;
+		m_num_nodes = 0;
+	}
+
+	void assign_heightmap(const t_heightmap& heightmap) {
+		m_arena.release();
+
+		m_heightmap = heightmap;
+
+		m_xmax = heightmap.width() - 1;
+		m_ymax = heightmap.height() - 1;
+
+		const size_t rect[4] = {0, m_xmax, 0, m_ymax};
+
+		std::vector<t_node> nodes;
+		nodes.reserve(t_node::num_subtree_nodes(rect, m_leaf_size));
+
+		t_cell_type* cells = 0;
+
+		// in compact mode the heightmap is all there is to the cells
+		if (m_compact_heights) {
+			m_heightmap.quantize();
+		} else {
+			cells = m_arena.create_array<t_cell_type>(m_xmax * m_ymax);
+		}
+
+		m_heightmap.set_layout(m_heightmap_layout);
+
+		t_node::create_from_heightmap(nodes, cells, m_xmax, m_heightmap, 0, m_xmax, 0, m_ymax, m_leaf_size, m_num_build_threads);
+
+		// move the nodes into the arena as one contiguous block
+		t_node* flat_nodes = m_arena.create_array<t_node>(nodes.size());
+		std::copy(nodes.begin(), nodes.end(), flat_nodes);
+
+		m_nodes = flat_nodes;
+		m_cells = cells;
+		m_num_nodes = nodes.size();
+	}
+
+
+	uint64_t get_build_key() const {
+		uint64_t key = hash_bytes("bvh4", 4);
+		key = hash_value(sizeof(t_node), key);
+		key = hash_value(sizeof(t_cell_type), key);
+		key = hash_value(m_compact_heights, key);
+		key = hash_value(m_heightmap_layout, key);
+		key = hash_value(m_leaf_size, key);
+		return key;
+	}
+
+	size_t num_heightmap_bytes() const { return (m_heightmap.num_bytes()); }
+
+	void get_stats(t_scene_stats& stats) const {
+		// children always follow their parent, so one forward sweep has every depth
+		std::vector<uint16_t> depths(m_num_nodes, 0);
+
+		stats.m_num_nodes = m_num_nodes;
+		stats.m_num_leaves = 0;
+
+		for (size_t idx = 0; idx < m_num_nodes; idx++) {
+			for (size_t i = 0; i < 4; i++) {
+				if (m_nodes[idx].is_empty_child(i))
+					continue;
+
+				if (!m_nodes[idx].is_leaf_child(i)) {
+					depths[idx + m_nodes[idx].get_child(i)] = depths[idx] + 1;
+					continue;
+				}
+
+				if ((depths[idx] + 1u) >= stats.m_leaf_depths.size())
+					stats.m_leaf_depths.resize(depths[idx] + 2, 0);
+
+				stats.m_leaf_depths[depths[idx] + 1] += 1;
+				stats.m_num_leaves += 1;
+				stats.m_num_nodes += 1;
+			}
+		}
+	}
+
+
+	t_color trace_ray(t_const_ray ray) const {
+		return (shade_lit_hit(intersect_ray(ray)));
+	}
+
+	t_ray_intersection intersect_ray(t_const_ray ray) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return (t_ray_intersection());
+
+		if (m_cells == 0)
+			return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->trace_ray(t_heightmap_cells<t_cell_type>(&m_heightmap), ray, tmin, tmax)));
+
+		return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->trace_ray(get_cells(), ray, tmin, tmax)));
+	}
+
+	bool trace_shadow_ray(t_const_ray ray) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return false;
+
+		if (m_cells == 0)
+			return (m_nodes->trace_shadow_ray(t_heightmap_cells<t_cell_type>(&m_heightmap), ray, tmin, tmax));
+
+		return (m_nodes->trace_shadow_ray(get_cells(), ray, tmin, tmax));
+	}
+
+	t_ray_intersection intersect_counted_ray(t_const_ray ray, t_trace_counters& counters) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return (t_ray_intersection());
+
+		if (m_cells == 0)
+			return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->trace_ray(count_cells(t_heightmap_cells<t_cell_type>(&m_heightmap), counters), ray, tmin, tmax)));
+
+		return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->trace_ray(count_cells(get_cells(), counters), ray, tmin, tmax)));
+	}
+
+	bool trace_counted_shadow_ray(t_const_ray ray, t_trace_counters& counters) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return false;
+
+		if (m_cells == 0)
+			return (m_nodes->trace_shadow_ray(count_cells(t_heightmap_cells<t_cell_type>(&m_heightmap), counters), ray, tmin, tmax));
+
+		return (m_nodes->trace_shadow_ray(count_cells(get_cells(), counters), ray, tmin, tmax));
+	}
+
+private:
+	t_cell_grid<t_cell_type> get_cells() const { return (t_cell_grid<t_cell_type>(m_cells, m_xmax)); }
+
+private:
+	// bounds of the tree-root
+	size_t m_xmax;
+	size_t m_ymax;
+
+	// source of the tree, kept to expand hits (and to rebuild
+	// cells while tracing if m_cells is null)
+	t_heightmap m_heightmap;
+
+	// root is the first node; both live in the arena
+	const t_node* m_nodes;
+	const t_cell_type* m_cells;
+
+	size_t m_num_nodes;
+};
@@ -1,8 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "color.hpp"
+#include "sample_layout.hpp"
 #include "vector.hpp"
 
 enum {
@@ -11,6 +19,41 @@ enum {
 	CAM_UPW_DIR = 2,
 };
 
+// a rectangle [xmin, xmax) x [ymin, ymax) of the image with its own packed
+// pixels (bottom row first, in the order of <layout>), traced apart from the
+// image and copied into it once done
+struct t_image_chunk {
+public:
+	t_image_chunk(size_t xmin = 0, size_t xmax = 0, size_t ymin = 0, size_t ymax = 0, uint32_t* pixels = 0, int layout = t_sample_layout::LAYOUT_LINEAR) {
+		m_xmin = xmin; m_xmax = xmax;
+		m_ymin = ymin; m_ymax = ymax;
+		m_pixels = pixels;
+		m_layout.reset(width(), height(), layout, get_layout_block_size(layout));
+	}
+
+	// side of the blocks of <layout>: 4 pixels (one cache-line per block)
+	// when blocked, 32 (one page per block) in Z-order
+	static size_t get_layout_block_size(int layout) {
+		return ((layout == t_sample_layout::LAYOUT_MORTON)? 32: 4);
+	}
+
+	size_t width() const { return (m_xmax - m_xmin); }
+	size_t height() const { return (m_ymax - m_ymin); }
+	// including the padding of the layout
+	size_t num_pixels() const { return m_layout.num_samples(); }
+
+	uint32_t get_pixel(size_t x, size_t y) const { return m_pixels[m_layout.get_index(x - m_xmin, y - m_ymin)]; }
+	void set_pixel(size_t x, size_t y, uint32_t pixel) { m_pixels[m_layout.get_index(x - m_xmin, y - m_ymin)] = pixel; }
+
+public:
+	size_t m_xmin, m_xmax;
+	size_t m_ymin, m_ymax;
+
+	uint32_t* m_pixels;
+
+	t_sample_layout m_layout;
+};
+
 class t_camera {
 public:
 	t_camera() {
@@ -19,6 +62,7 @@ public:
 		m_view_size_x = 0;
 		m_view_size_y = 0;
 
+		set_gamma(1.0f);
 		update(t_vector(1.0f, 1.0f, -1.0f).normalize_xyz());
 	}
 
@@ -33,12 +77,81 @@ public:
 	}
 
 	void set_image_pixel(size_t x, size_t y, const t_color& c) {
-		m_image[y * m_view_size_x + x] = c;
+		m_image[y * m_view_size_x + x] = pack_color(c);
 	}
+	uint32_t get_image_pixel(size_t x, size_t y) const { return m_image[y * m_view_size_x + x]; }
+
+	// copies the pixels of <chunk> into the (row-major) image
+	void set_image_chunk(const t_image_chunk& chunk) {
+		if (chunk.m_layout.type() == t_sample_layout::LAYOUT_LINEAR) {
+			for (size_t y = chunk.m_ymin; y < chunk.m_ymax; y++) {
+				std::copy(&chunk.m_pixels[(y - chunk.m_ymin) * chunk.width()], &chunk.m_pixels[(y - chunk.m_ymin + 1) * chunk.width()], &m_image[y * m_view_size_x + chunk.m_xmin]);
+			}
 
-	void draw_image_pixel(size_t x, size_t y, const t_color& c);
+			return;
+		}
+
+		for (size_t y = chunk.m_ymin; y < chunk.m_ymax; y++) {
+			for (size_t x = chunk.m_xmin; x < chunk.m_xmax; x++) {
+				m_image[y * m_view_size_x + x] = chunk.get_pixel(x, y);
+			}
+		}
+	}
+
+	// uploads the image in one call
 	void draw_image();
 
+	// packed pixels are encoded as pow(c, 1 / gamma); 1 stores them linearly
+	void set_gamma(float gamma) {
+		m_gamma_lut.clear();
+
+		if (gamma == 1.0f || gamma <= 0.0f)
+			return;
+
+		m_gamma_lut.resize(GAMMA_LUT_SIZE);
+
+		for (size_t n = 0; n < GAMMA_LUT_SIZE; n++) {
+			m_gamma_lut[n] = uint8_t(std::pow(n / (GAMMA_LUT_SIZE - 1.0f), 1.0f / gamma) * 255.0f + 0.5f);
+		}
+	}
+
+	// clamps <c> to [0, 1] and packs it as RGBA8, red in the lowest byte
+	// (so the bytes are in GL_RGBA order on little-endian machines)
+	uint32_t pack_color(const t_color& c) const {
+		#if defined(__SSE2__)
+		const __m128 v = _mm_min_ps(_mm_max_ps(_mm_set_ps(1.0f, c.b(), c.g(), c.r()), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+
+		if (m_gamma_lut.empty()) {
+			// round to [0, 255], then saturate the lanes down to bytes
+			const __m128i v32 = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+			const __m128i v16 = _mm_packs_epi32(v32, v32);
+
+			return (uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(v16, v16))));
+		}
+
+		const __m128i idx = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(GAMMA_LUT_SIZE - 1.0f)));
+
+		const uint32_t r = m_gamma_lut[_mm_cvtsi128_si32(idx)];
+		const uint32_t g = m_gamma_lut[_mm_cvtsi128_si32(_mm_shuffle_epi32(idx, _MM_SHUFFLE(1, 1, 1, 1)))];
+		const uint32_t b = m_gamma_lut[_mm_cvtsi128_si32(_mm_shuffle_epi32(idx, _MM_SHUFFLE(2, 2, 2, 2)))];
+		#else
+		const float s = m_gamma_lut.empty()? 255.0f: (GAMMA_LUT_SIZE - 1.0f);
+
+		uint32_t r = uint32_t(std::max(0.0f, std::min(1.0f, c.r())) * s + 0.5f);
+		uint32_t g = uint32_t(std::max(0.0f, std::min(1.0f, c.g())) * s + 0.5f);
+		uint32_t b = uint32_t(std::max(0.0f, std::min(1.0f, c.b())) * s + 0.5f);
+
+		if (m_gamma_lut.empty())
+			return (r | (g << 8) | (b << 16) | 0xff000000u);
+
+		r = m_gamma_lut[r];
+		g = m_gamma_lut[g];
+		b = m_gamma_lut[b];
+		#endif
+
+		return (r | (g << 8) | (b << 16) | 0xff000000u);
+	}
+
 	void update(const t_vector& dir) {
 		// (re)compose the camera's coordinate-system
 		m_dir[CAM_FWD_DIR] = dir;
@@ -56,6 +169,25 @@ public:
 
 	float aspect() const { return (m_view_size_x * 1.0f / m_view_size_y); }
 
+	// half-width of the image-plane at unit distance, for get_pixel_dir;
+	// meant to be hoisted out of per-pixel loops
+	float get_fov_scale() const { return (std::tan(m_fov * 0.5f)); }
+
+	// direction of the primary ray through pixel (x, y) of the image, or of
+	// a <view_size_x> x <view_size_y> view with the given aspect ratio
+	t_vector get_pixel_dir(size_t x, size_t y, float fscale) const {
+		return (get_pixel_dir(x, y, fscale, m_view_size_x, m_view_size_y, aspect()));
+	}
+	t_vector get_pixel_dir(size_t x, size_t y, float fscale, size_t view_size_x, size_t view_size_y, float aspect) const {
+		const float xrel = (x * 1.0f / view_size_x) - 0.5f;
+		const float yrel = (y * 1.0f / view_size_y) - 0.5f;
+
+		const t_vector pxl_up_dir = m_dir[CAM_UPW_DIR] * (yrel * fscale / aspect);
+		const t_vector pxl_rgt_dir = m_dir[CAM_RGT_DIR] * (xrel * fscale);
+
+		return ((m_dir[CAM_FWD_DIR] + pxl_up_dir + pxl_rgt_dir).normalize_xyz());
+	}
+
 	size_t get_view_size_x() const { return m_view_size_x; }
 	size_t get_view_size_y() const { return m_view_size_y; }
 
@@ -70,6 +202,11 @@ private:
 	size_t m_view_size_y;
 
 private:
-	std::vector<t_color> m_image;
+	static const size_t GAMMA_LUT_SIZE = 4096;
+
+	// RGBA8 pixels (see pack_color), bottom row first
+	std::vector<uint32_t> m_image;
+	// maps [0, 1] in GAMMA_LUT_SIZE steps to encoded bytes, empty if linear
+	std::vector<uint8_t> m_gamma_lut;
 };
 
@@ -1,22 +1,244 @@
 #pragma once
 
+#include <algorithm>
+#include <cfloat>
+#include <type_traits>
+#include <utility>
+
 #include "common.hpp"
 #include "heightmap.hpp"
 #include "ray.hpp"
 #include "ray_intersection.hpp"
 
-class t_cell {
+// scenes are templated on their cell-type and call it without virtual
+// dispatch, which keeps cells trivially copyable so they can be stored
+// in flat (and memory-mapped) arrays; every cell-type must provide (and
+// t_cell_interface checks)
+//
+//   float get_max_height() const;
+//   float get_min_height() const;
+//
+//   // traces a ray into this cell, which is number <index> of the grid
+//   // of cells over the scene's heightmap; returns the (slim) hit
+//   t_ray_hit trace_ray(t_const_ray ray, uint32_t index) const;
+//   t_ray_hit trace_slope_ray(t_const_ray slope_ray, uint32_t index) const;
+//
+//   // traces a shadow ray into this cell; returns true iff there is a collision
+//   bool trace_shadow_ray(t_const_ray ray) const;
+//
+//   void set_from_heightmap(const t_heightmap& heightmap, size_t x, size_t y);
+//
+//   // expands a hit returned for <ray> by one of the cells over <heightmap>
+//   static t_ray_intersection get_intersection(const t_heightmap& heightmap, t_const_ray ray, const t_ray_hit& hit);
+//
+//   // interpolated normal at the surface point <pos> of <heightmap>
+//   static t_vector shading_normal(const t_heightmap& heightmap, t_const_vec pos);
+//
+template<class t_cell_type>
+struct t_cell_interface {
+private:
+	typedef const t_cell_type& t_const_cell;
+
+	static_assert(std::is_trivially_copyable<t_cell_type>::value, "cells must be trivially copyable");
+
+	static_assert(std::is_same<decltype(std::declval<t_const_cell>().get_max_height()), float>::value, "cells must provide get_max_height");
+	static_assert(std::is_same<decltype(std::declval<t_const_cell>().get_min_height()), float>::value, "cells must provide get_min_height");
+
+	static_assert(std::is_same<decltype(std::declval<t_const_cell>().trace_ray(std::declval<t_const_ray>(), uint32_t(0))), t_ray_hit>::value, "cells must provide trace_ray");
+	static_assert(std::is_same<decltype(std::declval<t_const_cell>().trace_slope_ray(std::declval<t_const_ray>(), uint32_t(0))), t_ray_hit>::value, "cells must provide trace_slope_ray");
+	static_assert(std::is_same<decltype(std::declval<t_const_cell>().trace_shadow_ray(std::declval<t_const_ray>())), bool>::value, "cells must provide trace_shadow_ray");
+
+	static_assert(std::is_same<decltype(std::declval<t_cell_type&>().set_from_heightmap(std::declval<const t_heightmap&>(), size_t(0), size_t(0))), void>::value, "cells must provide set_from_heightmap");
+
+	static_assert(std::is_same<decltype(t_cell_type::get_intersection(std::declval<const t_heightmap&>(), std::declval<t_const_ray>(), std::declval<const t_ray_hit&>())), t_ray_intersection>::value, "cells must provide get_intersection");
+	static_assert(std::is_same<decltype(t_cell_type::shading_normal(std::declval<const t_heightmap&>(), std::declval<t_const_vec>())), t_vector>::value, "cells must provide shading_normal");
+
+public:
+	static const bool value = true;
+};
+
+
+
+// array of cells viewed as a grid of xsize() columns; traversals that step
+// from cell to cell (rather than only index the cells of their leaves) need
+// the width, which every array passed to them provides
+template<class t_cell_type>
+class t_cell_grid {
+public:
+	t_cell_grid(const t_cell_type* cells = 0, size_t xsize = 0) { m_cells = cells; m_xsize = xsize; }
+
+	const t_cell_type& operator [] (size_t idx) const { return m_cells[idx]; }
+
+	size_t xsize() const { return m_xsize; }
+
+private:
+	const t_cell_type* m_cells;
+
+	size_t m_xsize;
+};
+
+// stand-in for an array of cells that rebuilds each cell from a (compact)
+// heightmap when indexed, so scenes can trade cell storage for arithmetic;
+// indices are y * (width - 1) + x as for a full cell-grid
+template<class t_cell_type>
+class t_heightmap_cells {
+public:
+	t_heightmap_cells(const t_heightmap* heightmap = 0) { m_heightmap = heightmap; }
+
+	t_cell_type operator [] (size_t idx) const {
+		t_cell_type cell;
+		cell.set_from_heightmap(*m_heightmap, idx % xsize(), idx / xsize());
+		return cell;
+	}
+
+	size_t xsize() const { return (m_heightmap->width() - 1); }
+
+private:
+	const t_heightmap* m_heightmap;
+};
+
+
+
+// work done by a traversal, for cost visualization
+struct t_trace_counters {
+public:
+	t_trace_counters() {
+		m_num_nodes = 0;
+		m_num_cells = 0;
+		m_num_shadow_rays = 0;
+	}
+
+	size_t m_num_nodes;
+	size_t m_num_cells;
+	size_t m_num_shadow_rays;
+};
+
+// stand-in for an array of cells (or another stand-in) that counts every
+// cell indexed, and every node visit reported through count_node_visit
+template<typename t_cell_array>
+class t_counted_cells {
 public:
-	virtual float get_max_height() const = 0;
-	virtual float get_min_height() const = 0;
+	t_counted_cells(const t_cell_array& cells, t_trace_counters* counters): m_cells(cells), m_counters(counters) {}
 
-	// traces a ray into this cell; returns the intersection
-	virtual t_ray_intersection trace_ray(t_const_ray ray) const = 0;
-	virtual t_ray_intersection trace_slope_ray(t_const_ray slope_ray) const = 0;
+	auto operator [] (size_t idx) const -> decltype(std::declval<const t_cell_array&>()[idx]) {
+		m_counters->m_num_cells += 1;
+		return m_cells[idx];
+	}
 
-	// traces a shadow ray into this cell; returns true iff there is a collision
-	virtual bool trace_shadow_ray(t_const_ray ray) const = 0;
+	void count_node_visit() const { m_counters->m_num_nodes += 1; }
 
-	virtual void set_from_heightmap(const t_heightmap& heightmap, size_t x, size_t y) = 0;
+	size_t xsize() const { return m_cells.xsize(); }
+
+private:
+	t_cell_array m_cells;
+	t_trace_counters* m_counters;
 };
 
+template<typename t_cell_array>
+t_counted_cells<t_cell_array> count_cells(const t_cell_array& cells, t_trace_counters& counters) {
+	return (t_counted_cells<t_cell_array>(cells, &counters));
+}
+
+// called by traversals on entering a node; a no-op unless they are counted
+template<typename t_cell_array>
+inline void count_node_visit(const t_cell_array&) {}
+template<typename t_cell_array>
+inline void count_node_visit(const t_counted_cells<t_cell_array>& cells) { cells.count_node_visit(); }
+
+
+
+// calls func(cell_index, t0, t1) for every cell of the block of xsize x ysize
+// cells at (x, y) in a grid of <cells_xsize> columns that is overlapped by
+// the ray-segment [tmin, tmax], in front-to-back order (2D-DDA), until it
+// returns true; returns whether it did
+template<typename t_func>
+bool walk_cell_block(size_t cells_xsize, size_t x, size_t y, size_t xsize, size_t ysize, t_const_ray ray, float tmin, float tmax, const t_func& func) {
+	const t_vector start = ray.point(tmin);
+
+	const int xmin = x;
+	const int ymin = y;
+	const int xmax = xmin + xsize - 1;
+	const int ymax = ymin + ysize - 1;
+
+	int cx = std::max(xmin, std::min(xmax, int(start.x())));
+	int cy = std::max(ymin, std::min(ymax, int(start.y())));
+
+	const int step_x = (ray.dir().x() > 0.0f)? 1: -1;
+	const int step_y = (ray.dir().y() > 0.0f)? 1: -1;
+
+	for (float t0 = tmin; t0 <= tmax; ) {
+		const float t_next_x = (ray.dir().x() != 0.0f)? ray.time_to_x(cx + (step_x > 0)): FLT_MAX;
+		const float t_next_y = (ray.dir().y() != 0.0f)? ray.time_to_y(cy + (step_y > 0)): FLT_MAX;
+		const float t1 = std::min(tmax, std::min(t_next_x, t_next_y));
+
+		if (func(cy * cells_xsize + cx, t0, t1))
+			return true;
+
+		if (t_next_x < t_next_y) {
+			cx += step_x;
+			t0 = t_next_x;
+		} else {
+			cy += step_y;
+			t0 = t_next_y;
+		}
+
+		if (cx < xmin || cx > xmax)
+			break;
+		if (cy < ymin || cy > ymax)
+			break;
+	}
+
+	return false;
+}
+
+// the nearest hit of the ray-segment [tmin, tmax] with a block of cells as
+// for walk_cell_block, skipping the cells it passes over; the leaf-case of
+// the tree traversals
+template<typename t_cell_array>
+t_ray_hit trace_cell_block(const t_cell_array& cells, size_t x, size_t y, size_t xsize, size_t ysize, t_const_ray ray, float tmin, float tmax) {
+	const size_t cells_xsize = cells.xsize();
+
+	if (xsize == 1 && ysize == 1)
+		return (cells[y * cells_xsize + x].trace_ray(ray, y * cells_xsize + x));
+
+	t_ray_hit result;
+
+	walk_cell_block(cells_xsize, x, y, xsize, ysize, ray, tmin, tmax, [&](size_t idx, float t0, float t1) {
+		const float z0 = ray.pos().z() + t0 * ray.dir().z();
+		const float z1 = ray.pos().z() + t1 * ray.dir().z();
+
+		const auto& cell = cells[idx];
+
+		if (std::min(z0, z1) > cell.get_max_height())
+			return false;
+
+		result = cell.trace_ray(ray, idx);
+		return (result.valid());
+	});
+
+	return result;
+}
+
+// whether the ray-segment [tmin, tmax] collides with a block of cells, with
+// the same early-outs per cell as the traversals have per node
+template<typename t_cell_array>
+bool trace_shadow_cell_block(const t_cell_array& cells, size_t x, size_t y, size_t xsize, size_t ysize, t_const_ray ray, float tmin, float tmax) {
+	const size_t cells_xsize = cells.xsize();
+
+	if (xsize == 1 && ysize == 1)
+		return (cells[y * cells_xsize + x].trace_shadow_ray(ray));
+
+	return (walk_cell_block(cells_xsize, x, y, xsize, ysize, ray, tmin, tmax, [&](size_t idx, float t0, float t1) {
+		const float z0 = ray.pos().z() + t0 * ray.dir().z();
+		const float z1 = ray.pos().z() + t1 * ray.dir().z();
+
+		const auto& cell = cells[idx];
+
+		if (std::min(z0, z1) > (cell.get_max_height() - RAY_TEST_EPSILON))
+			return false;
+		if (std::max(z0, z1) < (cell.get_min_height() + RAY_TEST_EPSILON))
+			return true;
+
+		return (cell.trace_shadow_ray(ray));
+	}));
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <boost/chrono.hpp>
+
 // without barriers, performance doubles
 // but thread-safety goes out the window
 //
@@ -23,3 +26,9 @@ typedef const t_ray t_const_ray;
 typedef const t_vector t_const_vec;
 #endif
 
+// monotonic time in ns, for timing frames and their phases
+inline int64_t get_tick() {
+	const boost::chrono::high_resolution_clock::time_point cur_time = boost::chrono::high_resolution_clock::now();
+	const boost::chrono::nanoseconds run_time = boost::chrono::duration_cast<boost::chrono::nanoseconds>(cur_time.time_since_epoch());
+	return (run_time.count());
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "cell.hpp"
+#include "ray.hpp"
+#include "ray_intersection.hpp"
+#include "heightmap.hpp"
+#include "parallel.hpp"
+#include "scene.hpp"
+#include "scene_cache.hpp"
+
+// widest upward cone above a cell that no terrain enters: within (chebyshev)
+// distance d of the cell's footprint, no cell rises above m_apex + d / m_ratio
+//
+// the apex is the highest cell of the 3x3 block around the cell, so every
+// cone has a positive ratio even where the neighbours are higher
+//
+struct t_cell_cone {
+public:
+	t_cell_cone() {
+		m_apex = 0.0f;
+		m_ratio = 0.0f;
+	}
+
+	// parameter along <ray> (which is above the apex at <t>) up to which
+	// it stays inside the cone, for the horizontal (chebyshev) speed
+	// <dir_h> of the ray; FLT_MAX if it never leaves
+	float get_exit_time(t_const_ray ray, float t, float dir_h) const {
+		const float den = dir_h - m_ratio * ray.dir().z();
+
+		if (den <= 0.0f)
+			return FLT_MAX;
+
+		return (t + m_ratio * (ray.pos().z() + t * ray.dir().z() - m_apex) / den);
+	}
+
+	float m_apex;
+	float m_ratio;
+};
+
+
+
+// scene without any tree: rays march over the cells in steps as large as
+// the cone of the cell they are above allows, and through the cells (one
+// at a time, exactly) wherever they pass below a cone's apex; the cones
+// are precomputed per cell and the march reads them in ray order, which
+// suits wide views that see most of the map
+//
+template <class t_cell_type>
+class t_cone_step_cell_scene: public t_scene {
+public:
+	static_assert(t_cell_interface<t_cell_type>::value, "not a cell-type");
+
+	t_cone_step_cell_scene() {
+		m_xmax = 0;
+		m_ymax = 0;
+		m_cells = 0;
+		m_cones = 0;
+	}
+
+	void assign_heightmap(const t_heightmap& heightmap) {
+		m_arena.release();
+
+		m_heightmap = heightmap;
+
+		m_xmax = heightmap.width() - 1;
+		m_ymax = heightmap.height() - 1;
+
+		t_cell_type* cells = 0;
+
+		// in compact mode the heightmap is all there is to the cells
+		if (m_compact_heights) {
+			m_heightmap.quantize();
+		} else {
+			cells = m_arena.create_array<t_cell_type>(m_xmax * m_ymax);
+		}
+
+		m_heightmap.set_layout(m_heightmap_layout);
+
+		t_cell_cone* cones = m_arena.create_array<t_cell_cone>(m_xmax * m_ymax);
+
+		create_cones(cones, cells, m_heightmap, m_num_build_threads);
+
+		m_cells = cells;
+		m_cones = cones;
+	}
+
+
+	uint64_t get_build_key() const {
+		uint64_t key = hash_bytes("cone_step", 9);
+		key = hash_value(sizeof(t_cell_cone), key);
+		key = hash_value(sizeof(t_cell_type), key);
+		key = hash_value(m_compact_heights, key);
+		key = hash_value(m_heightmap_layout, key);
+		return key;
+	}
+
+	size_t num_heightmap_bytes() const { return (m_heightmap.num_bytes()); }
+
+
+	t_color trace_ray(t_const_ray ray) const {
+		return (shade_lit_hit(intersect_ray(ray)));
+	}
+
+	t_ray_intersection intersect_ray(t_const_ray ray) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return (t_ray_intersection());
+
+		if (m_cells == 0)
+			return (get_intersection<t_cell_type>(m_heightmap, ray, march_ray(t_heightmap_cells<t_cell_type>(&m_heightmap), ray, tmin, tmax)));
+
+		return (get_intersection<t_cell_type>(m_heightmap, ray, march_ray(get_cells(), ray, tmin, tmax)));
+	}
+
+	bool trace_shadow_ray(t_const_ray ray) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return false;
+
+		if (m_cells == 0)
+			return (march_shadow_ray(t_heightmap_cells<t_cell_type>(&m_heightmap), ray, tmin, tmax));
+
+		return (march_shadow_ray(get_cells(), ray, tmin, tmax));
+	}
+
+	// every step of the march counts as a node visit
+	t_ray_intersection intersect_counted_ray(t_const_ray ray, t_trace_counters& counters) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return (t_ray_intersection());
+
+		if (m_cells == 0)
+			return (get_intersection<t_cell_type>(m_heightmap, ray, march_ray(count_cells(t_heightmap_cells<t_cell_type>(&m_heightmap), counters), ray, tmin, tmax)));
+
+		return (get_intersection<t_cell_type>(m_heightmap, ray, march_ray(count_cells(get_cells(), counters), ray, tmin, tmax)));
+	}
+
+	bool trace_counted_shadow_ray(t_const_ray ray, t_trace_counters& counters) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return false;
+
+		if (m_cells == 0)
+			return (march_shadow_ray(count_cells(t_heightmap_cells<t_cell_type>(&m_heightmap), counters), ray, tmin, tmax));
+
+		return (march_shadow_ray(count_cells(get_cells(), counters), ray, tmin, tmax));
+	}
+
+private:
+	// marches the ray-segment [tmin, tmax] over the map; calls
+	// func(cell_index, t0, t1) for each cell it can not step over, in
+	// front-to-back order, until it returns true; returns whether it did
+	//
+	// the ray either steps to where it leaves the cone of the cell it is
+	// above (if that is past the cell), or crosses the cell to the next
+	// one as a 2D-DDA would
+	template<typename t_cell_array, typename t_func>
+	bool march(const t_cell_array& cells, t_const_ray ray, float tmin, float tmax, const t_func& func) const {
+		const int xmax = m_xmax - 1;
+		const int ymax = m_ymax - 1;
+
+		const int step_x = (ray.dir().x() > 0.0f)? 1: -1;
+		const int step_y = (ray.dir().y() > 0.0f)? 1: -1;
+
+		const float dir_h = std::max(std::fabs(ray.dir().x()), std::fabs(ray.dir().y()));
+
+		float t = tmin;
+
+		t_vector pos = ray.point(t);
+
+		int cx = std::max(0, std::min(xmax, int(pos.x())));
+		int cy = std::max(0, std::min(ymax, int(pos.y())));
+
+		for (;;) {
+			count_node_visit(cells);
+
+			const size_t idx = cy * m_xmax + cx;
+
+			const float t_next_x = (ray.dir().x() != 0.0f)? ray.time_to_x(cx + (step_x > 0)): FLT_MAX;
+			const float t_next_y = (ray.dir().y() != 0.0f)? ray.time_to_y(cy + (step_y > 0)): FLT_MAX;
+			const float t_exit = std::min(t_next_x, t_next_y);
+
+			const t_cell_cone& cone = m_cones[idx];
+
+			if ((ray.pos().z() + t * ray.dir().z()) > cone.m_apex) {
+				const float t_cone = cone.get_exit_time(ray, t, dir_h);
+
+				if (t_cone > std::max(t, t_exit)) {
+					if (t_cone >= tmax)
+						return false;
+
+					t = t_cone;
+					pos = ray.point(t);
+
+					cx = std::max(0, std::min(xmax, int(pos.x())));
+					cy = std::max(0, std::min(ymax, int(pos.y())));
+					continue;
+				}
+			}
+
+			if (func(idx, t, std::min(t_exit, tmax)))
+				return true;
+			if (t_exit >= tmax)
+				return false;
+
+			if (t_next_x < t_next_y) {
+				cx += step_x;
+				t = t_next_x;
+			} else {
+				cy += step_y;
+				t = t_next_y;
+			}
+
+			if (cx < 0 || cx > xmax)
+				return false;
+			if (cy < 0 || cy > ymax)
+				return false;
+		}
+	}
+
+	template<typename t_cell_array>
+	t_ray_hit march_ray(const t_cell_array& cells, t_const_ray ray, float tmin, float tmax) const {
+		t_ray_hit result;
+
+		march(cells, ray, tmin, tmax, [&](size_t idx, float t0, float t1) {
+			const float z0 = ray.pos().z() + t0 * ray.dir().z();
+			const float z1 = ray.pos().z() + t1 * ray.dir().z();
+
+			const auto& cell = cells[idx];
+
+			if (std::min(z0, z1) > cell.get_max_height())
+				return false;
+
+			result = cell.trace_ray(ray, idx);
+			return (result.valid());
+		});
+
+		return result;
+	}
+
+	// same early-outs per cell as the tree traversals have per node
+	template<typename t_cell_array>
+	bool march_shadow_ray(const t_cell_array& cells, t_const_ray ray, float tmin, float tmax) const {
+		return (march(cells, ray, tmin, tmax, [&](size_t idx, float t0, float t1) {
+			const float z0 = ray.pos().z() + t0 * ray.dir().z();
+			const float z1 = ray.pos().z() + t1 * ray.dir().z();
+
+			const auto& cell = cells[idx];
+
+			if (std::min(z0, z1) > (cell.get_max_height() - RAY_TEST_EPSILON))
+				return false;
+			if (std::max(z0, z1) < (cell.get_min_height() + RAY_TEST_EPSILON))
+				return true;
+
+			return (cell.trace_shadow_ray(ray));
+		}));
+	}
+
+
+	// fills the cells (unless null) and the cones over <heightmap> using up
+	// to <num_threads> threads, bands of rows at a time
+	//
+	// the highest cell within distance r of each cell (a running maximum
+	// over a window of (2r + 1)^2 cells) doubles its window per pass, and
+	// the cells that join it at 2r are at least r away from the footprint;
+	// the cone's ratio is the lowest r / rise over all passes, exact up to
+	// the factor two the windows grow by
+	static void create_cones(t_cell_cone* cones, t_cell_type* cells, const t_heightmap& heightmap, size_t num_threads) {
+		const size_t xsize = heightmap.width() - 1;
+		const size_t ysize = heightmap.height() - 1;
+
+		std::vector<float> heights(xsize * ysize);
+		std::vector<float> window(xsize * ysize);
+		std::vector<float> rows(xsize * ysize);
+
+		for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+			for (size_t y = ymin; y < ymax; y++) {
+				for (size_t x = 0; x < xsize; x++) {
+					t_cell_type cell;
+					cell.set_from_heightmap(heightmap, x, y);
+
+					if (cells != 0)
+						cells[y * xsize + x] = cell;
+
+					heights[y * xsize + x] = cell.get_max_height();
+				}
+			}
+		});
+
+		// window of the 3x3 block around each cell, which is the apex
+		dilate_rows(heights, rows, xsize, ysize, 1, num_threads);
+		dilate_cols(rows, window, xsize, ysize, 1, num_threads);
+
+		for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+			for (size_t n = ymin * xsize; n < ymax * xsize; n++) {
+				cones[n].m_apex = window[n];
+				cones[n].m_ratio = MAX_CONE_RATIO;
+			}
+		});
+
+		for (size_t r = 1; r < std::max(xsize, ysize); r *= 2) {
+			dilate_rows(window, rows, xsize, ysize, r, num_threads);
+			dilate_cols(rows, window, xsize, ysize, r, num_threads);
+
+			for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+				for (size_t n = ymin * xsize; n < ymax * xsize; n++) {
+					const float rise = window[n] - cones[n].m_apex;
+
+					if (rise > 0.0f)
+						cones[n].m_ratio = std::min(cones[n].m_ratio, r / rise);
+				}
+			});
+		}
+	}
+
+	// dst = max of src at offsets -r, 0 and r along x (rows) or y (cols),
+	// where inside the grid
+	static void dilate_rows(const std::vector<float>& src, std::vector<float>& dst, size_t xsize, size_t ysize, size_t r, size_t num_threads) {
+		for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+			for (size_t y = ymin; y < ymax; y++) {
+				const float* src_row = &src[y * xsize];
+				float* dst_row = &dst[y * xsize];
+
+				for (size_t x = 0; x < xsize; x++) {
+					float h = src_row[x];
+
+					if (x >= r)
+						h = std::max(h, src_row[x - r]);
+					if ((x + r) < xsize)
+						h = std::max(h, src_row[x + r]);
+
+					dst_row[x] = h;
+				}
+			}
+		});
+	}
+
+	static void dilate_cols(const std::vector<float>& src, std::vector<float>& dst, size_t xsize, size_t ysize, size_t r, size_t num_threads) {
+		for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+			for (size_t y = ymin; y < ymax; y++) {
+				for (size_t x = 0; x < xsize; x++) {
+					float h = src[y * xsize + x];
+
+					if (y >= r)
+						h = std::max(h, src[(y - r) * xsize + x]);
+					if ((y + r) < ysize)
+						h = std::max(h, src[(y + r) * xsize + x]);
+
+					dst[y * xsize + x] = h;
+				}
+			}
+		});
+	}
+
+	t_cell_grid<t_cell_type> get_cells() const { return (t_cell_grid<t_cell_type>(m_cells, m_xmax)); }
+
+private:
+	// ratio of cones with no higher terrain around them at all, which keeps
+	// the exit times finite
+	static constexpr float MAX_CONE_RATIO = 1e6f;
+
+	// size of the cell-grid
+	size_t m_xmax;
+	size_t m_ymax;
+
+	// source of the cells and cones, kept to expand hits (and to
+	// rebuild cells while tracing if m_cells is null)
+	t_heightmap m_heightmap;
+
+	// both live in the arena, one of each per cell
+	const t_cell_type* m_cells;
+	const t_cell_cone* m_cones;
+};
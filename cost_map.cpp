@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "lib/FreeImage.h"
+
+#include "common.hpp"
+#include "cost_map.hpp"
+
+static const char* COST_METRIC_NAMES[t_cost_map::COST_METRIC_COUNT] = {
+	"nodes",
+	"cells",
+	"shadow",
+	"time",
+};
+
+
+
+int t_cost_map::parse_metric(const char* name) {
+	for (int metric = 0; metric < COST_METRIC_COUNT; metric++) {
+		if (strcmp(name, COST_METRIC_NAMES[metric]) == 0) {
+			return metric;
+		}
+	}
+
+	return -1;
+}
+
+const char* t_cost_map::get_metric_name(int metric) {
+	if (metric < 0 || metric >= COST_METRIC_COUNT)
+		return "none";
+
+	return COST_METRIC_NAMES[metric];
+}
+
+
+void t_cost_map::trace_pixel(const t_scene& scene, size_t x, size_t y, t_const_ray ray) {
+	float cost = 0.0f;
+
+	if (m_metric == COST_METRIC_TIME) {
+		// without counting, which would add to the time
+		const int64_t trace_tick = get_tick();
+		const t_ray_intersection hit = scene.intersect_ray(ray);
+
+		scene.trace_light_mask(hit, 0, hit.time() * ray.spread());
+
+		cost = get_tick() - trace_tick;
+	} else {
+		t_trace_counters counters;
+
+		const t_ray_intersection hit = scene.intersect_counted_ray(ray, counters);
+
+		scene.trace_light_mask(hit, 0, hit.time() * ray.spread(), &counters);
+
+		switch (m_metric) {
+			case COST_METRIC_NODES:  { cost = counters.m_num_nodes;       } break;
+			case COST_METRIC_CELLS:  { cost = counters.m_num_cells;       } break;
+			case COST_METRIC_SHADOW: { cost = counters.m_num_shadow_rays; } break;
+		}
+	}
+
+	m_costs[y * m_xsize + x] = cost;
+}
+
+float t_cost_map::get_scale(size_t percentile) const {
+	if (m_costs.empty())
+		return 1.0f;
+
+	std::vector<float> costs = m_costs;
+	std::vector<float>::iterator it = costs.begin() + ((costs.size() - 1) * std::min(percentile, size_t(100))) / 100;
+
+	std::nth_element(costs.begin(), it, costs.end());
+	return *it;
+}
+
+t_color t_cost_map::get_color(size_t x, size_t y, float scale) const {
+	static const t_color ramp[] = {
+		t_color(0.0f, 0.0f, 0.0f),
+		t_color(0.0f, 0.0f, 1.0f),
+		t_color(1.0f, 0.0f, 0.0f),
+		t_color(1.0f, 1.0f, 0.0f),
+		t_color(1.0f, 1.0f, 1.0f),
+	};
+
+	const size_t num_steps = (sizeof(ramp) / sizeof(ramp[0])) - 1;
+
+	// a map without any cost stays black
+	const float heat = std::max(0.0f, std::min(1.0f, get_cost(x, y) / std::max(scale, 1e-6f))) * num_steps;
+	const size_t step = std::min(size_t(heat), num_steps - 1);
+	const float frac = heat - step;
+
+	t_color color = ramp[step] * (1.0f - frac);
+	color += (ramp[step + 1] * frac);
+	return color;
+}
+
+bool t_cost_map::write_image(const char* file_name, float scale) const {
+	FREE_IMAGE_FORMAT format = FreeImage_GetFIFFromFilename(file_name);
+
+	if (format == FIF_UNKNOWN)
+		format = FIF_PNG;
+
+	FIBITMAP* bitmap = FreeImage_Allocate(m_xsize, m_ysize, 24);
+
+	if (bitmap == 0) {
+		printf("[%s] failed to allocate a %lux%lu image\n", __FUNCTION__, m_xsize, m_ysize);
+		return false;
+	}
+
+	for (size_t y = 0; y < m_ysize; y++) {
+		for (size_t x = 0; x < m_xsize; x++) {
+			const t_color c = get_color(x, y, scale);
+
+			RGBQUAD quad;
+			quad.rgbRed   = BYTE(c.r() * 255.0f + 0.5f);
+			quad.rgbGreen = BYTE(c.g() * 255.0f + 0.5f);
+			quad.rgbBlue  = BYTE(c.b() * 255.0f + 0.5f);
+			quad.rgbReserved = 0;
+
+			FreeImage_SetPixelColor(bitmap, x, y, &quad);
+		}
+	}
+
+	const bool ret = FreeImage_Save(format, bitmap, file_name);
+
+	FreeImage_Unload(bitmap);
+
+	if (!ret)
+		printf("[%s] failed to write %s\n", __FUNCTION__, file_name);
+
+	return ret;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+
+#include "color.hpp"
+#include "ray.hpp"
+#include "scene.hpp"
+
+// per-pixel cost of tracing a frame, measured by one of the COST_METRIC_*
+// and drawn as a heat-ramp instead of the shaded image, so hot spots in the
+// terrain (and badly split regions of a tree) stand out
+//
+// pixels are independent, so threads may trace disjoint sets of them at once
+//
+class t_cost_map {
+public:
+	enum {
+		COST_METRIC_NODES  = 0, // tree-nodes visited by the primary and shadow rays
+		COST_METRIC_CELLS  = 1, // cells tested by the primary and shadow rays
+		COST_METRIC_SHADOW = 2, // shadow rays cast
+		COST_METRIC_TIME   = 3, // ns spent tracing the primary and shadow rays
+		COST_METRIC_COUNT  = 4,
+	};
+
+	t_cost_map() { m_metric = COST_METRIC_NODES; m_xsize = 0; m_ysize = 0; }
+
+	// returns COST_METRIC_* for <name>, or -1
+	static int parse_metric(const char* name);
+	static const char* get_metric_name(int metric);
+
+	void resize(size_t xsize, size_t ysize) {
+		m_xsize = xsize;
+		m_ysize = ysize;
+		m_costs.assign(xsize * ysize, 0.0f);
+	}
+
+	void set_metric(int metric) { m_metric = metric; }
+	int get_metric() const { return m_metric; }
+
+	// traces <ray> (with the shadow rays of its hit) into <scene> as its
+	// trace_ray would, and records the cost as that of pixel (x, y)
+	void trace_pixel(const t_scene& scene, size_t x, size_t y, t_const_ray ray);
+
+	// the cost at the <percentile>-th percentile of all pixels, which gets
+	// the hottest color (a few outliers would otherwise darken the rest)
+	float get_scale(size_t percentile = 99) const;
+	float get_cost(size_t x, size_t y) const { return m_costs[y * m_xsize + x]; }
+
+	// black (no cost) through blue, red and yellow to white (<scale> or more)
+	t_color get_color(size_t x, size_t y, float scale) const;
+
+	// saves the colors as an image (of any type FreeImage can write, by the
+	// extension of <file_name>), bottom row first like t_camera's
+	bool write_image(const char* file_name, float scale) const;
+
+private:
+	int m_metric;
+
+	size_t m_xsize;
+	size_t m_ysize;
+
+	std::vector<float> m_costs;
+};
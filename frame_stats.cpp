@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <string>
+
+#include "frame_stats.hpp"
+
+static const char* FRAME_PHASE_NAMES[t_frame_stats::FRAME_PHASE_COUNT] = {
+	"update",
+	"trace",
+	"draw",
+	"swap",
+	"frame",
+};
+
+// prints one row of percentiles for <times> (ns), which get reordered
+static void print_percentiles(FILE* file, const char* name, std::vector<int64_t>& times) {
+	if (times.empty())
+		return;
+
+	const auto percentile = [&](size_t p) {
+		std::vector<int64_t>::iterator it = times.begin() + ((times.size() - 1) * p) / 100;
+		std::nth_element(times.begin(), it, times.end());
+		return (*it * 1e-6);
+	};
+
+	const double p50 = percentile(50);
+	const double p90 = percentile(90);
+	const double p99 = percentile(99);
+	const double max = *std::max_element(times.begin(), times.end()) * 1e-6;
+
+	fprintf(file, "\t%-10s p50 %8.3fms  p90 %8.3fms  p99 %8.3fms  max %8.3fms\n", name, p50, p90, p99, max);
+}
+
+
+
+void t_frame_stats::reset(size_t num_workers, size_t capacity) {
+	m_num_workers = std::max(num_workers, size_t(1));
+	m_capacity = 1;
+
+	while (m_capacity < capacity)
+		m_capacity <<= 1;
+
+	m_num_frames.store(0);
+
+	m_phase_times.assign(m_capacity * FRAME_PHASE_COUNT, 0);
+	m_trace_times.assign(m_capacity * m_num_workers, 0);
+}
+
+void t_frame_stats::print(FILE* file) const {
+	const size_t num_frames = m_num_frames.load(std::memory_order_acquire);
+	const size_t num_kept = std::min(num_frames, m_capacity);
+
+	std::vector<int64_t> times(num_kept);
+
+	fprintf(file, "\tframe-times over the last %lu frames:\n", num_kept);
+
+	if (num_kept == 0)
+		return;
+
+	for (size_t phase = 0; phase < FRAME_PHASE_COUNT; phase++) {
+		for (size_t n = 0; n < num_kept; n++) {
+			times[n] = m_phase_times[slot(num_frames - num_kept + n) * FRAME_PHASE_COUNT + phase];
+		}
+
+		print_percentiles(file, FRAME_PHASE_NAMES[phase], times);
+	}
+
+	// a worker waits at the barrier for the rest of the main thread's trace-phase
+	for (size_t worker = 0; worker < m_num_workers; worker++) {
+		std::vector<int64_t> wait_times(num_kept);
+
+		for (size_t n = 0; n < num_kept; n++) {
+			const size_t frame_slot = slot(num_frames - num_kept + n);
+
+			times[n] = m_trace_times[frame_slot * m_num_workers + worker];
+			wait_times[n] = std::max(int64_t(0), m_phase_times[frame_slot * FRAME_PHASE_COUNT + FRAME_PHASE_TRACE] - times[n]);
+		}
+
+		char name[32];
+
+		snprintf(name, sizeof(name), "trace[%lu]", worker);
+		print_percentiles(file, name, times);
+		snprintf(name, sizeof(name), "wait[%lu]", worker);
+		print_percentiles(file, name, wait_times);
+	}
+
+	// frame-times in power-of-two buckets of milliseconds (bucket b holds
+	// those below 2^b ms)
+	std::vector<size_t> buckets;
+
+	for (size_t n = 0; n < num_kept; n++) {
+		const int64_t time = m_phase_times[slot(num_frames - num_kept + n) * FRAME_PHASE_COUNT + FRAME_PHASE_TOTAL];
+
+		size_t bucket = 0;
+
+		while ((int64_t(1000000) << bucket) <= time)
+			bucket++;
+
+		if (bucket >= buckets.size())
+			buckets.resize(bucket + 1, 0);
+
+		buckets[bucket] += 1;
+	}
+
+	fprintf(file, "\tframe-time histogram:\n");
+
+	for (size_t bucket = 0; bucket < buckets.size(); bucket++) {
+		if (buckets[bucket] == 0)
+			continue;
+
+		const size_t bar = (buckets[bucket] * 50 + num_kept - 1) / num_kept;
+
+		fprintf(file, "\t< %6lums %6lu |%s\n", (size_t(1) << bucket), buckets[bucket], std::string(bar, '#').c_str());
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// per-frame timings of the renderer's phases, kept for the last <capacity>
+// frames in a ring and summarized as percentiles (an average hides stutter)
+//
+// the main thread records the phases of a frame and publishes it through
+// end_frame; workers record their own trace-time for the current frame into
+// a slot of their own, so no locks are needed as long as the frame is not
+// published before every worker is done (which the renderer's barriers
+// guarantee)
+//
+class t_frame_stats {
+public:
+	enum {
+		FRAME_PHASE_UPDATE = 0, // camera and light update
+		FRAME_PHASE_TRACE  = 1, // main thread waiting for the workers (or tracing itself)
+		FRAME_PHASE_DRAW   = 2, // draw_image
+		FRAME_PHASE_SWAP   = 3, // glutSwapBuffers
+		FRAME_PHASE_TOTAL  = 4, // whole frame, incl. the time outside of display
+		FRAME_PHASE_COUNT  = 5,
+	};
+
+	t_frame_stats(size_t num_workers = 1, size_t capacity = 4096) { reset(num_workers, capacity); }
+
+	void reset(size_t num_workers, size_t capacity);
+
+	// main thread only
+	void set_phase_time(size_t phase, int64_t time) { m_phase_times[slot(m_num_frames.load(std::memory_order_relaxed)) * FRAME_PHASE_COUNT + phase] = time; }
+	void end_frame() { m_num_frames.store(m_num_frames.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+	// worker threads, for the frame that is not yet published
+	void set_trace_time(size_t worker, int64_t time) { m_trace_times[slot(m_num_frames.load(std::memory_order_acquire)) * m_num_workers + worker] = time; }
+
+	size_t num_frames() const { return (m_num_frames.load(std::memory_order_acquire)); }
+
+	// prints p50/p90/p99/max of every phase (and of every worker's trace- and
+	// wait-time) over the frames still in the ring, plus a histogram of the
+	// frame-times
+	void print(FILE* file) const;
+
+private:
+	size_t slot(size_t frame) const { return (frame & (m_capacity - 1)); }
+
+private:
+	size_t m_num_workers;
+	// power of two
+	size_t m_capacity;
+
+	std::atomic<size_t> m_num_frames;
+
+	// <capacity> rows of FRAME_PHASE_COUNT and <num_workers> times, in ns
+	std::vector<int64_t> m_phase_times;
+	std::vector<int64_t> m_trace_times;
+};
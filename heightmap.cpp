@@ -1,81 +1,529 @@
 #include <algorithm>
+#include <cctype>
 #include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
 #include <vector>
 
 #include "lib/FreeImage.h"
 #include "heightmap.hpp"
+#include "parallel.hpp"
+
+// converts one row of pixels with <num_channels> interleaved channels, of
+// which (at most) the first three are summed; these loops are kept simple
+// enough for the compiler to vectorize
+template<typename t_channel, size_t num_channels>
+static void convert_row(float* dst, const t_channel* src, size_t xsize, float scale) {
+	if (num_channels == 1) {
+		for (size_t x = 0; x < xsize; x++) {
+			dst[x] = src[x] * scale;
+		}
+	} else {
+		for (size_t x = 0; x < xsize; x++) {
+			dst[x] = (src[x * num_channels + 0] + src[x * num_channels + 1] + src[x * num_channels + 2]) * scale;
+		}
+	}
+}
 
-void t_heightmap::set_data(FIBITMAP* source, float scale) {
-	m_xsize = FreeImage_GetWidth(source);
-	m_ysize = FreeImage_GetHeight(source);
+template<typename t_channel, size_t num_channels>
+static void convert_rows(float* data, const BYTE* bits, ptrdiff_t pitch, size_t xsize, size_t ysize, float scale, size_t num_threads) {
+	for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+		for (size_t y = ymin; y < ymax; y++) {
+			convert_row<t_channel, num_channels>(data + y * xsize, reinterpret_cast<const t_channel*>(bits + y * pitch), xsize, scale);
+		}
+	});
+}
+
+
+// whether set_rows converts <source> directly, other types are converted
+// to one of these first
+static bool is_common_type(FIBITMAP* source) {
+	const FREE_IMAGE_TYPE type = FreeImage_GetImageType(source);
+	const unsigned int bpp = FreeImage_GetBPP(source);
+
+	if (type == FIT_BITMAP)
+		return (bpp == 8 || bpp == 24 || bpp == 32);
 
-	if (m_data != 0)
+	return (type == FIT_UINT16 || type == FIT_RGB16 || type == FIT_RGBA16 || type == FIT_FLOAT);
+}
+
+static FIBITMAP* convert_to_common_type(FIBITMAP* source) {
+	if (FreeImage_GetImageType(source) == FIT_BITMAP)
+		return (FreeImage_ConvertTo24Bits(source));
+
+	return (FreeImage_ConvertToType(source, FIT_FLOAT));
+}
+
+
+bool t_heightmap::set_data(FIBITMAP* source, float scale, size_t num_threads) {
+	if (source == 0) {
 		delete_data();
+		return false;
+	}
+
+	return (set_rows(source, scale, 0, FreeImage_GetHeight(source), num_threads));
+}
+
+bool t_heightmap::set_rows(FIBITMAP* source, float scale, size_t ymin, size_t ymax, size_t num_threads) {
+	delete_data();
+
+	if (source == 0 || ymin >= ymax || ymax > FreeImage_GetHeight(source))
+		return false;
+
+	// uncommon layouts are converted to one of the common ones first
+	if (!is_common_type(source)) {
+		FIBITMAP* converted = convert_to_common_type(source);
+		const bool ret = (converted != 0) && set_rows(converted, scale, ymin, ymax, num_threads);
+
+		FreeImage_Unload(converted);
+		return ret;
+	}
+
+	const FREE_IMAGE_TYPE type = FreeImage_GetImageType(source);
+	const unsigned int bpp = FreeImage_GetBPP(source);
+
+	m_xsize = FreeImage_GetWidth(source);
+	m_ysize = ymax - ymin;
+	m_layout.reset(m_xsize, m_ysize, t_sample_layout::LAYOUT_LINEAR, 1);
 
 	m_data = new float[m_xsize * m_ysize];
-    
-	for (size_t y = 0; y < m_ysize; y++) {
-		for (size_t x = 0; x < m_xsize; x++) {
-			RGBQUAD rawColor;
-			FreeImage_GetPixelColor(source, x, y, &rawColor);
 
-			at(x, y) = (rawColor.rgbRed / 255.0f + rawColor.rgbGreen / 255.0f + rawColor.rgbBlue / 255.0f) * scale / 3.0f;
+	const ptrdiff_t pitch = FreeImage_GetPitch(source);
+	const BYTE* bits = FreeImage_GetBits(source) + ymin * pitch;
+
+	switch (type) {
+		case FIT_UINT16: { convert_rows<uint16_t, 1>(m_data, bits, pitch, m_xsize, m_ysize, scale / 65535.0f, num_threads); } break;
+		case FIT_RGB16:  { convert_rows<uint16_t, 3>(m_data, bits, pitch, m_xsize, m_ysize, scale / (3.0f * 65535.0f), num_threads); } break;
+		case FIT_RGBA16: { convert_rows<uint16_t, 4>(m_data, bits, pitch, m_xsize, m_ysize, scale / (3.0f * 65535.0f), num_threads); } break;
+		case FIT_FLOAT:  { convert_rows<   float, 1>(m_data, bits, pitch, m_xsize, m_ysize, scale, num_threads); } break;
+
+		default: {
+			if (bpp == 24) { convert_rows<uint8_t, 3>(m_data, bits, pitch, m_xsize, m_ysize, scale / (3.0f * 255.0f), num_threads); break; }
+			if (bpp == 32) { convert_rows<uint8_t, 4>(m_data, bits, pitch, m_xsize, m_ysize, scale / (3.0f * 255.0f), num_threads); break; }
+
+			// palettized, look every index up once
+			const RGBQUAD* palette = FreeImage_GetPalette(source);
+
+			float heights[256];
+
+			for (size_t n = 0; n < 256; n++) {
+				if (palette != 0) {
+					heights[n] = (palette[n].rgbRed + palette[n].rgbGreen + palette[n].rgbBlue) * scale / (3.0f * 255.0f);
+				} else {
+					heights[n] = n * scale / 255.0f;
+				}
+			}
+
+			for_each_band(m_ysize, num_threads, [&](size_t ymin, size_t ymax) {
+				for (size_t y = ymin; y < ymax; y++) {
+					for (size_t x = 0; x < m_xsize; x++) {
+						m_data[y * m_xsize + x] = heights[bits[y * pitch + x]];
+					}
+				}
+			});
+		} break;
+	}
+
+	return true;
+}
+
+
+bool t_heightmap::load(const char* file_name, float scale, size_t num_threads) {
+	t_heightmap_reader reader;
+
+	delete_data();
+
+	// prints the reason if it fails
+	if (!reader.open(file_name, scale))
+		return false;
+
+	return (reader.read_rows(*this, 0, reader.height(), num_threads));
+}
+
+bool t_heightmap::load_raw(const char* file_name, size_t sample_size, float scale, size_t num_threads) {
+	t_heightmap_reader reader;
+
+	delete_data();
+
+	if (!reader.open_raw(file_name, sample_size, scale))
+		return false;
+
+	return (reader.read_rows(*this, 0, reader.height(), num_threads));
+}
+
+
+
+bool t_heightmap_reader::open(const char* file_name, float scale) {
+	close();
+
+	std::string ext = file_name;
+	ext = ext.substr(std::min(ext.size(), ext.find_last_of('.')));
+
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return char(tolower(c)); });
+
+	if (ext == ".r16" || ext == ".raw")
+		return (open_raw(file_name, sizeof(uint16_t), scale));
+	if (ext == ".r32" || ext == ".f32")
+		return (open_raw(file_name, sizeof(float), scale));
+
+	FREE_IMAGE_FORMAT format = FreeImage_GetFileType(file_name);
+
+	if (format == FIF_UNKNOWN)
+		format = FreeImage_GetFIFFromFilename(file_name);
+
+	if (format == FIF_UNKNOWN) {
+		printf("[%s] unknown image format of %s\n", __FUNCTION__, file_name);
+		return false;
+	}
+
+	FIBITMAP* bitmap = FreeImage_Load(format, file_name);
+
+	if (bitmap == 0) {
+		printf("[%s] failed to load %s\n", __FUNCTION__, file_name);
+		return false;
+	}
+
+	// convert once here rather than for every band
+	if (!is_common_type(bitmap)) {
+		FIBITMAP* converted = convert_to_common_type(bitmap);
+
+		FreeImage_Unload(bitmap);
+
+		if ((bitmap = converted) == 0) {
+			printf("[%s] unsupported image type of %s\n", __FUNCTION__, file_name);
+			return false;
 		}
 	}
+
+	m_bitmap = bitmap;
+	m_xsize = FreeImage_GetWidth(bitmap);
+	m_ysize = FreeImage_GetHeight(bitmap);
+	m_scale = scale;
+	return true;
+}
+
+bool t_heightmap_reader::open_raw(const char* file_name, size_t sample_size, float scale) {
+	close();
+
+	FILE* file = fopen(file_name, "rb");
+
+	if (file == 0) {
+		printf("[%s] failed to open %s\n", __FUNCTION__, file_name);
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+
+	const size_t num_samples = ftell(file) / sample_size;
+	const size_t size = std::sqrt(double(num_samples)) + 0.5;
+
+	if (size < 2 || (size * size) != num_samples) {
+		printf("[%s] %s does not hold a square map of %lu-byte samples\n", __FUNCTION__, file_name, sample_size);
+		fclose(file);
+		return false;
+	}
+
+	m_file = file;
+	m_file_name = file_name;
+	m_sample_size = sample_size;
+	m_xsize = size;
+	m_ysize = size;
+	m_scale = scale;
+	return true;
+}
+
+void t_heightmap_reader::close() {
+	if (m_file != 0)
+		fclose(m_file);
+	if (m_bitmap != 0)
+		FreeImage_Unload(m_bitmap);
+
+	m_file = 0;
+	m_bitmap = 0;
+	m_file_name.clear();
+	m_sample_size = 0;
+	m_xsize = 0;
+	m_ysize = 0;
+	m_scale = 1.0f;
+}
+
+bool t_heightmap_reader::read_rows(t_heightmap& heightmap, size_t ymin, size_t ymax, size_t num_threads) {
+	if (m_bitmap != 0)
+		return (heightmap.set_rows(m_bitmap, m_scale, ymin, ymax, num_threads));
+
+	heightmap.delete_data();
+
+	if (m_file == 0 || ymin >= ymax || ymax > m_ysize)
+		return false;
+
+	const size_t num_rows = ymax - ymin;
+	const size_t row_size = m_xsize * m_sample_size;
+
+	std::vector<uint8_t> samples(num_rows * row_size);
+
+	// the first row of the file is the top one, i.e. row (m_ysize - 1) of images
+	bool ok = true;
+
+	ok = ok && (fseek(m_file, (m_ysize - ymax) * row_size, SEEK_SET) == 0);
+	ok = ok && (fread(&samples[0], row_size, num_rows, m_file) == num_rows);
+
+	if (!ok) {
+		printf("[%s] failed to read %s\n", __FUNCTION__, m_file_name.c_str());
+		return false;
+	}
+
+	float* data = new float[m_xsize * num_rows];
+
+	// flip the rows to match the orientation of images
+	const BYTE* bits = &samples[(num_rows - 1) * row_size];
+	const ptrdiff_t pitch = -ptrdiff_t(row_size);
+
+	if (m_sample_size == sizeof(uint16_t)) {
+		convert_rows<uint16_t, 1>(data, bits, pitch, m_xsize, num_rows, m_scale / 65535.0f, num_threads);
+	} else {
+		convert_rows<   float, 1>(data, bits, pitch, m_xsize, num_rows, m_scale, num_threads);
+	}
+
+	heightmap.adopt_data(data, m_xsize, num_rows);
+	return true;
 }
 
 void t_heightmap::set_data(const t_heightmap& heightmap) {
+	delete_data();
+
 	m_xsize = heightmap.width();
 	m_ysize = heightmap.height();
+	m_layout = heightmap.m_layout;
 
-	if (m_data != 0)
-		delete_data();
+	// samples keep their layout
+	if (heightmap.is_quantized()) {
+		m_qdata = new uint16_t[num_samples()];
+		m_qscale = heightmap.quantized_scale();
+		m_qoffset = heightmap.quantized_offset();
 
-	m_data = new float[m_xsize * m_ysize];
+		std::copy(heightmap.quantized_data(), heightmap.quantized_data() + num_samples(), m_qdata);
+		return;
+	}
 
-	for (size_t y = 0; y < m_ysize; y++) {
-		for (size_t x = 0; x < m_xsize; x++) {
-			at(x, y) = heightmap.at(x, y);
-		}
+	m_data = new float[num_samples()];
+
+	std::copy(heightmap.data(), heightmap.data() + num_samples(), m_data);
+}
+
+void t_heightmap::set_data(const float* data, size_t xsize, size_t ysize, int layout) {
+	delete_data();
+
+	m_xsize = xsize;
+	m_ysize = ysize;
+	m_layout.reset(xsize, ysize, layout, get_layout_block_size(layout));
+
+	// never written through, at() on a read-only mapping is not allowed
+	m_data = const_cast<float*>(data);
+	m_owns_data = false;
+}
+
+void t_heightmap::set_quantized_data(const uint16_t* data, size_t xsize, size_t ysize, float scale, float offset, int layout) {
+	delete_data();
+
+	m_xsize = xsize;
+	m_ysize = ysize;
+	m_layout.reset(xsize, ysize, layout, get_layout_block_size(layout));
+
+	m_qdata = const_cast<uint16_t*>(data);
+	m_qscale = scale;
+	m_qoffset = offset;
+	m_owns_data = false;
+}
+
+
+void t_heightmap::quantize() {
+	if (m_data == 0)
+		return;
+
+	// padding repeats the edge samples, so it does not change the range
+	const size_t num_samples = m_layout.num_samples();
+
+	float min_height =  FLT_MAX;
+	float max_height = -FLT_MAX;
+
+	for (size_t n = 0; n < num_samples; n++) {
+		min_height = std::min(min_height, m_data[n]);
+		max_height = std::max(max_height, m_data[n]);
+	}
+
+	const float scale = std::max(max_height - min_height, FLT_MIN) / 65535.0f;
+
+	uint16_t* samples = new uint16_t[num_samples];
+
+	for (size_t n = 0; n < num_samples; n++) {
+		samples[n] = std::min(65535.0f, (m_data[n] - min_height) / scale + 0.5f);
+	}
+
+	adopt_quantized_data(samples, m_xsize, m_ysize, scale, min_height, m_layout.type());
+}
+
+void t_heightmap::set_layout(int layout) {
+	if (layout == m_layout.type() || (m_data == 0 && m_qdata == 0))
+		return;
+
+	t_sample_layout dst_layout;
+	dst_layout.reset(m_xsize, m_ysize, layout, get_layout_block_size(layout));
+
+	if (m_qdata != 0) {
+		uint16_t* samples = new uint16_t[dst_layout.num_samples()];
+
+		t_sample_layout::copy_samples(samples, dst_layout, m_qdata, m_layout, m_xsize, m_ysize);
+		adopt_quantized_data(samples, m_xsize, m_ysize, m_qscale, m_qoffset, layout);
+	} else {
+		float* samples = new float[dst_layout.num_samples()];
+
+		t_sample_layout::copy_samples(samples, dst_layout, m_data, m_layout, m_xsize, m_ysize);
+		adopt_data(samples, m_xsize, m_ysize, layout);
 	}
 }
 
 
-float t_heightmap::get_max_height_x(size_t x, size_t ymin, size_t ymax) const {
-	float result = -FLT_MAX;
+// splits [min, max) into aligned blocks of 2^k, the widest that fit; fills
+// <blocks> with {k, min >> k} of each and returns their number (at most two
+// per bit of max - min)
+static size_t split_range(size_t min, size_t max, size_t blocks[][2]) {
+	size_t num_blocks = 0;
+
+	while (min < max) {
+		size_t k = 0;
+
+		while (((min >> k) & 1) == 0 && (min + (size_t(2) << k)) <= max)
+			k++;
+
+		blocks[num_blocks][0] = k;
+		blocks[num_blocks][1] = min >> k;
+		num_blocks++;
 
-	for (size_t y = ymin; y < ymax; y++)
-		result = std::max(result, at(x, y));
+		min += (size_t(1) << k);
+	}
 
-	return result;
+	return num_blocks;
 }
 
-float t_heightmap::get_min_height_x(size_t x, size_t ymin, size_t ymax) const {
-	float result = FLT_MAX;
 
-	for (size_t y = ymin; y < ymax; y++)
-		result = std::min(result, at(x, y));
+void t_heightmap::build_range_index(size_t num_threads) {
+	clear_range_index();
+
+	if (m_xsize == 0 || m_ysize == 0)
+		return;
+
+	// enough levels for one block to cover each axis
+	size_t num_levels_x = 1;
+	size_t num_levels_y = 1;
+
+	while ((size_t(1) << (num_levels_x - 1)) < m_xsize)
+		num_levels_x++;
+	while ((size_t(1) << (num_levels_y - 1)) < m_ysize)
+		num_levels_y++;
+
+	m_range_offsets.resize(num_levels_x * num_levels_y, 0);
 
-	return result;
+	size_t num_ranges = 0;
+
+	for (size_t j = 0; j < num_levels_y; j++) {
+		for (size_t i = 0; i < num_levels_x; i++) {
+			m_range_offsets[j * num_levels_x + i] = num_ranges;
+
+			if ((i | j) != 0) {
+				num_ranges += (get_range_level_xsize(i) * get_range_level_ysize(j));
+			}
+		}
+	}
+
+	m_ranges.resize(num_ranges);
+	m_num_range_levels_x = num_levels_x;
+
+	// level (i, 0) pairs up the blocks of (i - 1, 0) along x, every other
+	// level (i, j) those of (i, j - 1) along y
+	for (size_t j = 0; j < num_levels_y; j++) {
+		for (size_t i = (j == 0)? 1: 0; i < num_levels_x; i++) {
+			const size_t xsize = get_range_level_xsize(i);
+			const size_t ysize = get_range_level_ysize(j);
+
+			const size_t src_i = (j == 0)? (i - 1): i;
+			const size_t src_j = (j == 0)? j: (j - 1);
+			const size_t src_xsize = get_range_level_xsize(src_i);
+			const size_t src_ysize = get_range_level_ysize(src_j);
+
+			t_height_range* ranges = &m_ranges[m_range_offsets[j * num_levels_x + i]];
+
+			for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+				for (size_t y = ymin; y < ymax; y++) {
+					for (size_t x = 0; x < xsize; x++) {
+						const size_t x1 = (j == 0)? std::min(x * 2 + 1, src_xsize - 1): x;
+						const size_t y1 = (j == 0)? y: std::min(y * 2 + 1, src_ysize - 1);
+
+						const t_height_range r0 = get_block_range(src_i, src_j, (j == 0)? (x * 2): x, (j == 0)? y: (y * 2));
+						const t_height_range r1 = get_block_range(src_i, src_j, x1, y1);
+
+						ranges[y * xsize + x].m_min = std::min(r0.m_min, r1.m_min);
+						ranges[y * xsize + x].m_max = std::max(r0.m_max, r1.m_max);
+					}
+				}
+			});
+		}
+	}
 }
 
+void t_heightmap::get_height_range(size_t xmin, size_t xmax, size_t ymin, size_t ymax, float& min_height, float& max_height) const {
+	min_height =  FLT_MAX;
+	max_height = -FLT_MAX;
+
+	if (!has_range_index()) {
+		for (size_t y = ymin; y < ymax; y++) {
+			for (size_t x = xmin; x < xmax; x++) {
+				min_height = std::min(min_height, at(x, y));
+				max_height = std::max(max_height, at(x, y));
+			}
+		}
+
+		return;
+	}
+
+	size_t xblocks[sizeof(size_t) * 16][2];
+	size_t yblocks[sizeof(size_t) * 16][2];
 
-float t_heightmap::get_max_height_y(size_t y, size_t xmin, size_t xmax) const {
-	float result = -FLT_MAX;
+	const size_t num_xblocks = split_range(xmin, xmax, xblocks);
+	const size_t num_yblocks = split_range(ymin, ymax, yblocks);
 
-	for (size_t x = xmin; x < xmax; x++)
-		result = std::max(result, at(x, y));
+	for (size_t n = 0; n < num_yblocks; n++) {
+		for (size_t m = 0; m < num_xblocks; m++) {
+			const t_height_range range = get_block_range(xblocks[m][0], yblocks[n][0], xblocks[m][1], yblocks[n][1]);
 
-	return result;
+			min_height = std::min(min_height, range.m_min);
+			max_height = std::max(max_height, range.m_max);
+		}
+	}
 }
 
-float t_heightmap::get_min_height_y(size_t y, size_t xmin, size_t xmax) const {
-	float result = FLT_MAX;
+bool t_heightmap::is_planar(size_t xmin, size_t xmax, size_t ymin, size_t ymax, float max_error) const {
+	const float z00 = at(xmin, ymin    ), z10 = at(xmax - 1, ymin    );
+	const float z01 = at(xmin, ymax - 1), z11 = at(xmax - 1, ymax - 1);
 
-	for (size_t x = xmin; x < xmax; x++)
-		result = std::min(result, at(x, y));
+	const float xmid = (xmin + xmax - 1) * 0.5f;
+	const float ymid = (ymin + ymax - 1) * 0.5f;
 
-	return result;
+	const float zmid = (z00 + z10 + z01 + z11) * 0.25f;
+	const float dzdx = ((z10 - z00) + (z11 - z01)) * 0.5f / std::max(float(xmax - 1 - xmin), 1.0f);
+	const float dzdy = ((z01 - z00) + (z11 - z10)) * 0.5f / std::max(float(ymax - 1 - ymin), 1.0f);
+
+	for (size_t y = ymin; y < ymax; y++) {
+		for (size_t x = xmin; x < xmax; x++) {
+			if (std::fabs(at(x, y) - (zmid + dzdx * (x - xmid) + dzdy * (y - ymid))) > max_error) {
+				return false;
+			}
+		}
+	}
+
+	return true;
 }
 
 
@@ -89,26 +537,28 @@ void t_heightmap::get_opt_split_x(float& score, size_t& split,  size_t xmin, siz
 	std::vector<float> max_height_neg(dx - 2);
 	std::vector<float> min_height_neg(dx - 2);
 
-	float max_height = get_max_height_x(xmin, ymin, ymax);
-	float min_height = get_min_height_x(xmin, ymin, ymax);
+	// range of every column, each is needed twice
+	std::vector<float> max_heights(dx);
+	std::vector<float> min_heights(dx);
 
-	for (size_t i = 1; i < dx - 1; i++) {
-		const float cur_max_height = get_max_height_x(xmin + i, ymin, ymax);
-		const float cur_min_height = get_min_height_x(xmin + i, ymin, ymax);
+	for (size_t i = 0; i < dx; i++) {
+		get_height_range(xmin + i, xmin + i + 1, ymin, ymax, min_heights[i], max_heights[i]);
+	}
+
+	float max_height = max_heights[0];
+	float min_height = min_heights[0];
 
-		max_height_pos[i - 1] = (max_height = std::max(max_height, cur_max_height));
-		min_height_pos[i - 1] = (min_height = std::min(min_height, cur_min_height));
+	for (size_t i = 1; i < dx - 1; i++) {
+		max_height_pos[i - 1] = (max_height = std::max(max_height, max_heights[i]));
+		min_height_pos[i - 1] = (min_height = std::min(min_height, min_heights[i]));
 	}
 
-	max_height = get_max_height_x(xmax - 1, ymin, ymax);
-	min_height = get_min_height_x(xmax - 1, ymin, ymax);
+	max_height = max_heights[dx - 1];
+	min_height = min_heights[dx - 1];
 
 	for (size_t i = dx - 2; i >= 1; i--) {
-		const float cur_max_height = get_max_height_x(xmin + i, ymin, ymax);
-		const float cur_min_height = get_min_height_x(xmin + i, ymin, ymax);
-
-		max_height_neg[i - 1] = (max_height = std::max(max_height, cur_max_height));
-		min_height_neg[i - 1] = (min_height = std::min(min_height, cur_min_height));
+		max_height_neg[i - 1] = (max_height = std::max(max_height, max_heights[i]));
+		min_height_neg[i - 1] = (min_height = std::min(min_height, min_heights[i]));
 	}
 
 	score = FLT_MAX;
@@ -143,26 +593,28 @@ void t_heightmap::get_opt_split_y(float& score, size_t& split,  size_t xmin, siz
 	std::vector<float> max_height_neg(dy - 2);
 	std::vector<float> min_height_neg(dy - 2);
 
-	float max_height = get_max_height_y(ymin, xmin, xmax);
-	float min_height = get_min_height_y(ymin, xmin, xmax);
+	// range of every row, each is needed twice
+	std::vector<float> max_heights(dy);
+	std::vector<float> min_heights(dy);
 
-	for (size_t i = 1; i < dy - 1; i++) {
-		const float cur_max_height = get_max_height_y(ymin + i, xmin, xmax);
-		const float cur_min_height = get_min_height_y(ymin + i, xmin, xmax);
+	for (size_t i = 0; i < dy; i++) {
+		get_height_range(xmin, xmax, ymin + i, ymin + i + 1, min_heights[i], max_heights[i]);
+	}
+
+	float max_height = max_heights[0];
+	float min_height = min_heights[0];
 
-		max_height_pos[i - 1] = (max_height = std::max(max_height, cur_max_height));
-		min_height_pos[i - 1] = (min_height = std::min(min_height, cur_min_height));
+	for (size_t i = 1; i < dy - 1; i++) {
+		max_height_pos[i - 1] = (max_height = std::max(max_height, max_heights[i]));
+		min_height_pos[i - 1] = (min_height = std::min(min_height, min_heights[i]));
 	}
 
-	max_height = get_max_height_y(ymax - 1, xmin, xmax);
-	min_height = get_min_height_y(ymax - 1, xmin, xmax);
+	max_height = max_heights[dy - 1];
+	min_height = min_heights[dy - 1];
 
 	for (size_t i = dy - 2; i >= 1; i--) {
-		const float cur_max_height = get_max_height_y(ymin + i, xmin, xmax);
-		const float cur_min_height = get_min_height_y(ymin + i, xmin, xmax);
-
-		max_height_neg[i - 1] = (max_height = std::max(max_height, cur_max_height));
-		min_height_neg[i - 1] = (min_height = std::min(min_height, cur_min_height));
+		max_height_neg[i - 1] = (max_height = std::max(max_height, max_heights[i]));
+		min_height_neg[i - 1] = (min_height = std::min(min_height, min_heights[i]));
 	}
 
 	score = FLT_MAX;
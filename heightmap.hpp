@@ -1,37 +1,247 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "sample_layout.hpp"
 
 class FIBITMAP;
 class t_heightmap {
 public:
-	t_heightmap() { m_xsize = 0; m_ysize = 0; m_data = 0; }
-	t_heightmap(FIBITMAP* source, float scale) { set_data(source, scale); }
+	t_heightmap() { init(); }
+	t_heightmap(const t_heightmap& heightmap) { init(); set_data(heightmap); }
+	t_heightmap(FIBITMAP* source, float scale) { init(); set_data(source, scale); }
 	~t_heightmap() { delete_data(); }
 
+	t_heightmap& operator = (const t_heightmap& heightmap) {
+		if (this != &heightmap)
+			set_data(heightmap);
+
+		return *this;
+	}
+
 	size_t width() const { return m_xsize; }
 	size_t height() const { return m_ysize; }
 
-	float  at(size_t x, size_t y) const { return m_data[y * m_xsize + x]; }
-	float& at(size_t x, size_t y)       { return m_data[y * m_xsize + x]; }
+	float at(size_t x, size_t y) const {
+		if (m_qdata != 0)
+			return (m_qoffset + m_qdata[m_layout.get_index(x, y)] * m_qscale);
+
+		return m_data[m_layout.get_index(x, y)];
+	}
 
-	void set_data(FIBITMAP* source, float scale);
+	// NOTE: not available for quantized samples
+	float& at(size_t x, size_t y) { return m_data[m_layout.get_index(x, y)]; }
+
+	// converts <source> to heights in [0, scale] (the mean of its RGB channels
+	// for colour images; float images are only multiplied by <scale>) using up
+	// to <num_threads> threads, whole scanlines at a time; returns false if the
+	// image type is not supported
+	bool set_data(FIBITMAP* source, float scale, size_t num_threads = 1);
+	// as above for rows [ymin, ymax) of <source> only, which become rows 0
+	// to (ymax - ymin - 1)
+	bool set_rows(FIBITMAP* source, float scale, size_t ymin, size_t ymax, size_t num_threads = 1);
 	void set_data(const t_heightmap& heightmap);
-	void delete_data() { delete[] m_data; m_data = 0; }
+	// wraps external (e.g. memory-mapped) samples without copying or owning
+	// them; <layout> (t_sample_layout::LAYOUT_*) is the order they are in
+	void set_data(const float* data, size_t xsize, size_t ysize, int layout = t_sample_layout::LAYOUT_LINEAR);
+	// takes ownership of <data>, which must have been allocated by new[]
+	void adopt_data(float* data, size_t xsize, size_t ysize, int layout = t_sample_layout::LAYOUT_LINEAR) {
+		set_data(data, xsize, ysize, layout);
+		m_owns_data = true;
+	}
+
+	// as above for 16-bit samples, which represent heights offset + sample * scale
+	void set_quantized_data(const uint16_t* data, size_t xsize, size_t ysize, float scale, float offset, int layout = t_sample_layout::LAYOUT_LINEAR);
+	void adopt_quantized_data(uint16_t* data, size_t xsize, size_t ysize, float scale, float offset, int layout = t_sample_layout::LAYOUT_LINEAR) {
+		set_quantized_data(data, xsize, ysize, scale, offset, layout);
+		m_owns_data = true;
+	}
+
+	// loads any image format FreeImage can identify, or a square raw file of
+	// little-endian 16-bit (.r16, .raw) or float (.r32, .f32) samples whose
+	// first row is the top one (row 0 of images loaded by FreeImage is the
+	// bottom one)
+	bool load(const char* file_name, float scale, size_t num_threads = 1);
+	bool load_raw(const char* file_name, size_t sample_size, float scale, size_t num_threads = 1);
+
+	// converts float samples to 16-bit ones spanning [min, max] height,
+	// halving the footprint at an error of at most (max - min) / 2^17
+	void quantize();
+
+	// reorders the samples into <layout> (t_sample_layout::LAYOUT_*); all
+	// maps are loaded row-major, blocked ones suit the 2D access patterns
+	// of tree-builds and traversals better
+	void set_layout(int layout);
+	int get_layout() const { return m_layout.type(); }
+
+	// side of the blocks of <layout>: 8 samples (two or four cache-lines per
+	// block-row) when blocked, 32 (one to two pages per block) in Z-order
+	static size_t get_layout_block_size(int layout) {
+		return ((layout == t_sample_layout::LAYOUT_MORTON)? 32: 8);
+	}
+
+	void delete_data() {
+		if (m_owns_data) {
+			delete[] m_data;
+			delete[] m_qdata;
+		}
+
+		m_data = 0;
+		m_qdata = 0;
+		m_owns_data = true;
+
+		clear_range_index();
+	}
+
+	bool is_quantized() const { return (m_qdata != 0); }
+
+	// raw samples in the order of get_layout(), only one of these is non-null
+	const float* data() const { return m_data; }
+	const uint16_t* quantized_data() const { return m_qdata; }
+
+	float quantized_scale() const { return m_qscale; }
+	float quantized_offset() const { return m_qoffset; }
+
+	size_t num_samples() const { return m_layout.num_samples(); }
+	size_t num_bytes() const { return (num_samples() * ((m_qdata != 0)? sizeof(uint16_t): sizeof(float))); }
+
+	// indexes the lowest and highest sample of every aligned block of 2^i
+	// by 2^j samples (i, j >= 0), using up to <num_threads> threads; takes
+	// about three times the memory of float samples, twice over (min and
+	// max), and is dropped whenever the samples change (or are copied)
+	//
+	// a sparse table (the range of the 2^i by 2^j block at every sample,
+	// not just at aligned ones) would answer any query from four blocks
+	// that overlap, but holds log2(width) * log2(height) ranges per sample
+	// (144 for a 4096^2 map), and one table per row still log2(width) of
+	// them; aligned blocks hold about three ranges per sample at the cost
+	// of logarithmically many lookups per query
+	void build_range_index(size_t num_threads = 1);
+	void clear_range_index() {
+		m_ranges.clear();
+		m_range_offsets.clear();
+		m_num_range_levels_x = 0;
+	}
+
+	bool has_range_index() const { return (!m_range_offsets.empty()); }
+
+	// lowest and highest sample in [xmin, xmax) x [ymin, ymax), from at most
+	// (2 * log2(xmax - xmin) + 1) * (2 * log2(ymax - ymin) + 1) blocks of the
+	// range index if there is one, i.e. logarithmically many for the rows
+	// and columns split searches query, else by visiting every sample
+	void get_height_range(size_t xmin, size_t xmax, size_t ymin, size_t ymax, float& min_height, float& max_height) const;
+
+	// whether every sample in [xmin, xmax) x [ymin, ymax) lies within
+	// <max_error> of the plane through the mean height and mean slopes
+	// of its corners; stops at the first sample that does not
+	bool is_planar(size_t xmin, size_t xmax, size_t ymin, size_t ymax, float max_error) const;
 
 	// determines split position for e.g. kd-trees
 	void get_opt_split_x(float& score, size_t& split,  size_t xmin, size_t xmax, size_t ymin, size_t ymax) const;
 	void get_opt_split_y(float& score, size_t& split,  size_t xmin, size_t xmax, size_t ymin, size_t ymax) const;
 
 private:
-	float get_max_height_x(size_t x, size_t ymin, size_t ymax) const;
-	float get_min_height_x(size_t x, size_t ymin, size_t ymax) const;
-	float get_max_height_y(size_t y, size_t xmin, size_t xmax) const;
-	float get_min_height_y(size_t y, size_t xmin, size_t xmax) const;
+	// an empty map, as every constructor starts out
+	void init() {
+		m_xsize = 0;
+		m_ysize = 0;
+		m_data = 0;
+		m_qdata = 0;
+		m_qscale = 1.0f;
+		m_qoffset = 0.0f;
+		m_owns_data = true;
+		m_num_range_levels_x = 0;
+	}
+
+	struct t_height_range {
+	public:
+		float m_min;
+		float m_max;
+	};
+
+	// sizes of range-index level (i, j)
+	size_t get_range_level_xsize(size_t i) const { return ((m_xsize + (size_t(1) << i) - 1) >> i); }
+	size_t get_range_level_ysize(size_t j) const { return ((m_ysize + (size_t(1) << j) - 1) >> j); }
+
+	// range of the block at (x, y) of level (i, j); level (0, 0) are the
+	// samples themselves and is not stored
+	t_height_range get_block_range(size_t i, size_t j, size_t x, size_t y) const {
+		if ((i | j) == 0) {
+			const float h = at(x, y);
+			const t_height_range range = {h, h};
+			return range;
+		}
+
+		return m_ranges[m_range_offsets[j * m_num_range_levels_x + i] + y * get_range_level_xsize(i) + x];
+	}
 
 private:
 	size_t m_xsize;
 	size_t m_ysize;
 	float* m_data;
+
+	// order of the samples in m_data or m_qdata
+	t_sample_layout m_layout;
+
+	// levels (i, j) of the range index, row-major; level (i, j) starts at
+	// m_range_offsets[j * m_num_range_levels_x + i]
+	std::vector<t_height_range> m_ranges;
+	std::vector<size_t> m_range_offsets;
+
+	size_t m_num_range_levels_x;
+
+	// compact samples and their dequantization parameters
+	uint16_t* m_qdata;
+
+	float m_qscale;
+	float m_qoffset;
+
+	bool m_owns_data;
+};
+
+
+
+// reads the maps t_heightmap::load does a band of rows at a time, so they
+// can be converted (e.g. to tiles) without all of their float samples in
+// memory; raw files are only read by read_rows, images are decoded once in
+// their own (usually more compact) type and converted band by band
+//
+class t_heightmap_reader {
+public:
+	t_heightmap_reader() { m_file = 0; m_bitmap = 0; m_sample_size = 0; m_xsize = 0; m_ysize = 0; m_scale = 1.0f; }
+	t_heightmap_reader(const t_heightmap_reader&) = delete;
+	~t_heightmap_reader() { close(); }
+
+	t_heightmap_reader& operator = (const t_heightmap_reader&) = delete;
+
+	// prints the reason if either fails
+	bool open(const char* file_name, float scale);
+	bool open_raw(const char* file_name, size_t sample_size, float scale);
+	void close();
+
+	// size of the whole map, in samples
+	size_t width() const { return m_xsize; }
+	size_t height() const { return m_ysize; }
+
+	// converts rows [ymin, ymax) of the map to rows 0 to (ymax - ymin - 1) of
+	// <heightmap> using up to <num_threads> threads
+	bool read_rows(t_heightmap& heightmap, size_t ymin, size_t ymax, size_t num_threads = 1);
+
+private:
+	// exactly one of these is non-null while open
+	FILE* m_file;
+	FIBITMAP* m_bitmap;
+
+	std::string m_file_name;
+
+	size_t m_sample_size;
+	size_t m_xsize;
+	size_t m_ysize;
+
+	float m_scale;
 };
 
@@ -1,32 +1,181 @@
 #pragma once
 
+#include <algorithm>
 #include <cfloat>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
+#include "cell.hpp"
 #include "ray.hpp"
 #include "ray_column.hpp"
 #include "ray_intersection.hpp"
 #include "heightmap.hpp"
+#include "parallel.hpp"
 #include "scene.hpp"
+#include "scene_cache.hpp"
 
 template <class t_cell_type>
 class t_kdtree_cell_scene;
 
+// level-of-detail stand-in for a kd-tree node: a plane through the mean
+// height and mean slopes of the cells below it, stored in an array parallel
+// to the nodes (so the same child offsets apply)
+//
+class t_kdtree_cell_scene_lod {
+public:
+	// intersects the plane over [tmin, tmax], the part of the ray inside the node
+	t_ray_hit trace_ray(t_const_ray ray, float tmin, float tmax) const {
+		const float h0 = height_above(ray.point(tmin));
+		const float h1 = height_above(ray.point(tmax));
+
+		if (h0 > 0.0f && h1 > 0.0f)
+			return (t_ray_hit());
+		// cells are one-sided, nothing is hit from below the terrain
+		if (ray.point(tmin).z() < m_min_height)
+			return (t_ray_hit());
+
+		// a ray entering the node below the plane hits its side (closes
+		// cracks between neighbouring planes)
+		const float t = (h0 <= 0.0f)? tmin: (tmin + (tmax - tmin) * (h0 / (h0 - h1)));
+
+		return (t_ray_hit(t, t_ray_hit::PLANE_ID, m_dzdx, m_dzdy));
+	}
+
+	// whether the plane blocks a shadow ray over [tmin, tmax]; only used
+	// for planar leaves, which must cast the shadows of what rays hit
+	bool trace_shadow_ray(t_const_ray ray, float tmin, float tmax) const {
+		return (height_above(ray.point(tmin)) < -RAY_TEST_EPSILON || height_above(ray.point(tmax)) < -RAY_TEST_EPSILON);
+	}
+
+	// longest side of the node's bounding box
+	float extent() const { return m_extent; }
+
+	// fills <lods> for the depth-first array of <num_nodes> nodes built over
+	// <heightmap>, whose leaves index a grid of <cells_xsize> columns
+	template<typename t_node>
+	static void create_from_nodes(t_kdtree_cell_scene_lod* lods, const t_node* nodes, size_t num_nodes, size_t cells_xsize, const t_heightmap& heightmap) {
+		struct t_sums {
+		public:
+			double m_num_cells;
+			double m_height;
+			double m_dzdx;
+			double m_dzdy;
+
+			size_t m_rect[4];
+		};
+
+		std::vector<t_sums> sums(num_nodes);
+
+		// children always follow their parent, so a reverse sweep is post-order
+		for (size_t idx = num_nodes; idx-- > 0; ) {
+			t_sums& s = sums[idx];
+
+			if (nodes[idx].is_leaf()) {
+				const size_t xmin = nodes[idx].cell_index() % cells_xsize;
+				const size_t ymin = nodes[idx].cell_index() / cells_xsize;
+				const size_t xmax = xmin + nodes[idx].leaf_xsize();
+				const size_t ymax = ymin + nodes[idx].leaf_ysize();
+
+				s.m_num_cells = 0.0;
+				s.m_height = 0.0;
+				s.m_dzdx = 0.0;
+				s.m_dzdy = 0.0;
+
+				for (size_t y = ymin; y < ymax; y++) {
+					for (size_t x = xmin; x < xmax; x++) {
+						const float z00 = heightmap.at(x, y    ), z10 = heightmap.at(x + 1, y    );
+						const float z01 = heightmap.at(x, y + 1), z11 = heightmap.at(x + 1, y + 1);
+
+						s.m_num_cells += 1.0;
+						s.m_height += (z00 + z10 + z01 + z11) * 0.25;
+						s.m_dzdx += ((z10 - z00) + (z11 - z01)) * 0.5;
+						s.m_dzdy += ((z01 - z00) + (z11 - z10)) * 0.5;
+					}
+				}
+
+				s.m_rect[0] = xmin; s.m_rect[1] = xmax;
+				s.m_rect[2] = ymin; s.m_rect[3] = ymax;
+			} else {
+				const t_sums& l = sums[idx + 1];
+				const t_sums& r = sums[nodes[idx].rgt_child() - nodes];
+
+				s.m_num_cells = l.m_num_cells + r.m_num_cells;
+				s.m_height = l.m_height + r.m_height;
+				s.m_dzdx = l.m_dzdx + r.m_dzdx;
+				s.m_dzdy = l.m_dzdy + r.m_dzdy;
+
+				s.m_rect[0] = std::min(l.m_rect[0], r.m_rect[0]); s.m_rect[1] = std::max(l.m_rect[1], r.m_rect[1]);
+				s.m_rect[2] = std::min(l.m_rect[2], r.m_rect[2]); s.m_rect[3] = std::max(l.m_rect[3], r.m_rect[3]);
+			}
+
+			t_kdtree_cell_scene_lod& lod = lods[idx];
+
+			lod.m_xmid = (s.m_rect[0] + s.m_rect[1]) * 0.5f;
+			lod.m_ymid = (s.m_rect[2] + s.m_rect[3]) * 0.5f;
+			lod.m_extent = std::max(s.m_rect[1] - s.m_rect[0], s.m_rect[3] - s.m_rect[2]);
+			lod.m_extent = std::max(lod.m_extent, nodes[idx].get_max_height() - nodes[idx].get_min_height());
+			lod.m_min_height = nodes[idx].get_min_height();
+			lod.m_max_height = nodes[idx].get_max_height();
+			lod.m_height = s.m_height / s.m_num_cells;
+			lod.m_dzdx = s.m_dzdx / s.m_num_cells;
+			lod.m_dzdy = s.m_dzdy / s.m_num_cells;
+		}
+	}
+
+private:
+	// the plane is clipped to the node's height range, an extrapolated
+	// slope must not make rays passing above all cells hit it
+	float height_above(t_const_vec p) const {
+		const float z = m_height + m_dzdx * (p.x() - m_xmid) + m_dzdy * (p.y() - m_ymid);
+		return (p.z() - std::max(m_min_height, std::min(m_max_height, z)));
+	}
+
+private:
+	float m_xmid;
+	float m_ymid;
+	float m_extent;
+
+	// plane height at the center, and its slopes
+	float m_height;
+	float m_dzdx;
+	float m_dzdy;
+
+	float m_min_height;
+	float m_max_height;
+};
+
+
+
 template <class t_cell_type>
 class t_kdtree_cell_scene_node {
 public:
 	// traces a ray into the scene; returns the intersection
-	t_ray_intersection trace_ray(t_const_ray ray, float tmin, float tmax, float zmin) const {
-		t_ray_intersection result;
+	//
+	// <cells> is what the leaves index, a t_cell_grid or a stand-in such
+	// as t_heightmap_cells that rebuilds the cells on the fly
+	//
+	// <lods> is the level-of-detail entry parallel to this node, or null to
+	// always descend to the cells; with it, a node narrower than the ray-cone
+	// (of width tmin * spread where the ray enters it) is hit as its plane,
+	// and so is every planar leaf
+	template<typename t_cell_array>
+	t_ray_hit trace_ray(const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax, float zmin) const {
+		t_ray_hit result;
+
+		count_node_visit(cells);
 
 		if (zmin > m_max_height)
 			return result;
 
-		if (m_leaf != 0)
-			return (m_leaf->trace_ray(ray));
+		if (is_leaf())
+			return (trace_leaf_ray(cells, lods, ray, tmin, tmax));
+
+		if (lods != 0 && lods->extent() < (tmin * ray.spread()))
+			return (lods->trace_ray(ray, tmin, tmax));
 
-		t_kdtree_cell_scene_node<t_cell_type>* min_child = 0;
-		t_kdtree_cell_scene_node<t_cell_type>* max_child = 0;
+		const t_kdtree_cell_scene_node<t_cell_type>* min_child = 0;
+		const t_kdtree_cell_scene_node<t_cell_type>* max_child = 0;
 		float t_split = 0.0f;
 
 		find_split(ray, min_child, max_child, t_split);
@@ -43,7 +192,7 @@ public:
 				}
 			}
 
-			result = min_child->trace_ray(ray, tmin, tmax_neg, zmin_neg);
+			result = min_child->trace_ray(cells, (lods != 0)? (lods + (min_child - this)): 0, ray, tmin, tmax_neg, zmin_neg);
 		}
 
 		if (result.valid())
@@ -61,24 +210,29 @@ public:
 				}
 			}
 
-			result = max_child->trace_ray(ray, tmin_pos, tmax, zmin_pos);
+			result = max_child->trace_ray(cells, (lods != 0)? (lods + (max_child - this)): 0, ray, tmin_pos, tmax, zmin_pos);
 		}
 
 		return result;
 	}
 
 	// traces a shadow ray; returns true iff there is a collision
-	bool trace_shadow_ray(t_const_ray ray, float tmin, float tmax, float zmin, float zmax) const {
+	//
+	// <lods> is as for trace_ray, but only stands in for planar leaves
+	template<typename t_cell_array>
+	bool trace_shadow_ray(const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax, float zmin, float zmax) const {
+		count_node_visit(cells);
+
 		if (zmin > (m_max_height - RAY_TEST_EPSILON))	
 			return false;
 		if (zmax < (m_min_height + RAY_TEST_EPSILON))
 			return true;
 
-		if (m_leaf != 0)
-			return (m_leaf->trace_shadow_ray(ray));
+		if (is_leaf())
+			return (trace_leaf_shadow_ray(cells, lods, ray, tmin, tmax));
 
-		t_kdtree_cell_scene_node<t_cell_type>* min_child = 0;
-		t_kdtree_cell_scene_node<t_cell_type>* max_child = 0;
+		const t_kdtree_cell_scene_node<t_cell_type>* min_child = 0;
+		const t_kdtree_cell_scene_node<t_cell_type>* max_child = 0;
 		float t_split = 0.0f;
 
 		find_split(ray, min_child, max_child, t_split);
@@ -98,7 +252,7 @@ public:
 				}
 			}
 
-			if (min_child->trace_shadow_ray(ray, tmin, tmax_neg, zmin_neg, zmax_neg)) {
+			if (min_child->trace_shadow_ray(cells, (lods != 0)? (lods + (min_child - this)): 0, ray, tmin, tmax_neg, zmin_neg, zmax_neg)) {
 				return true;
 			}
 		}
@@ -118,7 +272,7 @@ public:
 				}
 			}
 
-			if (max_child->trace_shadow_ray(ray, tmin_pos, tmax, zmin_pos, zmax_pos)) {
+			if (max_child->trace_shadow_ray(cells, (lods != 0)? (lods + (max_child - this)): 0, ray, tmin_pos, tmax, zmin_pos, zmax_pos)) {
 				return true;
 			}
 		}
@@ -126,8 +280,218 @@ public:
 		return false;
 	}
 
-	// traces a slope-column beginning at the <start>-th ray
-	int trace_slope_ray_column(t_ray_intersection* results, const t_slope_ray_column& slope_ray_column, float tmin, float tmax, int start) const {
+	// iterative trace_ray (TRAVERSAL_MODE_STACK) with the same result: the
+	// far child of each inner node waits on a small fixed stack instead of
+	// the call-stack, and no hit is passed back up through the levels
+	template<typename t_cell_array>
+	t_ray_hit trace_ray_stack(const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax, float zmin) const {
+		t_stack_entry stack[MAX_STACK_DEPTH];
+		size_t depth = 0;
+
+		const t_kdtree_cell_scene_node<t_cell_type>* node = this;
+
+		for (;;) {
+			const t_kdtree_cell_scene_lod* node_lods = (lods != 0)? (lods + (node - this)): 0;
+
+			count_node_visit(cells);
+
+			if (zmin <= node->m_max_height) {
+				if (node->is_leaf()) {
+					const t_ray_hit result = node->trace_leaf_ray(cells, node_lods, ray, tmin, tmax);
+
+					if (result.valid())
+						return result;
+				} else if (node_lods != 0 && node_lods->extent() < (tmin * ray.spread())) {
+					const t_ray_hit result = node_lods->trace_ray(ray, tmin, tmax);
+
+					if (result.valid())
+						return result;
+				} else {
+					const t_kdtree_cell_scene_node<t_cell_type>* min_child = 0;
+					const t_kdtree_cell_scene_node<t_cell_type>* max_child = 0;
+					float t_split = 0.0f;
+
+					node->find_split(ray, min_child, max_child, t_split);
+
+					const bool visit_min = (tmin <= t_split);
+					const bool visit_max = (t_split <= tmax);
+
+					float tmax_neg = tmax;
+					float zmin_neg = zmin;
+					float tmin_pos = tmin;
+					float zmin_pos = zmin;
+
+					if (t_split < tmax) {
+						tmax_neg = t_split;
+
+						if (ray.dir().z() < 0.0f) {
+							zmin_neg = ray.pos().z() + ray.dir().z() * tmax_neg;
+						}
+					}
+
+					if (t_split > tmin) {
+						tmin_pos = t_split;
+
+						if (ray.dir().z() > 0.0f) {
+							zmin_pos = ray.pos().z() + ray.dir().z() * tmin_pos;
+						}
+					}
+
+					if (visit_min && visit_max) {
+						if (depth < MAX_STACK_DEPTH) {
+							stack[depth++] = t_stack_entry(max_child, tmin_pos, tmax, zmin_pos, 0.0f);
+						} else {
+							// out of stack (only in degenerate trees), finish the near subtree recursively
+							const t_ray_hit result = min_child->trace_ray(cells, (lods != 0)? (lods + (min_child - this)): 0, ray, tmin, tmax_neg, zmin_neg);
+
+							if (result.valid())
+								return result;
+
+							node = max_child; tmin = tmin_pos; zmin = zmin_pos;
+							continue;
+						}
+					}
+
+					if (visit_min) {
+						node = min_child; tmax = tmax_neg; zmin = zmin_neg;
+						continue;
+					}
+
+					if (visit_max) {
+						node = max_child; tmin = tmin_pos; zmin = zmin_pos;
+						continue;
+					}
+				}
+			}
+
+			if (depth == 0)
+				return (t_ray_hit());
+
+			depth -= 1;
+
+			node = stack[depth].m_node;
+			tmin = stack[depth].m_tmin;
+			tmax = stack[depth].m_tmax;
+			zmin = stack[depth].m_zmin;
+		}
+	}
+
+	// iterative trace_shadow_ray (TRAVERSAL_MODE_STACK), see trace_ray_stack
+	template<typename t_cell_array>
+	bool trace_shadow_ray_stack(const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax, float zmin, float zmax) const {
+		t_stack_entry stack[MAX_STACK_DEPTH];
+		size_t depth = 0;
+
+		const t_kdtree_cell_scene_node<t_cell_type>* node = this;
+
+		for (;;) {
+			const t_kdtree_cell_scene_lod* node_lods = (lods != 0)? (lods + (node - this)): 0;
+
+			count_node_visit(cells);
+
+			if (zmin <= (node->m_max_height - RAY_TEST_EPSILON)) {
+				if (zmax < (node->m_min_height + RAY_TEST_EPSILON))
+					return true;
+
+				if (node->is_leaf()) {
+					if (node->trace_leaf_shadow_ray(cells, node_lods, ray, tmin, tmax))
+						return true;
+				} else {
+					const t_kdtree_cell_scene_node<t_cell_type>* min_child = 0;
+					const t_kdtree_cell_scene_node<t_cell_type>* max_child = 0;
+					float t_split = 0.0f;
+
+					node->find_split(ray, min_child, max_child, t_split);
+
+					const bool visit_min = (tmin <= t_split);
+					const bool visit_max = (t_split <= tmax);
+
+					float tmax_neg = tmax;
+					float zmin_neg = zmin;
+					float zmax_neg = zmax;
+					float tmin_pos = tmin;
+					float zmin_pos = zmin;
+					float zmax_pos = zmax;
+
+					if (t_split < tmax) {
+						tmax_neg = t_split;
+
+						if (ray.dir().z() < 0.0f) {
+							zmin_neg = ray.pos().z() + ray.dir().z() * tmax_neg;
+						} else {
+							zmax_neg = ray.pos().z() + ray.dir().z() * tmax_neg;
+						}
+					}
+
+					if (t_split > tmin) {
+						tmin_pos = t_split;
+
+						if (ray.dir().z() > 0.0f) {
+							zmin_pos = ray.pos().z() + ray.dir().z() * tmin_pos;
+						} else {
+							zmax_pos = ray.pos().z() + ray.dir().z() * tmin_pos;
+						}
+					}
+
+					if (visit_min && visit_max) {
+						if (depth < MAX_STACK_DEPTH) {
+							stack[depth++] = t_stack_entry(max_child, tmin_pos, tmax, zmin_pos, zmax_pos);
+						} else {
+							if (min_child->trace_shadow_ray(cells, (lods != 0)? (lods + (min_child - this)): 0, ray, tmin, tmax_neg, zmin_neg, zmax_neg))
+								return true;
+
+							node = max_child; tmin = tmin_pos; zmin = zmin_pos; zmax = zmax_pos;
+							continue;
+						}
+					}
+
+					if (visit_min) {
+						node = min_child; tmax = tmax_neg; zmin = zmin_neg; zmax = zmax_neg;
+						continue;
+					}
+
+					if (visit_max) {
+						node = max_child; tmin = tmin_pos; zmin = zmin_pos; zmax = zmax_pos;
+						continue;
+					}
+				}
+			}
+
+			if (depth == 0)
+				return false;
+
+			depth -= 1;
+
+			node = stack[depth].m_node;
+			tmin = stack[depth].m_tmin;
+			tmax = stack[depth].m_tmax;
+			zmin = stack[depth].m_zmin;
+			zmax = stack[depth].m_zmax;
+		}
+	}
+
+	// trace_ray or trace_ray_stack and trace_shadow_ray or trace_shadow_ray_stack,
+	// by <traversal_mode> (TRAVERSAL_MODE_*)
+	template<typename t_cell_array>
+	t_ray_hit traverse_ray(int traversal_mode, const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax, float zmin) const {
+		if (traversal_mode == TRAVERSAL_MODE_STACK)
+			return (trace_ray_stack(cells, lods, ray, tmin, tmax, zmin));
+
+		return (trace_ray(cells, lods, ray, tmin, tmax, zmin));
+	}
+
+	template<typename t_cell_array>
+	bool traverse_shadow_ray(int traversal_mode, const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax, float zmin, float zmax) const {
+		if (traversal_mode == TRAVERSAL_MODE_STACK)
+			return (trace_shadow_ray_stack(cells, lods, ray, tmin, tmax, zmin, zmax));
+
+		return (trace_shadow_ray(cells, lods, ray, tmin, tmax, zmin, zmax));
+	}
+
+	// traces a slope-column beginning at the <start>-th ray; <lods> is as
+	// for trace_shadow_ray
+	template<typename t_cell_array>
+	int trace_slope_ray_column(const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_ray_hit* results, const t_slope_ray_column& slope_ray_column, float tmin, float tmax, int start) const {
 		float zmin = slope_ray_column.pos().z() + tmin * slope_ray_column.zdirs()[start];
 		float zmax = slope_ray_column.pos().z() + tmax * slope_ray_column.zdirs()[start];
 
@@ -136,9 +500,46 @@ public:
 		if (zmin > m_max_height)
 			return start;
 
-		if (m_leaf != 0) {
+		if (is_leaf() && is_cell_leaf()) {
+			const t_cell_type& cell = cells[cell_index()];
+
+			for (; start < slope_ray_column.num_rays(); start++) {
+				const t_ray_hit result = cell.trace_ray(slope_ray_column.get_ray(start), cell_index());
+
+				if (result.valid()) {
+					results[start] = result;
+				} else {
+					break;
+				}
+			}
+
+			return start;
+		}
+
+		if (is_leaf()) {
+			const size_t xmin = cell_index() % cells.xsize();
+			const size_t ymin = cell_index() / cells.xsize();
+
 			for (; start < slope_ray_column.num_rays(); start++) {
-				const t_ray_intersection result = m_leaf->trace_ray(slope_ray_column.get_ray(start));
+				// the rays of a column are normalized differently, so
+				// each gets its own segment through the leaf
+				const t_ray ray = slope_ray_column.get_ray(start);
+
+				t_ray_hit result;
+
+				float t0 = 0.0f;
+				float t1 = 0.0f;
+
+				if (ray.time_in_rect(t0, t1, xmin, xmin + leaf_xsize(), ymin, ymin + leaf_ysize())) {
+					if (lods != 0 && is_planar_leaf()) {
+						result = lods->trace_ray(ray, t0, t1);
+					} else {
+						walk_cell_block(cells.xsize(), xmin, ymin, leaf_xsize(), leaf_ysize(), ray, t0, t1, [&](size_t idx, float, float) {
+							result = cells[idx].trace_ray(ray, idx);
+							return (result.valid());
+						});
+					}
+				}
 
 				if (result.valid()) {
 					results[start] = result;
@@ -150,40 +551,84 @@ public:
 			return start;
 		}
 
-		t_kdtree_cell_scene_node<t_cell_type>* min_child;
-		t_kdtree_cell_scene_node<t_cell_type>* max_child;
+		const t_kdtree_cell_scene_node<t_cell_type>* min_child;
+		const t_kdtree_cell_scene_node<t_cell_type>* max_child;
 		float t_split;
 
 		find_split(slope_ray_column.ray(), min_child, max_child, t_split);
 
 		if (tmin <= t_split) {
-			start = min_child->trace_slope_ray_column(results, slope_ray_column, tmin, ((t_split < tmax)? t_split: tmax), start);
+			start = min_child->trace_slope_ray_column(cells, (lods != 0)? (lods + (min_child - this)): 0, results, slope_ray_column, tmin, ((t_split < tmax)? t_split: tmax), start);
 		}
 
 		if (t_split <= tmax) {
-			start = max_child->trace_slope_ray_column(results, slope_ray_column, ((t_split > tmin)? t_split: tmin), tmax, start);
+			start = max_child->trace_slope_ray_column(cells, (lods != 0)? (lods + (max_child - this)): 0, results, slope_ray_column, ((t_split > tmin)? t_split: tmin), tmax, start);
 		}
 
 		return start;
 	}
 
     
-	static t_kdtree_cell_scene_node<t_cell_type>* create_from_heightmap(const t_heightmap& heightmap,  size_t xmin, size_t xmax, size_t ymin, size_t ymax) {
-		t_kdtree_cell_scene_node<t_cell_type>* result = new t_kdtree_cell_scene_node<t_cell_type>();
-
-		if (xmax == xmin + 1 && ymax == ymin + 1) {
+	// appends the subtree over [xmin, xmax] x [ymin, ymax] to <nodes> in depth-first order
+	// and fills in the cells of its leaves; <cells> is a grid of <cells_xsize> columns, or
+	// null if the cells are not stored
+	//
+	// nodes over at most <leaf_size> x <leaf_size> cells become leaves, which rays cross
+	// cell by cell instead of descending further; larger leaves make for (much) smaller
+	// and shallower trees at the cost of testing cells that a deeper tree would skip
+	//
+	// if <planar_error> is positive, so do nodes of any size whose samples all lie within
+	// it of one plane (water, plains, plateaus); such planar leaves are traced as their
+	// level-of-detail plane, which is off from the samples by at most twice that error
+	static void create_from_heightmap(
+		std::vector< t_kdtree_cell_scene_node<t_cell_type> >& nodes,
+		t_cell_type* cells,
+		size_t cells_xsize,
+		const t_heightmap& heightmap,
+		size_t xmin, size_t xmax, size_t ymin, size_t ymax,
+		int split_mode = SPLIT_MODE_EVEN,
+		size_t leaf_size = 1,
+		float planar_error = 0.0f,
+		size_t num_tasks = 1
+	) {
+		const size_t idx = nodes.size();
+
+		nodes.emplace_back();
+
+		leaf_size = std::max(size_t(1), std::min(leaf_size, MAX_LEAF_SIZE));
+
+		bool planar = (planar_error > 0.0f);
+
+		planar = planar && ((xmax - xmin) * (ymax - ymin)) > 1;
+		planar = planar && (xmax - xmin) <= MAX_LEAF_SIZE && (ymax - ymin) <= MAX_LEAF_SIZE;
+		planar = planar && heightmap.is_planar(xmin, xmax + 1, ymin, ymax + 1, planar_error);
+
+		if (planar || ((xmax - xmin) <= leaf_size && (ymax - ymin) <= leaf_size)) {
 			// leaf node
-			result->m_lft_child = 0;
-			result->m_rgt_child = 0;
-			result->m_leaf = new t_cell_type();
-			result->m_leaf->set_from_heightmap(heightmap, xmin, ymin);
-			result->m_min_height = result->m_leaf->get_min_height();
-			result->m_max_height = result->m_leaf->get_max_height();
-			return result;
-		}
+			float min_height = FLT_MAX;
+			float max_height = -FLT_MAX;
+
+			for (size_t y = ymin; y < ymax; y++) {
+				for (size_t x = xmin; x < xmax; x++) {
+					t_cell_type cell;
+					cell.set_from_heightmap(heightmap, x, y);
+
+					if (cells != 0)
+						cells[y * cells_xsize + x] = cell;
 
-		// non-leaf nodes
-		result->m_leaf = 0;
+					min_height = std::min(min_height, cell.get_min_height());
+					max_height = std::max(max_height, cell.get_max_height());
+				}
+			}
+
+			nodes[idx].m_data = ymin * cells_xsize + xmin;
+			nodes[idx].m_rgt_child = ((xmax - xmin - 1) << LEAF_SIZE_BITS) | (ymax - ymin - 1);
+			nodes[idx].m_split_axis = planar;
+			nodes[idx].m_leaf = 1;
+			nodes[idx].m_min_height = min_height;
+			nodes[idx].m_max_height = max_height;
+			return;
+		}
 
 		// choose an axis and split-coordinates such that surface area is minimized
 		// top surface area is constant with split choice, only worry about sides
@@ -194,82 +639,194 @@ public:
 		size_t split_y = 0;
 
 		if (xmax > (xmin + 1)) {
-			// placeholder: even split
-			split_x = (xmax + xmin) / 2;
-			score_x = ymax - ymin;
-
-			// heightmap.get_opt_split_x(score_x, split_x, xmin, xmax + 1, ymin, ymax + 1);
+			if (split_mode == SPLIT_MODE_COST) {
+				heightmap.get_opt_split_x(score_x, split_x, xmin, xmax + 1, ymin, ymax + 1);
+			} else {
+				split_x = (xmax + xmin) / 2;
+				score_x = ymax - ymin;
+			}
 		}
 
 		if (ymax > (ymin + 1)) {
-			// placeholder: even split
-			split_y = (ymin + ymax) / 2;
-			score_y = xmax - xmin;
-
-			// heightmap.get_opt_split_y(score_y, split_y, xmin, xmax + 1, ymin, ymax + 1);
+			if (split_mode == SPLIT_MODE_COST) {
+				heightmap.get_opt_split_y(score_y, split_y, xmin, xmax + 1, ymin, ymax + 1);
+			} else {
+				split_y = (ymin + ymax) / 2;
+				score_y = xmax - xmin;
+			}
 		}
 
-		if (score_x < score_y) {
-			result->m_lft_child = create_from_heightmap(heightmap, xmin, split_x, ymin, ymax);
-			result->m_rgt_child = create_from_heightmap(heightmap, split_x, xmax, ymin, ymax);
-			result->m_split_coor = split_x;
-			result->m_split_axis = false;
+		const bool split_axis = !(score_x < score_y);
+		const size_t split_coor = split_axis? split_y: split_x;
+
+		// child rectangles {xmin, xmax, ymin, ymax}
+		const size_t rects[2][4] = {
+			{                        xmin , (split_axis? xmax: split_coor),                         ymin , (split_axis? split_coor: ymax)},
+			{(split_axis? xmin: split_coor),                         xmax , (split_axis? split_coor: ymin),                         ymax },
+		};
+
+		nodes[idx].m_data = split_coor;
+		nodes[idx].m_split_axis = split_axis;
+		nodes[idx].m_leaf = 0;
+
+		// subtrees below this size are not worth a thread
+		if (num_tasks > 1 && ((xmax - xmin) * (ymax - ymin)) >= MIN_PARALLEL_BUILD_CELLS) {
+			std::vector< t_kdtree_cell_scene_node<t_cell_type> > sub_trees[2];
+
+			fork_join(2, num_tasks, [&](size_t i, size_t num_sub_tasks) {
+				sub_trees[i].reserve(num_subtree_nodes(rects[i], leaf_size));
+				create_from_heightmap(sub_trees[i], cells, cells_xsize, heightmap, rects[i][0], rects[i][1], rects[i][2], rects[i][3], split_mode, leaf_size, planar_error, num_sub_tasks);
+			});
+
+			nodes.insert(nodes.end(), sub_trees[0].begin(), sub_trees[0].end());
+			nodes.insert(nodes.end(), sub_trees[1].begin(), sub_trees[1].end());
+
+			nodes[idx].m_rgt_child = 1 + sub_trees[0].size();
 		} else {
-			result->m_lft_child = create_from_heightmap(heightmap, xmin, xmax, ymin, split_y);
-			result->m_rgt_child = create_from_heightmap(heightmap, xmin, xmax, split_y, ymax);
-			result->m_split_coor = split_y;
-			result->m_split_axis = true;
+			create_from_heightmap(nodes, cells, cells_xsize, heightmap, rects[0][0], rects[0][1], rects[0][2], rects[0][3], split_mode, leaf_size, planar_error);
+			nodes[idx].m_rgt_child = nodes.size() - idx;
+			create_from_heightmap(nodes, cells, cells_xsize, heightmap, rects[1][0], rects[1][1], rects[1][2], rects[1][3], split_mode, leaf_size, planar_error);
 		}
 
-		result->m_max_height = std::max(result->m_lft_child->m_max_height, result->m_rgt_child->m_max_height);
-		result->m_min_height = std::min(result->m_lft_child->m_min_height, result->m_rgt_child->m_min_height);
+		const t_kdtree_cell_scene_node<t_cell_type>& lft_child = nodes[idx + 1];
+		const t_kdtree_cell_scene_node<t_cell_type>& rgt_child = nodes[idx + nodes[idx].m_rgt_child];
 
-		return result;
+		nodes[idx].m_max_height = std::max(lft_child.m_max_height, rgt_child.m_max_height);
+		nodes[idx].m_min_height = std::min(lft_child.m_min_height, rgt_child.m_min_height);
 	}
 
-private:
+	// a subtree over n cells has 2n-1 nodes if every leaf covers a single
+	// cell; for larger leaves this is only an estimate (exact for the even
+	// splits of a power-of-two block)
+	static size_t num_subtree_nodes(const size_t rect[4], size_t leaf_size = 1) {
+		const size_t num_leaves_x = (rect[1] - rect[0] + leaf_size - 1) / leaf_size;
+		const size_t num_leaves_y = (rect[3] - rect[2] + leaf_size - 1) / leaf_size;
+		return (num_leaves_x * num_leaves_y * 2 - 1);
+	}
+
+	bool is_leaf() const { return (m_leaf != 0); }
+	// true for leaves over a single cell
+	bool is_cell_leaf() const { return (m_rgt_child == 0); }
+	// true for leaves whose cells all lie (nearly) in one plane
+	bool is_planar_leaf() const { return (is_leaf() && m_split_axis != 0); }
+
+	float get_min_height() const { return m_min_height; }
+	float get_max_height() const { return m_max_height; }
+
+	// leaves cover a block of leaf_xsize() x leaf_ysize() cells, of which
+	// cell_index() is the lower-left one
+	size_t cell_index() const { return m_data; }
+	size_t split_coor() const { return m_data; }
+
+	size_t leaf_xsize() const { return ((m_rgt_child >> LEAF_SIZE_BITS) + 1); }
+	size_t leaf_ysize() const { return ((m_rgt_child & ((1 << LEAF_SIZE_BITS) - 1)) + 1); }
+
+	const t_kdtree_cell_scene_node<t_cell_type>* lft_child() const { return (this + 1); }
+	const t_kdtree_cell_scene_node<t_cell_type>* rgt_child() const { return (this + m_rgt_child); }
+
+	// the near and far child of this (inner) node along <ray>, and the time
+	// at which <ray> crosses the split-plane
 	void find_split(
 		t_const_ray ray,
-		t_kdtree_cell_scene_node<t_cell_type>*& min_child, // near
-		t_kdtree_cell_scene_node<t_cell_type>*& max_child, // far
+		const t_kdtree_cell_scene_node<t_cell_type>*& min_child, // near
+		const t_kdtree_cell_scene_node<t_cell_type>*& max_child, // far
 		float& t_split
 	) const {
 		if (m_split_axis) {
-			t_split = ray.time_to_y(m_split_coor);
+			t_split = ray.time_to_y(split_coor());
 
 			if (ray.dir().y() > 0.0f) {
-				min_child = m_lft_child;
-				max_child = m_rgt_child;
+				min_child = lft_child();
+				max_child = rgt_child();
 			} else {
-				min_child = m_rgt_child;
-				max_child = m_lft_child;
+				min_child = rgt_child();
+				max_child = lft_child();
 			}
 		} else {
-			t_split = ray.time_to_x(m_split_coor);
+			t_split = ray.time_to_x(split_coor());
 
 			if (ray.dir().x() > 0.0f) {
-				min_child = m_lft_child;
-				max_child = m_rgt_child;
+				min_child = lft_child();
+				max_child = rgt_child();
 			} else {
-				min_child = m_rgt_child;
-				max_child = m_lft_child;
+				min_child = rgt_child();
+				max_child = lft_child();
 			}
 		}
 	}
 
+private:
+	// the leaf-cases of the traversals, for leaves over one or more cells
+	template<typename t_cell_array>
+	t_ray_hit trace_leaf_ray(const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax) const {
+		if (is_cell_leaf())
+			return (cells[cell_index()].trace_ray(ray, cell_index()));
+
+		if (lods != 0 && (is_planar_leaf() || lods->extent() < (tmin * ray.spread())))
+			return (lods->trace_ray(ray, tmin, tmax));
+
+		return (trace_cell_block(cells, cell_index() % cells.xsize(), cell_index() / cells.xsize(), leaf_xsize(), leaf_ysize(), ray, tmin, tmax));
+	}
+
+	template<typename t_cell_array>
+	bool trace_leaf_shadow_ray(const t_cell_array& cells, const t_kdtree_cell_scene_lod* lods, t_const_ray ray, float tmin, float tmax) const {
+		if (is_cell_leaf())
+			return (cells[cell_index()].trace_shadow_ray(ray));
+
+		if (lods != 0 && is_planar_leaf())
+			return (lods->trace_shadow_ray(ray, tmin, tmax));
+
+		return (trace_shadow_cell_block(cells, cell_index() % cells.xsize(), cell_index() / cells.xsize(), leaf_xsize(), leaf_ysize(), ray, tmin, tmax));
+	}
+
+
 private:
 	friend t_kdtree_cell_scene<t_cell_type>;
 
-	t_kdtree_cell_scene_node<t_cell_type>* m_lft_child; // "left" subtree (< split)
-	t_kdtree_cell_scene_node<t_cell_type>* m_rgt_child; // "right" subtree (> split)
-	t_cell_type* m_leaf; // null if not leaf node
+	static const size_t MIN_PARALLEL_BUILD_CELLS = 64 * 64;
+
+	// deeper than any tree over a 2^32 x 2^32 map with even splits; cost-
+	// splits may exceed it, in which case the traversals fall back to
+	// recursion
+	static const size_t MAX_STACK_DEPTH = 64;
 
-	size_t m_split_coor;
+	// leaves pack their width and height (minus one) into m_rgt_child
+	static const size_t LEAF_SIZE_BITS = 15;
+	static const size_t MAX_LEAF_SIZE = size_t(1) << LEAF_SIZE_BITS;
 
+	// nodes live in one flat array (position-independent, so they can be
+	// mapped from a cache-file); the "left" subtree (< split) of an inner
+	// node directly follows it, the "right" one (> split) starts at offset
+	// m_rgt_child (leaves store the size of their block of cells there)
 	float m_min_height;
 	float m_max_height;
 
-	bool m_split_axis; // true = y axis
+	// split coordinate for inner nodes, index into the cell-grid for leaves
+	uint32_t m_data;
+
+	uint32_t m_rgt_child : 30;
+	uint32_t m_split_axis : 1; // 1 = y axis (inner nodes) or planar (leaves)
+	uint32_t m_leaf : 1;
+
+	// a far child left for later by the iterative traversals
+	struct t_stack_entry {
+	public:
+		t_stack_entry() {}
+		t_stack_entry(const t_kdtree_cell_scene_node<t_cell_type>* node, float tmin, float tmax, float zmin, float zmax) {
+			m_node = node;
+			m_tmin = tmin;
+			m_tmax = tmax;
+			m_zmin = zmin;
+			m_zmax = zmax;
+		}
+
+		const t_kdtree_cell_scene_node<t_cell_type>* m_node;
+
+		float m_tmin;
+		float m_tmax;
+		float m_zmin;
+		float m_zmax;
+	};
 };
 
 
@@ -277,37 +834,222 @@ private:
 template <class t_cell_type>
 class t_kdtree_cell_scene: public t_scene {
 public:
-	~t_kdtree_cell_scene() {}
+	static_assert(t_cell_interface<t_cell_type>::value, "not a cell-type");
+
+	typedef t_kdtree_cell_scene_node<t_cell_type> t_node;
+
+	t_kdtree_cell_scene() {
+		m_xmax = 0;
+		m_ymax = 0;
+		m_nodes = 0;
+		m_lods = 0;
+		m_cells = 0;
+		m_num_nodes = 0;
+	}
 
 	void assign_heightmap(const t_heightmap& heightmap) {
+		clear();
+
+		m_heightmap = heightmap;
+
 		m_xmax = heightmap.width() - 1;
 		m_ymax = heightmap.height() - 1;
-		m_root = t_kdtree_cell_scene_node<t_cell_type>::create_from_heightmap(heightmap, 0, m_xmax, 0, m_ymax);
+
+		const size_t rect[4] = {0, m_xmax, 0, m_ymax};
+
+		std::vector<t_node> nodes;
+		nodes.reserve(t_node::num_subtree_nodes(rect, m_leaf_size));
+
+		t_cell_type* cells = 0;
+
+		// in compact mode the heightmap is all there is to the cells
+		if (m_compact_heights) {
+			m_heightmap.quantize();
+		} else {
+			cells = m_arena.create_array<t_cell_type>(m_xmax * m_ymax);
+		}
+
+		// reorder before the build, so its region walks get the locality of
+		// the layout as well as the traversals
+		m_heightmap.set_layout(m_heightmap_layout);
+
+		// cost-splits query the height-range of every row and column of a node
+		if (m_split_mode == SPLIT_MODE_COST)
+			m_heightmap.build_range_index(m_num_build_threads);
+
+		t_node::create_from_heightmap(nodes, cells, m_xmax, m_heightmap, 0, m_xmax, 0, m_ymax, m_split_mode, m_leaf_size, m_planar_error, m_num_build_threads);
+
+		m_heightmap.clear_range_index();
+
+		// move the nodes into the arena as one contiguous block
+		t_node* flat_nodes = m_arena.create_array<t_node>(nodes.size());
+		std::copy(nodes.begin(), nodes.end(), flat_nodes);
+
+		t_kdtree_cell_scene_lod* lods = m_arena.create_array<t_kdtree_cell_scene_lod>(nodes.size());
+		t_kdtree_cell_scene_lod::create_from_nodes(lods, flat_nodes, nodes.size(), m_xmax, m_heightmap);
+
+		m_nodes = flat_nodes;
+		m_lods = lods;
+		m_cells = cells;
+		m_num_nodes = nodes.size();
 	}
 
 
-	void assign_light_source(t_light* light) {
-		m_light_sources.push_back(light);
+	uint64_t get_build_key() const {
+		uint64_t key = hash_bytes("kdtree", 6);
+		key = hash_value(sizeof(t_node), key);
+		key = hash_value(sizeof(t_cell_type), key);
+		key = hash_value(sizeof(t_kdtree_cell_scene_lod), key);
+		key = hash_value(m_compact_heights, key);
+		key = hash_value(m_split_mode, key);
+		key = hash_value(m_heightmap_layout, key);
+		key = hash_value(m_leaf_size, key);
+		key = hash_value(m_planar_error, key);
+		return key;
 	}
 
-	void modify_light_source(size_t idx, float yaw, float pitch) {
-		m_light_sources[idx]->rotate(yaw, pitch);
+	size_t num_heightmap_bytes() const { return (m_heightmap.num_bytes()); }
+
+	void get_stats(t_scene_stats& stats) const {
+		// children always follow their parent, so one forward sweep has every depth
+		std::vector<uint16_t> depths(m_num_nodes, 0);
+
+		stats.m_num_nodes = m_num_nodes;
+		stats.m_num_leaves = 0;
+
+		for (size_t idx = 0; idx < m_num_nodes; idx++) {
+			if (m_nodes[idx].is_leaf()) {
+				if (depths[idx] >= stats.m_leaf_depths.size())
+					stats.m_leaf_depths.resize(depths[idx] + 1, 0);
+
+				stats.m_leaf_depths[depths[idx]] += 1;
+				stats.m_num_leaves += 1;
+				continue;
+			}
+
+			depths[idx + 1] = depths[idx] + 1;
+			depths[idx + m_nodes[idx].m_rgt_child] = depths[idx] + 1;
+		}
+	}
+
+	bool supports_cache() const { return true; }
+
+	bool read_cache(const char* file_name, uint64_t key) {
+		clear();
+
+		if (!m_cache.open(file_name, key))
+			return false;
+
+		const size_t xsize = m_cache.get_param(CACHE_PARAM_XSIZE);
+		const size_t ysize = m_cache.get_param(CACHE_PARAM_YSIZE);
+		const size_t num_nodes = m_cache.get_param(CACHE_PARAM_NUM_NODES);
+		const bool compact = (m_cache.get_param(CACHE_PARAM_COMPACT) != 0);
+		const int layout = m_cache.get_param(CACHE_PARAM_LAYOUT);
+
+		const t_scene_cache::t_section samples = m_cache.get_section(CACHE_SECTION_HEIGHTMAP);
+		const t_scene_cache::t_section nodes = m_cache.get_section(CACHE_SECTION_NODES);
+		const t_scene_cache::t_section cells = m_cache.get_section(CACHE_SECTION_CELLS);
+		const t_scene_cache::t_section lods = m_cache.get_section(CACHE_SECTION_LODS);
+
+		bool valid = true;
+
+		valid = valid && (xsize > 1 && ysize > 1);
+		valid = valid && (m_cache.get_param(CACHE_PARAM_NODE_SIZE) == sizeof(t_node));
+		valid = valid && (m_cache.get_param(CACHE_PARAM_CELL_SIZE) == sizeof(t_cell_type));
+		valid = valid && (layout >= 0 && layout < t_sample_layout::LAYOUT_COUNT);
+		valid = valid && (samples.m_size == (t_sample_layout::get_num_samples(xsize, ysize, layout, t_heightmap::get_layout_block_size(layout)) * (compact? sizeof(uint16_t): sizeof(float))));
+		valid = valid && (nodes.m_size == (num_nodes * sizeof(t_node)));
+		valid = valid && (cells.m_size == (compact? 0: ((xsize - 1) * (ysize - 1) * sizeof(t_cell_type))));
+		valid = valid && (lods.m_size == (num_nodes * sizeof(t_kdtree_cell_scene_lod)));
+
+		if (!valid) {
+			m_cache.close();
+			return false;
+		}
+
+		if (compact) {
+			float qscale = 0.0f;
+			float qoffset = 0.0f;
+
+			uint64_t qscale_bits = m_cache.get_param(CACHE_PARAM_QSCALE);
+			uint64_t qoffset_bits = m_cache.get_param(CACHE_PARAM_QOFFSET);
+
+			memcpy(&qscale, &qscale_bits, sizeof(qscale));
+			memcpy(&qoffset, &qoffset_bits, sizeof(qoffset));
+
+			m_heightmap.set_quantized_data(reinterpret_cast<const uint16_t*>(samples.m_data), xsize, ysize, qscale, qoffset, layout);
+		} else {
+			m_heightmap.set_data(reinterpret_cast<const float*>(samples.m_data), xsize, ysize, layout);
+		}
+
+		m_xmax = xsize - 1;
+		m_ymax = ysize - 1;
+
+		m_nodes = reinterpret_cast<const t_node*>(nodes.m_data);
+		m_lods = reinterpret_cast<const t_kdtree_cell_scene_lod*>(lods.m_data);
+		m_cells = compact? 0: reinterpret_cast<const t_cell_type*>(cells.m_data);
+		m_num_nodes = num_nodes;
+		return true;
+	}
+
+	bool write_cache(const char* file_name, uint64_t key) const {
+		if (m_nodes == 0)
+			return false;
+
+		uint64_t params[CACHE_PARAM_COUNT];
+		params[CACHE_PARAM_XSIZE] = m_heightmap.width();
+		params[CACHE_PARAM_YSIZE] = m_heightmap.height();
+		params[CACHE_PARAM_NUM_NODES] = m_num_nodes;
+		params[CACHE_PARAM_NODE_SIZE] = sizeof(t_node);
+		params[CACHE_PARAM_CELL_SIZE] = sizeof(t_cell_type);
+		params[CACHE_PARAM_COMPACT] = m_heightmap.is_quantized();
+		params[CACHE_PARAM_QSCALE] = 0;
+		params[CACHE_PARAM_QOFFSET] = 0;
+		params[CACHE_PARAM_LAYOUT] = m_heightmap.get_layout();
+
+		if (m_heightmap.is_quantized()) {
+			const float qscale = m_heightmap.quantized_scale();
+			const float qoffset = m_heightmap.quantized_offset();
+
+			memcpy(&params[CACHE_PARAM_QSCALE], &qscale, sizeof(qscale));
+			memcpy(&params[CACHE_PARAM_QOFFSET], &qoffset, sizeof(qoffset));
+		}
+
+		const void* samples = m_heightmap.is_quantized()? static_cast<const void*>(m_heightmap.quantized_data()): static_cast<const void*>(m_heightmap.data());
+
+		t_scene_cache::t_section sections[CACHE_SECTION_COUNT];
+		sections[CACHE_SECTION_HEIGHTMAP] = t_scene_cache::t_section(samples, m_heightmap.num_bytes());
+		sections[CACHE_SECTION_NODES] = t_scene_cache::t_section(m_nodes, m_num_nodes * sizeof(t_node));
+		sections[CACHE_SECTION_CELLS] = t_scene_cache::t_section(m_cells, (m_cells != 0)? (m_xmax * m_ymax * sizeof(t_cell_type)): 0);
+		sections[CACHE_SECTION_LODS] = t_scene_cache::t_section(m_lods, m_num_nodes * sizeof(t_kdtree_cell_scene_lod));
+
+		return (t_scene_cache::write(file_name, key, params, CACHE_PARAM_COUNT, sections, CACHE_SECTION_COUNT));
 	}
 
 
 	t_color trace_ray(t_const_ray ray) const {
+		const t_ray_intersection hit = intersect_ray(ray);
+
+		// the cone-width at the hit bounds the level-of-detail error
+		return (shade_lit_hit(hit, hit.time() * ray.spread()));
+	}
+
+	t_ray_intersection intersect_ray(t_const_ray ray) const {
 		float tmin = 0.0f;
 		float tmax = 0.0f;
 
 		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
-			return (t_color(0.0f, 0.0f, 0.0f));
+			return (t_ray_intersection());
 
 		float zmin = ray.pos().z() + tmin * ray.dir().z();
 		float zmax = ray.pos().z() + tmax * ray.dir().z();
 
 		zmin = std::min(zmin, zmax);
 
-		return (shade_hit(m_root->trace_ray(ray, tmin, tmax, zmin)));
+		if (m_cells == 0)
+			return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->traverse_ray(m_traversal_mode, t_heightmap_cells<t_cell_type>(&m_heightmap), m_lods, ray, tmin, tmax, zmin)));
+
+		return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->traverse_ray(m_traversal_mode, get_cells(), m_lods, ray, tmin, tmax, zmin)));
 	}
 
 	bool trace_shadow_ray(t_const_ray ray) const {
@@ -323,77 +1065,103 @@ public:
 		if (zmin > zmax)
 			std::swap(zmin, zmax);
 
-		return (m_root->trace_shadow_ray(ray, tmin, tmax, zmin, zmax));
-	}
+		if (m_cells == 0)
+			return (m_nodes->traverse_shadow_ray(m_traversal_mode, t_heightmap_cells<t_cell_type>(&m_heightmap), m_lods, ray, tmin, tmax, zmin, zmax));
 
-	void trace_slope_ray_column(const t_slope_ray_column& slope_ray_column, t_color* results) const {
-		std::vector<t_ray_intersection> hits(slope_ray_column.num_rays());
+		return (m_nodes->traverse_shadow_ray(m_traversal_mode, get_cells(), m_lods, ray, tmin, tmax, zmin, zmax));
+	}
 
+	t_ray_intersection intersect_counted_ray(t_const_ray ray, t_trace_counters& counters) const {
 		float tmin = 0.0f;
 		float tmax = 0.0f;
 
-		if (!(slope_ray_column.ray()).time_in_rect(tmin, tmax,  0, m_xmax, 0, m_ymax)) {
-			for (int i = 0; i < slope_ray_column.num_rays(); i++) {
-				results[i] *= 0.0f;
-			}
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return (t_ray_intersection());
 
-			return;
-		}
+		const float zmin = std::min(ray.pos().z() + tmin * ray.dir().z(), ray.pos().z() + tmax * ray.dir().z());
 
-		m_root->trace_slope_ray_column(&hits[0], slope_ray_column, tmin, tmax, 0);
+		if (m_cells == 0)
+			return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->traverse_ray(m_traversal_mode, count_cells(t_heightmap_cells<t_cell_type>(&m_heightmap), counters), m_lods, ray, tmin, tmax, zmin)));
 
-		for (int i = 0; i < slope_ray_column.num_rays(); i++) {
-			results[i] = shade_hit(hits[i]);
-		}
+		return (get_intersection<t_cell_type>(m_heightmap, ray, m_nodes->traverse_ray(m_traversal_mode, count_cells(get_cells(), counters), m_lods, ray, tmin, tmax, zmin)));
 	}
 
-private:
-	t_color shade_hit(const t_ray_intersection& hit) const {
-		t_color result;
-
-		if (hit.valid()) {
-			// convert the normal to a diffuse RGB color (TODO: read in a diffuse albedo texture)
-			const t_color albedo = t_color((0.5f * hit.sn().x() + 0.5f), (0.5f * hit.sn().y() + 0.5f), (0.5f * hit.sn().z() + 0.5f));
+	bool trace_counted_shadow_ray(t_const_ray ray, t_trace_counters& counters) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
 
-			// we only trace shadow secondary rays, so fake global illumination
-			result += (albedo * 0.25f);
+		if (!ray.time_in_rect(tmin, tmax,  0, m_xmax, 0, m_ymax))
+			return false;
 
-			for (size_t n = 0; n < m_light_sources.size(); n++) {
-				const t_vector light_dir = m_light_sources[n]->get_direction(hit.pos());
+		float zmin = ray.pos().z() + tmin * ray.dir().z();
+		float zmax = ray.pos().z() + tmax * ray.dir().z();
 
-				// calculate the strength of diffuse local illumination via dot(N, L)
-				const float obliquity_g = hit.gn() * light_dir;
-				const float obliquity_s = hit.sn() * light_dir;
+		if (zmin > zmax)
+			std::swap(zmin, zmax);
 
-				if (obliquity_s > 0.0f) {
-					if (obliquity_g > 0.0f) {
-						if (!trace_shadow_ray(t_ray(hit.pos(), light_dir))) {
-							result += (m_light_sources[n]->get_color() * albedo * obliquity_s);
-						}
-					} else {
-						const t_ray shadow_ray = t_ray(hit.pos() + light_dir, light_dir);
+		if (m_cells == 0)
+			return (m_nodes->traverse_shadow_ray(m_traversal_mode, count_cells(t_heightmap_cells<t_cell_type>(&m_heightmap), counters), m_lods, ray, tmin, tmax, zmin, zmax));
 
-						float tmin = 0.0f;
-						float tmax = 0.0f;
+		return (m_nodes->traverse_shadow_ray(m_traversal_mode, count_cells(get_cells(), counters), m_lods, ray, tmin, tmax, zmin, zmax));
+	}
 
-						if (shadow_ray.time_in_rect(tmin, tmax,  0, m_xmax, 0, m_ymax)) {
-							const float zmin = shadow_ray.pos().z() + tmin * shadow_ray.dir().z();
-							const float zmax = shadow_ray.pos().z() + tmax * shadow_ray.dir().z();
+	void trace_slope_ray_column(const t_slope_ray_column& slope_ray_column, t_color* results) const {
+		std::vector<t_ray_hit> hits(slope_ray_column.num_rays());
 
-							const t_ray_intersection shadow_int = m_root->trace_ray(shadow_ray, tmin, tmax, std::min(zmin, zmax));
+		float tmin = 0.0f;
+		float tmax = 0.0f;
 
-							if (!shadow_int.valid()) {
-								result += (m_light_sources[n]->get_color() * albedo * obliquity_s);
-							}
-						} else {
-							result += (m_light_sources[n]->get_color() * albedo * obliquity_s);
-						}
-					}
-				}
+		if (!(slope_ray_column.ray()).time_in_rect(tmin, tmax,  0, m_xmax, 0, m_ymax)) {
+			for (int i = 0; i < slope_ray_column.num_rays(); i++) {
+				results[i] *= 0.0f;
 			}
+
+			return;
 		}
 
-		return result;
+		if (m_cells == 0) {
+			m_nodes->trace_slope_ray_column(t_heightmap_cells<t_cell_type>(&m_heightmap), m_lods, &hits[0], slope_ray_column, tmin, tmax, 0);
+		} else {
+			m_nodes->trace_slope_ray_column(get_cells(), m_lods, &hits[0], slope_ray_column, tmin, tmax, 0);
+		}
+
+		for (int i = 0; i < slope_ray_column.num_rays(); i++) {
+			results[i] = shade_lit_hit(get_intersection<t_cell_type>(m_heightmap, slope_ray_column.get_ray(i), hits[i]));
+		}
+	}
+
+private:
+	enum {
+		CACHE_PARAM_XSIZE     = 0,
+		CACHE_PARAM_YSIZE     = 1,
+		CACHE_PARAM_NUM_NODES = 2,
+		CACHE_PARAM_NODE_SIZE = 3,
+		CACHE_PARAM_CELL_SIZE = 4,
+		CACHE_PARAM_COMPACT   = 5,
+		CACHE_PARAM_QSCALE    = 6,
+		CACHE_PARAM_QOFFSET   = 7,
+		CACHE_PARAM_LAYOUT    = 8,
+		CACHE_PARAM_COUNT     = 9,
+	};
+
+	enum {
+		CACHE_SECTION_HEIGHTMAP = 0,
+		CACHE_SECTION_NODES     = 1,
+		CACHE_SECTION_CELLS     = 2,
+		CACHE_SECTION_LODS      = 3,
+		CACHE_SECTION_COUNT     = 4,
+	};
+
+	t_cell_grid<t_cell_type> get_cells() const { return (t_cell_grid<t_cell_type>(m_cells, m_xmax)); }
+
+	void clear() {
+		m_arena.release();
+		m_cache.close();
+
+		m_nodes = 0;
+		m_lods = 0;
+		m_cells = 0;
+		m_num_nodes = 0;
 	}
 
 private:
@@ -401,8 +1169,19 @@ private:
 	size_t m_xmax;
 	size_t m_ymax;
 
-	t_kdtree_cell_scene_node<t_cell_type>* m_root;
+	// source of the tree, kept for the cache and to expand
+	// hits (and to rebuild cells while tracing if m_cells is
+	// null)
+	t_heightmap m_heightmap;
+
+	// root is the first node; all of these either live
+	// in the arena or in the cache-file mapping
+	const t_node* m_nodes;
+	const t_kdtree_cell_scene_lod* m_lods;
+	const t_cell_type* m_cells;
+
+	size_t m_num_nodes;
 
-	std::vector<t_light*> m_light_sources;
+	t_scene_cache m_cache;
 };
 
@@ -5,6 +5,8 @@
 
 class t_light {
 public:
+	virtual ~t_light() {}
+
 	// get the direction and distance to this light from pos
 	virtual t_vector get_direction(const t_vector& pos) const = 0;
 	virtual t_color get_color() const = 0;
@@ -4,13 +4,23 @@
 template <class t_cell_type>
 class t_linear_cell_scene: public t_scene {
 public:
-	~t_linear_cell_scene() {}
+	static_assert(t_cell_interface<t_cell_type>::value, "not a cell-type");
+
+	t_linear_cell_scene() {
+		m_ysize = 0;
+		m_xsize = 0;
+		m_cells = 0;
+	}
 
 	void assign_heightmap(const t_heightmap& heightmap) {
+		m_arena.release();
+
 		m_ysize = heightmap.height() - 1;
 		m_xsize = heightmap.width() - 1;
 
-		m_cells = new t_cell_type[m_xsize * m_ysize];
+		m_heightmap = heightmap;
+
+		m_cells = m_arena.create_array<t_cell_type>(m_xsize * m_ysize);
 
 		for (size_t y = 0; y < m_ysize; y++) {
 			for (size_t x = 0; x < m_xsize; x++) {
@@ -23,14 +33,18 @@ public:
 		return (t_color((0.5f * hit.sn().x() + 0.5f), (0.5f * hit.sn().y() + 0.5f), (0.5f * hit.sn().z() + 0.5f)));
 	}
 
-	// search through the grid (note: not the best way)
 	t_color trace_ray(t_const_ray ray) const {
+		return (shade_hit(intersect_ray(ray)));
+	}
+
+	// search through the grid (note: not the best way)
+	t_ray_intersection intersect_ray(t_const_ray ray) const {
 		t_ray traced_ray = ray;
-		t_ray_intersection traced_int;
+		t_ray_hit traced_int;
 
 		for (size_t y = 0; y < m_ysize; y++) {
 			for (size_t x = 0; x < m_xsize; x++) {
-				const t_ray_intersection hit = m_cells[y * m_xsize + x].trace_ray(traced_ray);
+				const t_ray_hit hit = m_cells[y * m_xsize + x].trace_ray(traced_ray, y * m_xsize + x);
 
 				if (hit.valid()) {
 					traced_int = hit;
@@ -39,7 +53,16 @@ public:
 			}
 		}
 
-		return (shade_hit(traced_int));
+		return (get_intersection<t_cell_type>(m_heightmap, ray, traced_int));
+	}
+
+	size_t num_heightmap_bytes() const { return (m_heightmap.num_bytes()); }
+
+	// the grid is a single level of leaves
+	void get_stats(t_scene_stats& stats) const {
+		stats.m_num_nodes = m_xsize * m_ysize;
+		stats.m_num_leaves = m_xsize * m_ysize;
+		stats.m_leaf_depths.assign(1, m_xsize * m_ysize);
 	}
 
 	bool trace_shadow_ray(t_const_ray ray) const {
@@ -47,7 +70,7 @@ public:
 
 		for (size_t y = 0; y < m_ysize; y++) {
 			for (size_t x = 0; x < m_xsize; x++) {
-				const t_ray_intersection ray_int = m_cells[y * m_xsize + x].trace_ray(ray);
+				const t_ray_hit ray_int = m_cells[y * m_xsize + x].trace_ray(ray, y * m_xsize + x);
 
 				if ((hit = ray_int.valid())) {
 					break;
@@ -63,5 +86,8 @@ private:
 	size_t m_xsize;
 
 	t_cell_type* m_cells;
+
+	// for expanding hits
+	t_heightmap m_heightmap;
 };
 
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <boost/thread.hpp>
+
+// thread-safe least-recently-used cache of immutable values, bounded by
+// the sum of their num_bytes(); values are handed out as shared pointers
+// so an evicted entry stays alive until its last reader lets go of it
+//
+template<typename t_value>
+class t_lru_cache {
+public:
+	typedef std::shared_ptr<const t_value> t_value_ptr;
+
+	t_lru_cache(size_t max_bytes = 0) {
+		m_max_bytes = max_bytes;
+		m_num_bytes = 0;
+		m_num_hits = 0;
+		m_num_misses = 0;
+	}
+
+	t_lru_cache(const t_lru_cache&) = delete;
+	t_lru_cache& operator = (const t_lru_cache&) = delete;
+
+	// returns the value for <key>, calling load(key) on a miss (which returns
+	// a t_value_ptr, null on failure); loads run outside the lock so that one
+	// slow read does not stall other threads, two racing loads of the same key
+	// keep whichever value got inserted first
+	template<typename t_load_func>
+	t_value_ptr get(size_t key, const t_load_func& load) {
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			const typename t_index::iterator it = m_index.find(key);
+
+			if (it != m_index.end()) {
+				m_entries.splice(m_entries.begin(), m_entries, it->second);
+				m_num_hits++;
+				return (it->second->second);
+			}
+
+			m_num_misses++;
+		}
+
+		const t_value_ptr value = load(key);
+
+		if (value == nullptr)
+			return value;
+
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		const typename t_index::iterator it = m_index.find(key);
+
+		if (it != m_index.end())
+			return (it->second->second);
+
+		m_entries.push_front(std::make_pair(key, value));
+		m_index[key] = m_entries.begin();
+		m_num_bytes += value->num_bytes();
+
+		// always keep the newest entry, even if it alone exceeds the budget
+		while (m_num_bytes > m_max_bytes && m_entries.size() > 1) {
+			m_num_bytes -= m_entries.back().second->num_bytes();
+			m_index.erase(m_entries.back().first);
+			m_entries.pop_back();
+		}
+
+		return value;
+	}
+
+	void clear() {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+
+		m_entries.clear();
+		m_index.clear();
+
+		m_num_bytes = 0;
+	}
+
+	void set_max_bytes(size_t max_bytes) { m_max_bytes = max_bytes; }
+
+	size_t max_bytes() const { return m_max_bytes; }
+	size_t num_bytes() const { return m_num_bytes; }
+	size_t num_hits() const { return m_num_hits; }
+	size_t num_misses() const { return m_num_misses; }
+
+private:
+	typedef std::list< std::pair<size_t, t_value_ptr> > t_entries;
+	typedef std::unordered_map<size_t, typename t_entries::iterator> t_index;
+
+	// most recently used first
+	t_entries m_entries;
+	t_index m_index;
+
+	boost::mutex m_mutex;
+
+	size_t m_max_bytes;
+	size_t m_num_bytes;
+
+	size_t m_num_hits;
+	size_t m_num_misses;
+};
@@ -1,5 +1,7 @@
+#include <cstring>
 #include <GL/glut.h>
 
+#include "benchmark.hpp"
 #include "renderer.hpp"
 
 static t_renderer* renderer = 0;
@@ -20,6 +22,10 @@ static void mouse_motion(int x, int y) { renderer->mouse_motion(x, y); }
 
 
 int main(int argc, char** argv) {
+	// headless, does not need a window
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+		return (run_benchmark(argc, argv));
+
 	#if (USE_STANDARD_GLUT == 1)
 	atexit(kill);
 	#endif
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// bounded lock-free queue for many producers and a single consumer (after
+// Vyukov's bounded MPMC queue): every slot carries a sequence number which
+// tells whether it is free for the producer that claimed its position or
+// holds a value for the consumer, so neither side ever blocks the other
+//
+template<typename t_value>
+class t_mpsc_queue {
+public:
+	t_mpsc_queue(size_t capacity = 1) { reset(capacity); }
+
+	// not thread-safe; <capacity> is rounded up to a power of two
+	void reset(size_t capacity) {
+		m_mask = round_capacity(capacity) - 1;
+		m_slots.reset(new t_slot[m_mask + 1]);
+
+		for (size_t n = 0; n <= m_mask; n++) {
+			m_slots[n].m_seq.store(n, std::memory_order_relaxed);
+		}
+
+		m_tail.store(0, std::memory_order_relaxed);
+		m_head = 0;
+	}
+
+	size_t capacity() const { return (m_mask + 1); }
+
+	// any thread; returns false if the queue is full
+	bool push(const t_value& value) {
+		size_t pos = m_tail.load(std::memory_order_relaxed);
+
+		for (;;) {
+			t_slot& slot = m_slots[pos & m_mask];
+
+			const size_t seq = slot.m_seq.load(std::memory_order_acquire);
+			const ptrdiff_t dif = ptrdiff_t(seq) - ptrdiff_t(pos);
+
+			if (dif == 0) {
+				// the slot is free, claim its position
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					slot.m_value = value;
+					slot.m_seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (dif < 0) {
+				// still holds the value from one lap ago
+				return false;
+			} else {
+				pos = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// consumer thread only; returns false if the queue is empty
+	bool pop(t_value& value) {
+		t_slot& slot = m_slots[m_head & m_mask];
+
+		if (slot.m_seq.load(std::memory_order_acquire) != (m_head + 1))
+			return false;
+
+		value = slot.m_value;
+
+		// free the slot for the producer one lap ahead
+		slot.m_seq.store(m_head + m_mask + 1, std::memory_order_release);
+		m_head += 1;
+		return true;
+	}
+
+private:
+	static size_t round_capacity(size_t capacity) {
+		size_t n = 1;
+
+		while (n < capacity)
+			n <<= 1;
+
+		return n;
+	}
+
+private:
+	struct t_slot {
+	public:
+		std::atomic<size_t> m_seq;
+		t_value m_value;
+	};
+
+	std::unique_ptr<t_slot[]> m_slots;
+	size_t m_mask;
+
+	// keep the producers' and the consumer's position on separate lines
+	char m_pad0[64];
+	std::atomic<size_t> m_tail;
+	char m_pad1[64];
+	size_t m_head;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include "arena.hpp"
+
+// fork-join helper for recursive builders: calls func(i, num_sub_tasks) for
+// each i in [0, num_items) while spreading <num_tasks> threads over the items
+// (the last item and those that get no share of the tasks run inline)
+//
+// the result does not depend on <num_tasks>, only the build-time does
+//
+template<typename t_func>
+void fork_join(size_t num_items, size_t num_tasks, const t_func& func) {
+	if (num_tasks <= 1 || num_items <= 1) {
+		for (size_t i = 0; i < num_items; i++) {
+			func(i, size_t(1));
+		}
+
+		return;
+	}
+
+	std::vector<boost::thread*> threads;
+	std::vector<size_t> inline_items;
+
+	threads.reserve(num_items);
+	inline_items.reserve(num_items);
+
+	for (size_t i = 0; i < num_items; i++) {
+		const size_t num_sub_tasks = (num_tasks * (i + 1)) / num_items - (num_tasks * i) / num_items;
+
+		if (num_sub_tasks == 0 || i == (num_items - 1)) {
+			inline_items.push_back(i);
+			continue;
+		}
+
+		threads.push_back(new boost::thread([&func, i, num_sub_tasks]() { func(i, num_sub_tasks); }));
+	}
+
+	for (size_t n = 0; n < inline_items.size(); n++) {
+		const size_t i = inline_items[n];
+		const size_t num_sub_tasks = (num_tasks * (i + 1)) / num_items - (num_tasks * i) / num_items;
+
+		func(i, std::max(num_sub_tasks, size_t(1)));
+	}
+
+	for (size_t n = 0; n < threads.size(); n++) {
+		threads[n]->join();
+		delete threads[n];
+	}
+}
+
+// as above, but calls func(arena, i, num_sub_tasks) where every item that
+// can run on a spawned thread allocates from its own forked sub-arena
+template<typename t_func>
+void fork_join(t_arena& arena, size_t num_items, size_t num_tasks, const t_func& func) {
+	if (num_tasks <= 1 || num_items <= 1) {
+		for (size_t i = 0; i < num_items; i++) {
+			func(arena, i, size_t(1));
+		}
+
+		return;
+	}
+
+	// fork in the calling thread, which owns <arena>
+	std::vector<t_arena*> arenas(num_items, &arena);
+
+	for (size_t i = 0; i < (num_items - 1); i++) {
+		arenas[i] = &arena.fork();
+	}
+
+	fork_join(num_items, num_tasks, [&](size_t i, size_t num_sub_tasks) { func(*arenas[i], i, num_sub_tasks); });
+}
+
+// splits [0, num_items) into <num_threads> contiguous bands (e.g. of image
+// rows) and calls func(begin, end) for each of them in parallel
+template<typename t_func>
+void for_each_band(size_t num_items, size_t num_threads, const t_func& func) {
+	const size_t num_bands = std::max(size_t(1), std::min(num_threads, num_items));
+
+	fork_join(num_bands, num_bands, [&](size_t i, size_t) {
+		func((num_items * i) / num_bands, (num_items * (i + 1)) / num_bands);
+	});
+}
@@ -1,17 +1,18 @@
 #pragma once
 
 #include "heightmap.hpp"
+#include "parallel.hpp"
 #include "ray.hpp"
 #include "scene.hpp"
 
 template <class t_cell_type>
 class t_quadtree_cell_scene_node {
 public:
-	t_ray_intersection trace_ray(t_const_ray ray) const {
+	t_ray_hit trace_ray(t_const_ray ray) const {
 		if (m_leaf != 0)
-			return (m_leaf->trace_ray(ray));
+			return (m_leaf->trace_ray(ray, m_cell_index));
 
-		t_ray_intersection result;
+		t_ray_hit result;
 		t_ray traced_ray = ray;
 
 		float tmin_x = (m_xmin - ray.pos().x()) / ray.dir().x();
@@ -47,7 +48,7 @@ public:
 
 		for (int i = 0; i < 4; i++) {
 			if (m_children[i] != 0) {
-				const t_ray_intersection hit = m_children[i]->trace_ray(traced_ray);
+				const t_ray_hit hit = m_children[i]->trace_ray(traced_ray);
 
 				if (hit.valid()) {
 					result = hit;
@@ -63,13 +64,32 @@ public:
 		return ((trace_ray(ray)).valid());
 	}
 
+	void get_stats(t_scene_stats& stats, size_t depth = 0) const {
+		stats.m_num_nodes += 1;
 
-	static t_quadtree_cell_scene_node<t_cell_type>* create_from_heightmap(const t_heightmap& heightmap) {
-		return (create_from_heightmap(heightmap, 0, heightmap.width() - 1, 0, heightmap.height() - 1));
+		if (m_leaf != 0) {
+			if (depth >= stats.m_leaf_depths.size())
+				stats.m_leaf_depths.resize(depth + 1, 0);
+
+			stats.m_leaf_depths[depth] += 1;
+			stats.m_num_leaves += 1;
+			return;
+		}
+
+		for (int i = 0; i < 4; i++) {
+			if (m_children[i] != 0) {
+				m_children[i]->get_stats(stats, depth + 1);
+			}
+		}
 	}
 
-    static t_quadtree_cell_scene_node<t_cell_type>* create_from_heightmap(const t_heightmap& heightmap, size_t xmin, size_t xmax, size_t ymin, size_t ymax) {
-		t_quadtree_cell_scene_node<t_cell_type>* result = new t_quadtree_cell_scene_node<t_cell_type>();
+
+	static t_quadtree_cell_scene_node<t_cell_type>* create_from_heightmap(t_arena& arena, const t_heightmap& heightmap, size_t num_tasks = 1) {
+		return (create_from_heightmap(arena, heightmap, 0, heightmap.width() - 1, 0, heightmap.height() - 1, num_tasks));
+	}
+
+	static t_quadtree_cell_scene_node<t_cell_type>* create_from_heightmap(t_arena& arena, const t_heightmap& heightmap, size_t xmin, size_t xmax, size_t ymin, size_t ymax, size_t num_tasks = 1) {
+		t_quadtree_cell_scene_node<t_cell_type>* result = arena.create< t_quadtree_cell_scene_node<t_cell_type> >();
 		result->m_xmin = xmin;
 		result->m_xmax = xmax;
 		result->m_ymin = ymin;
@@ -79,6 +99,21 @@ public:
 		result->m_children[2] = 0;
 		result->m_children[3] = 0;
 		result->m_leaf = 0;
+		result->m_cell_index = 0;
+
+		// child-slots and their rectangles {xmin, xmax, ymin, ymax}
+		size_t slots[4] = {0, 0, 0, 0};
+		size_t rects[4][4];
+		size_t num_children = 0;
+
+		const auto add_child = [&](size_t slot,  size_t cxmin, size_t cxmax, size_t cymin, size_t cymax) {
+			slots[num_children] = slot;
+			rects[num_children][0] = cxmin;
+			rects[num_children][1] = cxmax;
+			rects[num_children][2] = cymin;
+			rects[num_children][3] = cymax;
+			num_children++;
+		};
 
 		if (xmax > (xmin + 1)) {
 			if (ymax > (ymin + 1)) {
@@ -86,50 +121,63 @@ public:
 				const int xmid = (xmin + xmax) >> 1;
 				const int ymid = (ymin + ymax) >> 1;
 
-				result->m_children[0] = create_from_heightmap(heightmap, xmin, xmid, ymin, ymid);
-				result->m_children[1] = create_from_heightmap(heightmap, xmid, xmax, ymin, ymid);
-				result->m_children[2] = create_from_heightmap(heightmap, xmin, xmid, ymid, ymax);
-				result->m_children[3] = create_from_heightmap(heightmap, xmid, xmax, ymid, ymax);
-				result->m_min_height = std::min(result->m_children[0]->m_min_height, result->m_children[1]->m_min_height);
-				result->m_min_height = std::min(result->m_min_height, result->m_children[2]->m_min_height);
-				result->m_min_height = std::min(result->m_min_height, result->m_children[3]->m_min_height);
-				result->m_max_height = std::max(result->m_children[0]->m_max_height, result->m_children[1]->m_max_height);
-				result->m_max_height = std::max(result->m_max_height, result->m_children[2]->m_max_height);
-				result->m_max_height = std::max(result->m_max_height, result->m_children[3]->m_max_height);
+				add_child(0,  xmin, xmid, ymin, ymid);
+				add_child(1,  xmid, xmax, ymin, ymid);
+				add_child(2,  xmin, xmid, ymid, ymax);
+				add_child(3,  xmid, xmax, ymid, ymax);
 			} else {
 				// 2-node, split on x
 				const int xmid = (xmin + xmax) >> 1;
 
-				result->m_children[0] = create_from_heightmap(heightmap, xmin, xmid, ymin, ymax);
-				result->m_children[1] = create_from_heightmap(heightmap, xmid, xmax, ymin, ymax);
-				result->m_min_height = std::min(result->m_children[0]->m_min_height, result->m_children[1]->m_min_height);
-				result->m_max_height = std::max(result->m_children[0]->m_max_height, result->m_children[1]->m_max_height);
+				add_child(0,  xmin, xmid, ymin, ymax);
+				add_child(1,  xmid, xmax, ymin, ymax);
 			}
 		} else {
 			if (ymax > (ymin + 1)) {
 				// 2-node, split on y
 				const int ymid = (ymin + ymax) >> 1;
 
-				result->m_children[0] = create_from_heightmap(heightmap, xmin, xmax, ymin, ymid);
-				result->m_children[3] = create_from_heightmap(heightmap, xmin, xmax, ymid, ymax);
-				result->m_min_height = std::min(result->m_children[0]->m_min_height, result->m_children[3]->m_min_height);
-				result->m_max_height = std::max(result->m_children[0]->m_max_height, result->m_children[3]->m_max_height);
+				add_child(0,  xmin, xmax, ymin, ymid);
+				add_child(3,  xmin, xmax, ymid, ymax);
 			} else {
 				// leaf node
-				result->m_leaf = new t_cell_type();
+				result->m_leaf = arena.create<t_cell_type>();
+				result->m_cell_index = ymin * (heightmap.width() - 1) + xmin;
 				result->m_leaf->set_from_heightmap(heightmap, xmin, ymin);
 				result->m_min_height = result->m_leaf->get_min_height();
 				result->m_max_height = result->m_leaf->get_max_height();
+				return result;
 			}
 		}
 
+		// subtrees below this size are not worth a thread
+		if (((xmax - xmin) * (ymax - ymin)) < MIN_PARALLEL_BUILD_CELLS)
+			num_tasks = 1;
+
+		fork_join(arena, num_children, num_tasks, [&](t_arena& sub_arena, size_t i, size_t num_sub_tasks) {
+			result->m_children[slots[i]] = create_from_heightmap(sub_arena, heightmap, rects[i][0], rects[i][1], rects[i][2], rects[i][3], num_sub_tasks);
+		});
+
+		result->m_min_height = result->m_children[slots[0]]->m_min_height;
+		result->m_max_height = result->m_children[slots[0]]->m_max_height;
+
+		for (size_t i = 1; i < num_children; i++) {
+			result->m_min_height = std::min(result->m_min_height, result->m_children[slots[i]]->m_min_height);
+			result->m_max_height = std::max(result->m_max_height, result->m_children[slots[i]]->m_max_height);
+		}
+
 		return result;
 	}
 
 private:
+	static const size_t MIN_PARALLEL_BUILD_CELLS = 64 * 64;
+
 	t_quadtree_cell_scene_node<t_cell_type>* m_children[4];
 	t_cell_type* m_leaf;
 
+	// position of the leaf-cell in the scene's cell-grid
+	uint32_t m_cell_index;
+
 	float m_min_height;
 	float m_max_height;
 
@@ -142,11 +190,16 @@ private:
 template <class t_cell_type>
 class t_quadtree_cell_scene: public t_scene {
 public:
-	~t_quadtree_cell_scene() {}
+	static_assert(t_cell_interface<t_cell_type>::value, "not a cell-type");
+
+	t_quadtree_cell_scene() { m_root = 0; }
 
 	void assign_heightmap(const t_heightmap& heightmap) {
+		m_arena.release();
+		m_heightmap = heightmap;
+
 		// construct tree
-		m_root = t_quadtree_cell_scene_node<t_cell_type>::create_from_heightmap(heightmap); 
+		m_root = t_quadtree_cell_scene_node<t_cell_type>::create_from_heightmap(m_arena, heightmap, m_num_build_threads);
 	}
 
 	t_color shade_hit(const t_ray_intersection& hit) const {
@@ -154,14 +207,28 @@ public:
 	}
 
 	t_color trace_ray(t_const_ray ray) const {
-		return (shade_hit(m_root->trace_ray(ray)));
+		return (shade_hit(intersect_ray(ray)));
+	}
+	t_ray_intersection intersect_ray(t_const_ray ray) const {
+		return (get_intersection<t_cell_type>(m_heightmap, ray, m_root->trace_ray(ray)));
 	}
 
 	bool trace_shadow_ray(t_const_ray ray) const {
 		return (m_root->trace_shadow_ray(ray));
 	}
 
+	size_t num_heightmap_bytes() const { return (m_heightmap.num_bytes()); }
+
+	void get_stats(t_scene_stats& stats) const {
+		if (m_root != 0) {
+			m_root->get_stats(stats);
+		}
+	}
+
 private:
 	t_quadtree_cell_scene_node<t_cell_type>* m_root;
+
+	// for expanding hits
+	t_heightmap m_heightmap;
 };
 
@@ -5,10 +5,11 @@
 class t_ray {
 public:
 	t_ray() {}
-	t_ray(t_const_vec pos, t_const_vec dir, float tmax = -1.0f) {
+	t_ray(t_const_vec pos, t_const_vec dir, float tmax = -1.0f, float spread = 0.0f) {
 		m_pos = pos;
 		m_dir = dir;
 		m_tmax = tmax;
+		m_spread = spread;
 	}
 
 	t_vector point(float t) const { return (m_pos + m_dir * t); }
@@ -23,7 +24,11 @@ public:
 	const t_vector& pos() const { return m_pos; }
 	const t_vector& dir() const { return m_dir; }
 
-	float& tmax() { return m_tmax; }
+	float  tmax() const { return m_tmax; }
+	float& tmax()       { return m_tmax; }
+
+	// width of the ray-cone at unit distance, zero for exact rays
+	float spread() const { return m_spread; }
 
 private:
 	t_vector m_pos; // origin
@@ -31,5 +36,6 @@ private:
 
 	// defines our segment length
 	float m_tmax;
+	float m_spread;
 };
 
@@ -6,12 +6,13 @@
 class t_ray_column {
 public:
 	// note: <dirs> must be sorted in ascending order
-	t_ray_column(t_const_vec origin, t_vector* dirs, float xdir, float ydir, int num_rays) {
+	t_ray_column(t_const_vec origin, t_vector* dirs, float xdir, float ydir, int num_rays, float spread = 0.0f) {
 		m_origin = origin;
 		m_dirs = dirs;
 		m_xdir = xdir;
 		m_ydir = ydir;
 		m_num_rays = num_rays;
+		m_spread = spread;
 	}
 
 	const t_vector& pos() const { return m_origin; }
@@ -22,6 +23,8 @@ public:
 
 	int num_rays() const { return m_num_rays; }
 
+	float spread() const { return m_spread; }
+
 private:
 	t_vector m_origin;
 	t_vector* m_dirs;
@@ -30,5 +33,8 @@ private:
 	float m_ydir;
 
 	int m_num_rays;
+
+	// ray-cone spread shared by all rays
+	float m_spread;
 };
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #include "color.hpp"
 #include "vector.hpp"
 
@@ -52,3 +54,48 @@ private:
 	float m_time;
 };
 
+
+
+// slim record of a hit as returned through the traversals; only the
+// nearest one is expanded into a t_ray_intersection (by the cell-type)
+class t_ray_hit {
+public:
+	t_ray_hit(float t = -1.0f) {
+		m_time = t;
+		m_id = 0;
+		m_u = 0.0f;
+		m_v = 0.0f;
+	}
+
+	t_ray_hit(float t, uint32_t id, float u, float v) {
+		m_time = t;
+		m_id = id;
+		m_u = u;
+		m_v = v;
+	}
+
+	float time() const { return m_time; }
+	uint32_t id() const { return m_id; }
+
+	float u() const { return m_u; }
+	float v() const { return m_v; }
+
+	bool valid() const { return (time() >= 0.0f); }
+	bool is_plane() const { return (m_id == PLANE_ID); }
+
+	// marks hits on a level-of-detail plane
+	static const uint32_t PLANE_ID = 0xffffffff;
+
+private:
+	// parametric time of intersection
+	float m_time;
+
+	// what was hit, as encoded by the cell-type (or PLANE_ID)
+	uint32_t m_id;
+
+	// barycentric coordinates on the hit primitive, or
+	// the slopes dz/dx and dz/dy of a plane
+	float m_u;
+	float m_v;
+};
+
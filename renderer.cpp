@@ -5,7 +5,6 @@
 #include <fstream>
 #include <sstream>
 
-#include <boost/chrono.hpp>
 #include <GL/glut.h>
 
 #include "lib/FreeImage.h"
@@ -16,31 +15,11 @@
 #include "linear_cell_scene.hpp"
 #include "quadtree_cell_scene.hpp"
 #include "kdtree_cell_scene.hpp"
-
-#if 0
-struct t_thread_state {
-private:
-	boost::thread* m_thread;
-	boost::mutex* m_mutex;
-
-	// produced sub-frame image chunks
-	std::list<t_bitmap> m_chunks;
-};
-#endif
-
-enum {
-	SCENETYPE_LINEAR   = 0,
-	SCENETYPE_QUADTREE = 1,
-	SCENETYPE_KDTREE   = 2,
-};
-
-
-
-static int64_t get_tick() {
-	const boost::chrono::high_resolution_clock::time_point cur_time = boost::chrono::high_resolution_clock::now();
-	const boost::chrono::nanoseconds run_time = boost::chrono::duration_cast<boost::chrono::nanoseconds>(cur_time.time_since_epoch());
-	return (run_time.count());
-}
+#include "tiled_kdtree_cell_scene.hpp"
+#include "bvh4_cell_scene.hpp"
+#include "cone_step_cell_scene.hpp"
+#include "scene_cache.hpp"
+#include "terrain_generator.hpp"
 
 static float deg2rad(float x) { return (x * (M_PI / 180.0f)); }
 static float rnd_flt() { return (float(rand()) / RAND_MAX); }
@@ -50,8 +29,10 @@ static float rnd_flt() { return (float(rand()) / RAND_MAX); }
 t_renderer::t_renderer() {
 	m_epoch_tick = get_tick();
 	m_frame_tick = get_tick();
+	m_frame_end_tick = get_tick();
 
 	m_thread_count = boost::thread::hardware_concurrency();
+	m_build_thread_count = boost::thread::hardware_concurrency();
 	m_frame_count = 0;
 	m_scene_type = SCENETYPE_KDTREE;
 
@@ -74,6 +55,20 @@ t_renderer::t_renderer() {
 
 	m_quit_tracing = false;
 	m_trace_columns = true;
+	m_huge_pages = false;
+	m_lod_error = 0.0f;
+	m_compact_heights = false;
+	m_split_mode = SPLIT_MODE_EVEN;
+	m_timeline_frames = 256;
+	m_timeline_phases = false;
+	m_heatmap_metric = -1;
+	m_chunk_size = 32;
+	m_image_layout = t_sample_layout::LAYOUT_LINEAR;
+	m_map_layout = t_sample_layout::LAYOUT_LINEAR;
+	m_leaf_size = 1;
+	m_planar_error = 0.0f;
+	m_traversal_mode = TRAVERSAL_MODE_STACK;
+	m_num_chunks = 0;
 
 	const time_t raw_time = time(0);
 	const tm* loc_time = localtime(&raw_time);
@@ -100,6 +95,12 @@ t_renderer::~t_renderer() {
 	printf("\trender-time: %gsec\n", (render_time * 1e-9));
 	printf("\trender-rate: %gfps\n", render_rate);
 
+	m_frame_stats.print(stdout);
+
+	if (m_timeline.enabled() && m_timeline.write(m_timeline_file.c_str(), m_epoch_tick)) {
+		printf("\ttimeline: wrote %s\n", m_timeline_file.c_str());
+	}
+
 	delete m_barrier;
 	delete m_camera;
 	delete m_scene;
@@ -107,24 +108,122 @@ t_renderer::~t_renderer() {
 
 
 void t_renderer::spawn_threads() {
+	m_frame_stats.reset(std::max(m_thread_count, size_t(1)), 4096);
+	m_cost_map.resize(m_camera->get_view_size_x(), m_camera->get_view_size_y());
+
+	size_t num_threads_x = 1;
+	size_t num_threads_y = 1;
+
+	if (m_thread_count > 1)
+		get_thread_grid(m_thread_count, num_threads_x, num_threads_y);
+
+	m_thread_states.clear();
+	m_thread_states.resize(num_threads_x * num_threads_y);
+
+	size_t num_chunks = 0;
+	size_t max_thread_chunks = 0;
+
+	for (size_t y = 0; y < num_threads_y; y++) {
+		for (size_t x = 0; x < num_threads_x; x++) {
+			const size_t xmin = (m_camera->get_view_size_x() / num_threads_x) * (x + 0), xmax = (m_camera->get_view_size_x() / num_threads_x) * (x + 1);
+			const size_t ymin = (m_camera->get_view_size_y() / num_threads_y) * (y + 0), ymax = (m_camera->get_view_size_y() / num_threads_y) * (y + 1);
+
+			t_thread_state& state = m_thread_states[y * num_threads_x + x];
+
+			state.set_tile(xmin, xmax, ymin, ymax, m_chunk_size, m_image_layout);
+
+			num_chunks += state.m_chunks.size();
+			max_thread_chunks = std::max(max_thread_chunks, state.m_chunks.size());
+		}
+	}
+
+	// every chunk of a frame fits, so publishing one never waits for the main thread
+	m_chunk_queue.reset(num_chunks);
+	m_num_chunks = num_chunks;
+
+	// thread 0 is the main thread, worker n is thread n + 1; a frame takes at
+	// most four spans on the main thread and three (plus three per chunk) on
+	// a worker
+	if (!m_timeline_file.empty()) {
+		m_timeline.reset(m_thread_states.size() + 1, m_timeline_frames * (3 + 3 * max_thread_chunks));
+		m_timeline.set_thread_name(0, "main");
+	}
+
 	if (m_thread_count <= 1) {
+		if (m_timeline.enabled())
+			m_timeline.set_thread_name(1, "main (tracing)");
+
 		// dummy for the ST case
 		m_barrier = new boost::barrier(1);
 		return;
 	}
 
 	assert(m_thread_count != 0);
-	assert((m_thread_count % 2) == 0);
 
 	m_barrier = new boost::barrier(m_thread_count + 1);
 	m_threads.resize(m_thread_count, NULL);
 
-	size_t num_threads_x = 0;
-	size_t num_threads_y = 0;
-
 	// spawn threads to perform the actual raytracing in lockstep
 	// these will be cranked by display() calls in the main-thread
-	switch (m_thread_count) {
+	for (size_t worker = 0; worker < m_thread_count; worker++) {
+		if (m_timeline.enabled()) {
+			const t_thread_state& state = m_thread_states[worker];
+
+			char name[64];
+			snprintf(name, sizeof(name), "worker %lu (%lu-%lu, %lu-%lu)", worker, state.m_xmin, state.m_xmax, state.m_ymin, state.m_ymax);
+
+			m_timeline.set_thread_name(worker + 1, name);
+		}
+
+		m_threads[worker] = new boost::thread(&t_renderer::trace_frames, this,  worker);
+	}
+}
+
+void t_renderer::t_thread_state::set_tile(size_t xmin, size_t xmax, size_t ymin, size_t ymax, size_t chunk_size, int layout) {
+	// pixels per (64-byte) cache-line
+	const size_t line_size = 16;
+
+	m_xmin = xmin; m_xmax = xmax;
+	m_ymin = ymin; m_ymax = ymax;
+
+	m_chunks.clear();
+
+	chunk_size = std::max(chunk_size, size_t(1));
+
+	size_t num_pixels = 0;
+
+	// bands of columns, which suit both the row- and the column-tracers
+	for (size_t x = xmin; x < xmax; x += chunk_size) {
+		m_chunks.emplace_back(x, std::min(x + chunk_size, xmax), ymin, ymax, static_cast<uint32_t*>(0), layout);
+
+		num_pixels += m_chunks.back().num_pixels();
+	}
+
+	// start and end the pixels on lines of their own, so no two threads
+	// ever write to the same line
+	m_buffer.clear();
+	m_buffer.resize(num_pixels + line_size * 2, 0);
+
+	uint32_t* pixels = &m_buffer[0];
+
+	while ((reinterpret_cast<uintptr_t>(pixels) % (line_size * sizeof(uint32_t))) != 0)
+		pixels++;
+
+	// blocked chunks span whole blocks, so each of theirs starts a line
+	for (size_t n = 0; n < m_chunks.size(); n++) {
+		m_chunks[n].m_pixels = pixels;
+
+		pixels += m_chunks[n].num_pixels();
+	}
+}
+
+
+void t_renderer::get_thread_grid(size_t num_threads, size_t& num_threads_x, size_t& num_threads_y) {
+	// counts without a tile-layout get one band of rows per thread
+	num_threads_x = 1;
+	num_threads_y = num_threads;
+
+	switch (num_threads) {
 		case  2: {
 			num_threads_x = 1;
 			num_threads_y = 2;
@@ -165,24 +264,30 @@ void t_renderer::spawn_threads() {
 			num_threads_y = 16;
 		} break;
 	}
+}
 
-	for (size_t y = 0; y < num_threads_y; y++) {
-		for (size_t x = 0; x < num_threads_x; x++) {
-			const int xmin = (m_camera->get_view_size_x() / num_threads_x) * (x + 0), xmax = (m_camera->get_view_size_x() / num_threads_x) * (x + 1);
-			const int ymin = (m_camera->get_view_size_y() / num_threads_y) * (y + 0), ymax = (m_camera->get_view_size_y() / num_threads_y) * (y + 1);
-
-			if (m_trace_columns) {
-				m_threads[y * num_threads_x + x] = new boost::thread(&t_renderer::trace_ray_columns, this,  xmin, xmax, ymin, ymax);
-			} else {
-				m_threads[y * num_threads_x + x] = new boost::thread(&t_renderer::trace_rays, this,  xmin, xmax, ymin, ymax);
-			}
-		}
+t_scene* t_renderer::create_scene(size_t scene_type) {
+	switch (scene_type) {
+		case SCENETYPE_LINEAR:   { return (new   t_linear_cell_scene<t_tri_cell>()); } break;
+		case SCENETYPE_QUADTREE: { return (new t_quadtree_cell_scene<t_tri_cell>()); } break;
+		case SCENETYPE_KDTREE:   { return (new   t_kdtree_cell_scene<t_tri_cell>()); } break;
+		case SCENETYPE_TILED_KDTREE: { return (new t_tiled_kdtree_cell_scene<t_tri_cell>()); } break;
+		case SCENETYPE_BVH4:     { return (new     t_bvh4_cell_scene<t_tri_cell>()); } break;
+		case SCENETYPE_CONE_STEP: { return (new t_cone_step_cell_scene<t_tri_cell>()); } break;
 	}
+
+	return 0;
 }
 
 
+float t_renderer::get_ray_spread() const {
+	// pixel-width on the image-plane at unit distance, times the tolerated error
+	return (std::tan(m_camera->fov() * 0.5f) / m_camera->get_view_size_x() * m_lod_error);
+}
+
 void t_renderer::set_viewport(size_t x, size_t y) {
 	m_camera->set_image_size(x, y);
+	m_cost_map.resize(x, y);
 
 	glViewport(0, 0, x, y);
 	glMatrixMode(GL_PROJECTION);
@@ -201,17 +306,34 @@ void t_renderer::read_config(const char* filename) {
 
 	is.open(filename);
 
+	struct t_map_source {
+	public:
+		std::string m_name;
+		float m_scale;
+
+		// procedural maps (m_name is empty) only
+		t_terrain_generator m_generator;
+
+		size_t m_xsize;
+		size_t m_ysize;
+	};
+
 	struct t_scene_data {
 	public:
-		std::vector<t_heightmap> m_images;
+		std::vector<t_map_source> m_maps;
 		std::vector<t_light*> m_lights;
 	};
 
 	t_scene_data scene_data;
 
-	while ((std::getline(is, line)).good()) {
-		assert(!line.empty());
+	// out-of-core maps (tiled kd-tree scenes only)
+	std::string tiles_name;
+	size_t tile_size = 256;
+	size_t tile_cache_mb = 256;
 
+	while ((std::getline(is, line)).good()) {
+		if (line.empty())
+			continue;
 		if (line[0] == '\n')
 			continue;
 		if (line[0] == '\r')
@@ -219,21 +341,66 @@ void t_renderer::read_config(const char* filename) {
 		if (line[0] == '#')
 			continue;
 
-		ss << line;
+		// reset the stream, extracting the last value of a line sets its eof-bit
+		ss.clear();
+		ss.str(line);
 		ss >> oper; // extract key
 
 		if (oper ==   "num_threads") { ss >> m_thread_count; continue; }
+		if (oper == "build_threads") { ss >> m_build_thread_count; continue; }
 		if (oper ==    "scene_type") { ss >> m_scene_type; continue; }
 		if (oper == "trace_columns") { ss >> m_trace_columns; continue; }
+		if (oper ==    "huge_pages") { ss >> m_huge_pages; continue; }
+		if (oper ==   "scene_cache") { ss >> m_scene_cache_dir; continue; }
+		if (oper ==     "lod_error") { ss >> m_lod_error; continue; }
+		if (oper == "compact_heights") { ss >> m_compact_heights; continue; }
+		if (oper ==    "split_mode") { ss >> m_split_mode; continue; }
+		if (oper ==    "chunk_size") { ss >> m_chunk_size; continue; }
+		if (oper ==     "leaf_size") { ss >> m_leaf_size; continue; }
+		if (oper ==  "planar_error") { ss >> m_planar_error; continue; }
+		if (oper == "traversal_mode") { ss >> m_traversal_mode; continue; }
+
+		if (oper == "image_layout" || oper == "map_layout") {
+			// <linear|blocked|morton>
+			std::string name;
+			ss >> name;
+
+			const int layout = t_sample_layout::parse_type(name.c_str());
+
+			if (layout < 0) {
+				printf("[%s] unknown layout \"%s\"\n", __FUNCTION__, name.c_str());
+				continue;
+			}
+
+			if (oper == "image_layout") {
+				m_image_layout = layout;
+			} else {
+				m_map_layout = layout;
+			}
+
+			continue;
+		}
+		if (oper ==      "timeline") { ss >> m_timeline_file; ss >> m_timeline_frames; ss >> m_timeline_phases; continue; }
 
 		if (oper == "camera_pos") { ss >> m_camera->pos(); continue; }
 		if (oper == "camera_dir") { ss >> m_camera->dir(); m_camera->dir().normalize_xyz(); continue; }
 		if (oper == "camera_fov") { ss >> m_camera->fov(); m_camera->fov() = deg2rad(m_camera->fov()); continue; }
+		if (oper == "camera_gamma") { float gamma = 1.0f; ss >> gamma; m_camera->set_gamma(gamma); continue; }
 
 		if (oper == "camera_mov_speed") { ss >> camera_transl_speed; continue; }
 		if (oper == "camera_rot_speed") { ss >> camera_rotate_speed; continue; }
 		if (oper == "mouse_sensitivity") { ss >> m_mouse_scale; continue; }
 
+		if (oper == "heatmap") {
+			// <nodes|cells|shadow|time>
+			std::string metric;
+			ss >> metric;
+
+			m_heatmap_metric = t_cost_map::parse_metric(metric.c_str());
+			m_cost_map.set_metric(m_heatmap_metric);
+			continue;
+		}
+
 		if (oper == "view_size") {
 			size_t vsx; ss >> vsx;
 			size_t vsy; ss >> vsy;
@@ -243,14 +410,48 @@ void t_renderer::read_config(const char* filename) {
 		}
 
 		if (oper == "map_image") {
-			std::string name; ss >> name;
-			float scale; ss >> scale;
+			// loaded on demand, a cached scene does not need the image
+			scene_data.m_maps.emplace_back(t_map_source());
+			ss >> scene_data.m_maps.back().m_name;
+			ss >> scene_data.m_maps.back().m_scale;
+			continue;
+		}
+
+		if (oper == "map_terrain") {
+			// <xsize> <ysize> <scale> <seed> <fbm|ridged|eroded> [<octaves> [<feature size>]]
+			std::string type;
+			uint32_t seed = 1;
+			size_t num_octaves = 0;
+			float feature_size = 0.0f;
+
+			scene_data.m_maps.emplace_back(t_map_source());
+
+			t_map_source& map = scene_data.m_maps.back();
+
+			ss >> map.m_xsize;
+			ss >> map.m_ysize;
+			ss >> map.m_scale;
+			ss >> seed;
+			ss >> type;
+
+			ss >> num_octaves;
+			ss >> feature_size;
+
+			map.m_generator.set_seed(seed);
+			map.m_generator.set_type(std::max(0, t_terrain_generator::parse_type(type.c_str())));
+
+			if (num_octaves > 0)
+				map.m_generator.set_num_octaves(num_octaves);
+			if (feature_size > 0.0f)
+				map.m_generator.set_feature_size(feature_size);
 
-			scene_data.m_images.emplace_back(t_heightmap());
-			scene_data.m_images.back().set_data(FreeImage_Load(FIF_PNG, name.c_str()), scale);
 			continue;
 		}
 
+		if (oper == "map_tiles") { ss >> tiles_name; continue; }
+		if (oper == "map_tile_size") { ss >> tile_size; continue; }
+		if (oper == "map_tile_cache") { ss >> tile_cache_mb; continue; }
+
 		if (oper == "light_source") {
 			t_vector dir;
 			t_color color;
@@ -266,17 +467,129 @@ void t_renderer::read_config(const char* filename) {
 	is.close();
 
 
-	switch (m_scene_type) {
-		case SCENETYPE_LINEAR:   { m_scene = new   t_linear_cell_scene<t_tri_cell>(); } break;
-		case SCENETYPE_QUADTREE: { m_scene = new t_quadtree_cell_scene<t_tri_cell>(); } break;
-		case SCENETYPE_KDTREE:   { m_scene = new   t_kdtree_cell_scene<t_tri_cell>(); } break;
-	}
+	m_scene = create_scene(m_scene_type);
+
+	t_tiled_kdtree_cell_scene<t_tri_cell>* tiled_scene = 0;
+
+	if (m_scene_type == SCENETYPE_TILED_KDTREE)
+		tiled_scene = static_cast<t_tiled_kdtree_cell_scene<t_tri_cell>*>(m_scene);
 
 	assert(m_scene != 0);
-	assert(!scene_data.m_images.empty());
+	assert(!scene_data.m_maps.empty() || (tiled_scene != 0 && !tiles_name.empty()));
 	assert(!scene_data.m_lights.empty());
 
-	m_scene->assign_heightmap(scene_data.m_images.back());
+	// must be set before the arena allocates its first block
+	m_scene->get_arena().set_huge_pages(m_huge_pages);
+	m_scene->set_num_build_threads(m_build_thread_count);
+	m_scene->set_compact_heights(m_compact_heights);
+	m_scene->set_split_mode(m_split_mode);
+	m_scene->set_heightmap_layout(m_map_layout);
+	m_scene->set_leaf_size(m_leaf_size);
+	m_scene->set_planar_error(m_planar_error);
+	m_scene->set_traversal_mode(m_traversal_mode);
+
+	if (tiled_scene != 0) {
+		tiled_scene->set_tile_size(tile_size);
+		tiled_scene->set_tile_cache_size(tile_cache_mb << 20);
+	}
+
+	const int64_t build_tick = get_tick();
+
+	int64_t load_time = 0;
+
+	const auto load_map = [&](const t_map_source& map, t_heightmap& heightmap) {
+		const int64_t load_tick = get_tick();
+
+		// prints the reason if it fails
+		if (map.m_name.empty()) {
+			map.m_generator.generate(heightmap, map.m_xsize, map.m_ysize, map.m_scale, m_build_thread_count);
+		} else {
+			heightmap.load(map.m_name.c_str(), map.m_scale, m_build_thread_count);
+		}
+
+		load_time = get_tick() - load_tick;
+
+		assert(heightmap.width() > 1 && heightmap.height() > 1);
+	};
+
+	std::string cache_name;
+	uint64_t cache_key = 0;
+	bool cache_hit = false;
+	bool tiles_open = false;
+
+	if (tiled_scene != 0 && !tiles_name.empty()) {
+		// convert the image once, later runs only page in tiles
+		if (!(tiles_open = tiled_scene->open_tiles(tiles_name.c_str()))) {
+			assert(!scene_data.m_maps.empty());
+
+			const t_map_source& map = scene_data.m_maps.back();
+
+			// map files are streamed a row of tiles at a time, generated ones are normalized over the whole map
+			if (map.m_name.empty()) {
+				t_heightmap heightmap;
+				load_map(map, heightmap);
+
+				t_tiled_heightmap::write(tiles_name.c_str(), heightmap, tile_size, m_compact_heights);
+			} else {
+				const int64_t load_tick = get_tick();
+
+				t_tiled_heightmap::write(tiles_name.c_str(), map.m_name.c_str(), map.m_scale, tile_size, m_compact_heights, m_build_thread_count);
+
+				load_time = get_tick() - load_tick;
+			}
+
+			tiles_open = tiled_scene->open_tiles(tiles_name.c_str());
+		}
+	} else if (!m_scene_cache_dir.empty() && !m_scene->supports_cache()) {
+		printf("[%s] scene_cache is not supported by scene_type %lu, ignored\n", __FUNCTION__, m_scene_type);
+	} else if (!m_scene_cache_dir.empty()) {
+		const t_map_source& map = scene_data.m_maps.back();
+
+		// key on everything the built structure depends on
+		cache_key = hash_value(m_scene_type, m_scene->get_build_key());
+		cache_key = hash_value(map.m_scale, cache_key);
+
+		if (map.m_name.empty()) {
+			cache_key = hash_value(map.m_xsize, cache_key);
+			cache_key = hash_value(map.m_ysize, cache_key);
+			cache_key = map.m_generator.get_hash(cache_key);
+		} else {
+			cache_key = hash_file(map.m_name.c_str(), cache_key);
+		}
+
+		char key_str[32];
+		snprintf(key_str, sizeof(key_str), "%016llx", (unsigned long long) cache_key);
+
+		cache_name = m_scene_cache_dir + "/" + key_str + ".scene";
+		cache_hit = m_scene->read_cache(cache_name.c_str(), cache_key);
+	}
+
+	if (!cache_hit && !tiles_open) {
+		t_heightmap heightmap;
+		load_map(scene_data.m_maps.back(), heightmap);
+
+		m_scene->assign_heightmap(heightmap);
+	}
+
+	const int64_t build_time = get_tick() - build_tick; // ns
+	const t_arena& scene_arena = m_scene->get_arena();
+
+	printf("[%s]\n", __FUNCTION__);
+	printf("\tbuild-time: %gms (%lu threads, %gms to load the map)\n", (build_time * 1e-6), m_build_thread_count, (load_time * 1e-6));
+	printf("\tbuild-size: %lu bytes used, %lu bytes reserved (%lu blocks)\n", scene_arena.num_bytes_used(), scene_arena.num_bytes_reserved(), scene_arena.num_blocks());
+
+	if (tiled_scene != 0) {
+		const t_tiled_heightmap& tiles = tiled_scene->get_tiles();
+		printf("\tmap-tiles: %lux%lu tiles of %lu cells, %luMB cache\n", tiles.num_tiles_x(), tiles.num_tiles_y(), tiles.tile_size(), tile_cache_mb);
+	}
+
+	if (!cache_name.empty()) {
+		if (cache_hit) {
+			printf("\tscene-cache: mapped %s\n", cache_name.c_str());
+		} else if (m_scene->write_cache(cache_name.c_str(), cache_key)) {
+			printf("\tscene-cache: wrote %s\n", cache_name.c_str());
+		}
+	}
 
 	for (size_t n = 0; n < scene_data.m_lights.size(); n++) {
 		m_scene->assign_light_source(scene_data.m_lights[n]);
@@ -316,29 +629,90 @@ void t_renderer::display() {
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
+	const int64_t trace_tick = get_tick();
 
 	if (!m_threads.empty()) {
 		#if (USE_BARRIERS == 1)
 		// signal each thread to start its iteration
 		m_barrier->wait();
+		#endif
+	} else {
+		trace_tile(0);
+	}
+
+	// copy the chunks into the image as they are finished; nothing drawn
+	// into the back buffer would show before the swap, so the image is
+	// still uploaded once, after the last chunk
+	int64_t copy_time = 0;
+
+	for (size_t n = 0; n < m_num_chunks; n++) {
+		const t_image_chunk* chunk = 0;
+
+		// chunks finish close together, so spin briefly before sleeping
+		for (size_t k = 0; k < 64 && !m_chunk_queue.pop(chunk); k++) {
+			boost::this_thread::yield();
+		}
+
+		if (chunk == 0) {
+			boost::unique_lock<boost::mutex> lock(m_chunk_mutex);
+
+			while (!m_chunk_queue.pop(chunk)) {
+				m_chunk_cond.wait(lock);
+			}
+		}
+
+		const int64_t copy_tick = get_tick();
+
+		m_camera->set_image_chunk(*chunk);
+
+		copy_time += (get_tick() - copy_tick);
+	}
+
+	if (!m_threads.empty()) {
+		#if (USE_BARRIERS == 1)
 		// wait for each thread to finish its iteration
 		m_barrier->wait();
 		#endif
-	} else {
-		if (m_trace_columns) {
-			trace_ray_columns(0, m_camera->get_view_size_x(), 0, m_camera->get_view_size_y());
-		} else {
-			trace_rays(0, m_camera->get_view_size_x(), 0, m_camera->get_view_size_y());
+	}
+
+	if (m_heatmap_metric >= 0) {
+		const float scale = m_cost_map.get_scale();
+
+		for (size_t y = 0; y < m_camera->get_view_size_y(); y++) {
+			for (size_t x = 0; x < m_camera->get_view_size_x(); x++) {
+				m_camera->set_image_pixel(x, y, m_cost_map.get_color(x, y, scale));
+			}
 		}
 	}
 
+	const int64_t draw_tick = get_tick();
+
 	// show the composite result
 	m_camera->draw_image();
 
+	const int64_t swap_tick = get_tick();
 
 	// glFlush();
 	glutSwapBuffers();
 
+	const int64_t end_tick = get_tick();
+
+	m_frame_stats.set_phase_time(t_frame_stats::FRAME_PHASE_UPDATE, trace_tick - m_frame_tick);
+	// chunks are copied while the workers trace, but count as drawing
+	m_frame_stats.set_phase_time(t_frame_stats::FRAME_PHASE_TRACE, draw_tick - trace_tick - copy_time);
+	m_frame_stats.set_phase_time(t_frame_stats::FRAME_PHASE_DRAW, swap_tick - draw_tick + copy_time);
+	m_frame_stats.set_phase_time(t_frame_stats::FRAME_PHASE_SWAP, end_tick - swap_tick);
+	m_frame_stats.set_phase_time(t_frame_stats::FRAME_PHASE_TOTAL, end_tick - m_frame_end_tick);
+
+	m_timeline.add_span(0, "update", m_frame_tick, trace_tick);
+	m_timeline.add_span(0, "trace", trace_tick, draw_tick);
+	m_timeline.add_span(0, "draw_image", draw_tick, swap_tick);
+	m_timeline.add_span(0, "swap", swap_tick, end_tick);
+
+	// workers are done with this frame (they wait at the barrier)
+	m_frame_stats.end_frame();
+
+	m_frame_end_tick = end_tick;
 	m_frame_count++;
 }
 
@@ -361,6 +735,22 @@ void t_renderer::idle() {
 void t_renderer::keyboard_down(unsigned char key, int, int) {
 	switch (key) {
 		case 'x': { m_quit_tracing = true; } break;
+		case 'p': {
+			m_frame_stats.print(stdout);
+
+			if (m_heatmap_metric >= 0) {
+				printf("\theatmap: %s, %g at full heat\n", t_cost_map::get_metric_name(m_heatmap_metric), m_cost_map.get_scale());
+			}
+		} break;
+
+		case 'h': {
+			// cycle through the heatmap metrics and back to the shaded image
+			if ((m_heatmap_metric += 1) >= t_cost_map::COST_METRIC_COUNT)
+				m_heatmap_metric = -1;
+
+			m_cost_map.set_metric(m_heatmap_metric);
+			printf("[%s] heatmap: %s\n", __FUNCTION__, t_cost_map::get_metric_name(m_heatmap_metric));
+		} break;
 
 		case 'a': { camera_azim_angle =  camera_rotate_speed; } break;
 		case 'd': { camera_azim_angle = -camera_rotate_speed; } break;
@@ -420,147 +810,228 @@ void t_renderer::mouse_motion(int x, int y) {
 
 
 
-void t_renderer::trace_rays(size_t xmin, size_t xmax, size_t ymin, size_t ymax) {
-	const float fscale = std::tan(m_camera->fov() * 0.5f);
-	const float aspect = m_camera->aspect();
+void t_renderer::trace_frames(size_t worker) {
+	const size_t thread = worker + 1;
 
 	while (!m_quit_tracing) {
+		const int64_t wait_tick = get_tick();
+
 		#if (USE_BARRIERS == 1)
 		m_barrier->wait();
 		#endif
 
-		const t_vector& cam_fwd_dir = m_camera->dir(CAM_FWD_DIR);
-		const t_vector& cam_rgt_dir = m_camera->dir(CAM_RGT_DIR);
-		const t_vector& cam_upw_dir = m_camera->dir(CAM_UPW_DIR);
-
-		for (size_t y = ymin; y < ymax; y++) {
-			const float yrel = (y * 1.0f / m_camera->get_view_size_y()) - 0.5f;
-			const t_vector pxl_up_dir = cam_upw_dir * (yrel / aspect);
+		const int64_t trace_tick = get_tick();
 
-			for (size_t x = xmin; x < xmax; x++) {
-				const float xrel = (x * 1.0f / m_camera->get_view_size_x()) - 0.5f;
+		// a worker idles here until the main thread starts the frame
+		m_timeline.add_span(thread, "barrier", wait_tick, trace_tick);
 
-				const t_vector pxl_rgt_dir = cam_rgt_dir * (xrel * fscale);
-				const t_vector pxl_ray_dir = (cam_fwd_dir + pxl_up_dir + pxl_rgt_dir).normalize_xyz();
+		trace_tile(worker);
 
-				m_camera->set_image_pixel(x, y, m_scene->trace_ray(t_ray(m_camera->pos(), pxl_ray_dir)));
-			}
-		}
+		const int64_t end_tick = get_tick();
 
 		#if (USE_BARRIERS == 1)
 		m_barrier->wait();
 		#endif
 
-		if (m_threads.empty()) {
-			break;
-		}
+		// and here until the slowest worker is done (the lockstep bubble)
+		m_timeline.add_span(thread, "barrier", end_tick, get_tick());
 	}
 }
 
-void t_renderer::trace_ray_columns(size_t xmin, size_t xmax, size_t ymin, size_t ymax) {
-	// a larger FOV means the rays will fan out wider, and moves
-	// our (virtual) image-plane closer to the camera's position
-	const float fscale = std::tan(m_camera->fov() * 0.5f);
-	const float aspect = m_camera->aspect();
+void t_renderer::trace_tile(size_t worker) {
+	const int64_t trace_tick = get_tick();
 
-	// inefficient in ST mode
-	std::vector<t_color> pxls(ymax - ymin);
-	std::vector<t_vector> dirs(ymax - ymin);
+	std::vector<t_image_chunk>& chunks = m_thread_states[worker].m_chunks;
+
+	for (size_t n = 0; n < chunks.size(); n++) {
+		t_image_chunk& chunk = chunks[n];
+
+		if (m_heatmap_metric >= 0) {
+			trace_ray_costs(chunk);
+		} else if (m_timeline_phases && m_timeline.enabled()) {
+			trace_ray_phases(worker, chunk);
+		} else if (m_trace_columns) {
+			trace_ray_columns(chunk);
+		} else {
+			trace_rays(chunk);
+		}
+
+		// publish it; the queue holds a whole frame, so this does not wait
+		while (!m_chunk_queue.push(&chunk)) {
+			boost::this_thread::yield();
+		}
+
+		// taking the lock orders the push before the main thread's last
+		// check of the queue, so the wake-up cannot be lost
+		{
+			boost::lock_guard<boost::mutex> lock(m_chunk_mutex);
+			m_chunk_cond.notify_one();
+		}
+	}
+
+	const int64_t end_tick = get_tick();
+
+	m_frame_stats.set_trace_time(worker, end_tick - trace_tick);
+	m_timeline.add_span(worker + 1, "tile", trace_tick, end_tick);
+}
 
-	while (!m_quit_tracing) {
-		#if (USE_BARRIERS == 1)
-		m_barrier->wait();
-		#endif
 
-		const t_vector& cam_fwd_dir = m_camera->dir(CAM_FWD_DIR);
-		const t_vector& cam_rgt_dir = m_camera->dir(CAM_RGT_DIR);
-		const t_vector& cam_upw_dir = m_camera->dir(CAM_UPW_DIR);
+void t_renderer::trace_rays(t_image_chunk& chunk) {
+	const size_t xmin = chunk.m_xmin, xmax = chunk.m_xmax;
+	const size_t ymin = chunk.m_ymin, ymax = chunk.m_ymax;
 
+	const float fscale = m_camera->get_fov_scale();
+	const float ray_spread = get_ray_spread();
+
+	for (size_t y = ymin; y < ymax; y++) {
 		for (size_t x = xmin; x < xmax; x++) {
-			const float xrel = (x * 1.0f / m_camera->get_view_size_x()) - 0.5f;
-			const t_vector pxl_rgt_dir = cam_rgt_dir * (xrel * fscale);
+			const t_vector pxl_ray_dir = m_camera->get_pixel_dir(x, y, fscale);
 
-			t_vector col_dir = cam_fwd_dir + pxl_rgt_dir;
+			chunk.set_pixel(x, y, m_camera->pack_color(m_scene->trace_ray(t_ray(m_camera->pos(), pxl_ray_dir, -1.0f, ray_spread))));
+		}
+	}
+}
 
-			col_dir.z() = 0.0f;
-			col_dir.normalize_xyz();
+void t_renderer::trace_ray_columns(t_image_chunk& chunk) {
+	const size_t xmin = chunk.m_xmin, xmax = chunk.m_xmax;
+	const size_t ymin = chunk.m_ymin, ymax = chunk.m_ymax;
 
-			// for each pixel in the column, set its image-plane direction
-			for (size_t y = ymin; y < ymax; y++) {
-				const float yrel = (y * 1.0f / m_camera->get_view_size_y()) - 0.5f;
+	// a larger FOV means the rays will fan out wider, and moves
+	// our (virtual) image-plane closer to the camera's position
+	const float fscale = m_camera->get_fov_scale();
 
-				const t_vector pxl_up_dir = cam_upw_dir * (yrel * fscale / aspect);
-				const t_vector pxl_ray_dir = (cam_fwd_dir + pxl_up_dir + pxl_rgt_dir).normalize_xyz();
+	std::vector<t_color> pxls(ymax - ymin);
+	std::vector<t_vector> dirs(ymax - ymin);
 
-				dirs[y - ymin] = pxl_ray_dir;
-			}
+	const t_vector& cam_fwd_dir = m_camera->dir(CAM_FWD_DIR);
+	const t_vector& cam_rgt_dir = m_camera->dir(CAM_RGT_DIR);
 
-			// trace the column of directions as one contiguous element
-			m_scene->trace_ray_column(t_ray_column(m_camera->pos(), &dirs[0], col_dir.x(), col_dir.y(), ymax - ymin), &pxls[0]);
+	const float ray_spread = get_ray_spread();
 
-			for (size_t y = ymin; y < ymax; y++) {
-				m_camera->set_image_pixel(x, y, pxls[y - ymin]);
-			}
+	for (size_t x = xmin; x < xmax; x++) {
+		const float xrel = (x * 1.0f / m_camera->get_view_size_x()) - 0.5f;
+		const t_vector pxl_rgt_dir = cam_rgt_dir * (xrel * fscale);
+
+		t_vector col_dir = cam_fwd_dir + pxl_rgt_dir;
+
+		col_dir.z() = 0.0f;
+		col_dir.normalize_xyz();
+
+		// for each pixel in the column, set its image-plane direction
+		for (size_t y = ymin; y < ymax; y++) {
+			dirs[y - ymin] = m_camera->get_pixel_dir(x, y, fscale);
 		}
 
-		#if (USE_BARRIERS == 1)
-		m_barrier->wait();
-		#endif
+		// trace the column of directions as one contiguous element
+		m_scene->trace_ray_column(t_ray_column(m_camera->pos(), &dirs[0], col_dir.x(), col_dir.y(), ymax - ymin, ray_spread), &pxls[0]);
 
-		if (m_threads.empty()) {
-			break;
+		for (size_t y = ymin; y < ymax; y++) {
+			chunk.set_pixel(x, y, m_camera->pack_color(pxls[y - ymin]));
 		}
 	}
 }
 
-void t_renderer::trace_ray_slope_columns(size_t xmin, size_t xmax, size_t ymin, size_t ymax) {
+void t_renderer::trace_ray_slope_columns(t_image_chunk& chunk) {
+	const size_t xmin = chunk.m_xmin, xmax = chunk.m_xmax;
+	const size_t ymin = chunk.m_ymin, ymax = chunk.m_ymax;
+
 	const float fscale = std::tan(m_camera->fov() * 0.5f);
 	const float aspect = m_camera->aspect();
 
 	std::vector<t_color> pixels(ymax - ymin);
 	std::vector<float> slopes(ymax - ymin);
 
-	while (!m_quit_tracing) {
-		#if (USE_BARRIERS == 1)
-		m_barrier->wait();
-		#endif
+	const t_vector& cam_fwd_dir = m_camera->dir(CAM_FWD_DIR);
+	const t_vector& cam_rgt_dir = m_camera->dir(CAM_RGT_DIR);
+	const t_vector& cam_upw_dir = m_camera->dir(CAM_UPW_DIR);
 
-		const t_vector& cam_fwd_dir = m_camera->dir(CAM_FWD_DIR);
-		const t_vector& cam_rgt_dir = m_camera->dir(CAM_RGT_DIR);
-		const t_vector& cam_upw_dir = m_camera->dir(CAM_UPW_DIR);
+	// for each pixel in the column, set its vertical slope
+	for (size_t y = ymin; y < ymax; y++) {
+		const float yrel = (y * 1.0f / m_camera->get_view_size_y()) - 0.5f;
 
-		// for each pixel in the column, set its vertical slope
-		for (size_t y = ymin; y < ymax; y++) {
-			const float yrel = (y * 1.0f / m_camera->get_view_size_y()) - 0.5f;
+		const t_vector pxl_up_dir = cam_upw_dir * (yrel * fscale / aspect);
+		const t_vector col_fwd_dir = cam_fwd_dir + pxl_up_dir;
+
+		slopes[y - ymin] = col_fwd_dir.get_slope();
+	}
 
-			const t_vector pxl_up_dir = cam_upw_dir * (yrel / aspect);
-			const t_vector col_fwd_dir = cam_fwd_dir + pxl_up_dir;
+	for (size_t x = xmin; x < xmax; x++) {
+		const float xrel = ((x * 1.0f + RAY_JITTER_RIGHT * (rnd_flt() - 0.5f)) / m_camera->get_view_size_x()) - 0.5f;
 
-			slopes[y - ymin] = col_fwd_dir.get_slope();
+		const t_vector pxl_rgt_dir = cam_rgt_dir * (xrel * fscale);
+		const t_vector pxl_col_dir = (cam_fwd_dir + pxl_rgt_dir).normalize_xy();
+
+		// trace the column of slopes as one contiguous element
+		// FIXME: vertical line in SS is not in general vertical in WS, needs multisampling
+		m_scene->trace_slope_ray_column(t_slope_ray_column(m_camera->pos(), pxl_col_dir.x(), pxl_col_dir.y(), &slopes[0], ymax - ymin), &pixels[0]);
+
+		for (size_t y = ymin; y < ymax; y++) {
+			chunk.set_pixel(x, y, m_camera->pack_color(pixels[y - ymin]));
 		}
+	}
+}
 
-		for (size_t x = xmin; x < xmax; x++) {
-			const float xrel = ((x * 1.0f + RAY_JITTER_RIGHT * (rnd_flt() - 0.5f)) / m_camera->get_view_size_x()) - 0.5f;
+void t_renderer::trace_ray_phases(size_t worker, t_image_chunk& chunk) {
+	const size_t xmin = chunk.m_xmin, xmax = chunk.m_xmax;
+	const size_t ymin = chunk.m_ymin, ymax = chunk.m_ymax;
 
-			const t_vector pxl_rgt_dir = cam_rgt_dir * (xrel * fscale);
-			const t_vector pxl_col_dir = (cam_fwd_dir + pxl_rgt_dir).normalize_xy();
+	const float fscale = m_camera->get_fov_scale();
 
-			// trace the column of slopes as one contiguous element
-			// FIXME: vertical line in SS is not in general vertical in WS, needs multisampling
-			m_scene->trace_slope_ray_column(t_slope_ray_column(m_camera->pos(), pxl_col_dir.x(), pxl_col_dir.y(), &slopes[0], ymax - ymin), &pixels[0]);
+	const size_t num_cols = xmax - xmin;
+	const size_t thread = worker + 1;
 
-			for (size_t y = ymin; y < ymax; y++) {
-				m_camera->set_image_pixel(x, y, pixels[y - ymin]);
-			}
+	const size_t num_lights = m_scene->num_light_sources();
+
+	std::vector<t_ray_intersection> hits(num_cols * (ymax - ymin));
+	std::vector<uint8_t> masks(hits.size() * num_lights);
+
+	const int64_t trace_tick = get_tick();
+
+	const float ray_spread = get_ray_spread();
+
+	for (size_t y = ymin; y < ymax; y++) {
+		for (size_t x = xmin; x < xmax; x++) {
+			const t_vector pxl_ray_dir = m_camera->get_pixel_dir(x, y, fscale);
+
+			hits[(y - ymin) * num_cols + (x - xmin)] = m_scene->intersect_ray(t_ray(m_camera->pos(), pxl_ray_dir, -1.0f, ray_spread));
 		}
+	}
 
-		#if (USE_BARRIERS == 1)
-		m_barrier->wait();
-		#endif
+	const int64_t shadow_tick = get_tick();
+
+	for (size_t i = 0; i < hits.size(); i++) {
+		m_scene->trace_light_mask(hits[i], masks.data() + i * num_lights, hits[i].time() * ray_spread);
+	}
+
+	const int64_t shade_tick = get_tick();
 
-		if (m_threads.empty()) {
-			break;
+	for (size_t y = ymin; y < ymax; y++) {
+		for (size_t x = xmin; x < xmax; x++) {
+			const size_t i = (y - ymin) * num_cols + (x - xmin);
+
+			chunk.set_pixel(x, y, m_camera->pack_color(m_scene->shade_masked_hit(hits[i], masks.data() + i * num_lights)));
 		}
 	}
+
+	const int64_t end_tick = get_tick();
+
+	m_timeline.add_span(thread, "primary", trace_tick, shadow_tick);
+	m_timeline.add_span(thread, "shadow", shadow_tick, shade_tick);
+	m_timeline.add_span(thread, "shade", shade_tick, end_tick);
 }
 
+void t_renderer::trace_ray_costs(const t_image_chunk& chunk) {
+	const size_t xmin = chunk.m_xmin, xmax = chunk.m_xmax;
+	const size_t ymin = chunk.m_ymin, ymax = chunk.m_ymax;
+
+	const float fscale = m_camera->get_fov_scale();
+	const float ray_spread = get_ray_spread();
+
+	for (size_t y = ymin; y < ymax; y++) {
+		for (size_t x = xmin; x < xmax; x++) {
+			const t_vector pxl_ray_dir = m_camera->get_pixel_dir(x, y, fscale);
+
+			m_cost_map.trace_pixel(*m_scene, x, y, t_ray(m_camera->pos(), pxl_ray_dir, -1.0f, ray_spread));
+		}
+	}
+}
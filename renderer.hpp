@@ -1,13 +1,27 @@
 #pragma once
 
+#include <string>
 #include <vector>
 #include <boost/thread.hpp>
 
+#include "cost_map.hpp"
+#include "frame_stats.hpp"
+#include "mpsc_queue.hpp"
+#include "timeline.hpp"
 #include "scene.hpp"
 #include "tri_cell.hpp"
 #include "vector.hpp"
 #include "camera.hpp"
 
+enum {
+	SCENETYPE_LINEAR   = 0,
+	SCENETYPE_QUADTREE = 1,
+	SCENETYPE_KDTREE   = 2,
+	SCENETYPE_TILED_KDTREE = 3,
+	SCENETYPE_BVH4     = 4,
+	SCENETYPE_CONE_STEP = 5,
+};
+
 class t_renderer {
 public:
 	t_renderer();
@@ -15,6 +29,11 @@ public:
 
 	const t_camera* get_camera() const { return m_camera; }
 
+	// layout of the image-tiles (one per thread) traced in lockstep
+	static void get_thread_grid(size_t num_threads, size_t& num_threads_x, size_t& num_threads_y);
+	// returns a new (empty) scene of type SCENETYPE_*, or null
+	static t_scene* create_scene(size_t scene_type);
+
 	void spawn_threads();
 	void read_config(const char* filename);
 
@@ -33,14 +52,49 @@ public:
 	#endif
 
 private:
-	void trace_rays(size_t xmin, size_t xmax, size_t ymin, size_t ymax);
-	void trace_ray_columns(size_t xmin, size_t xmax, size_t ymin, size_t ymax);
-	void trace_ray_slope_columns(size_t xmin, size_t xmax, size_t ymin, size_t ymax);
+	// a thread's tile of the image and its private pixels, traced and
+	// handed to the main thread in chunks
+	struct t_thread_state {
+	public:
+		void set_tile(size_t xmin, size_t xmax, size_t ymin, size_t ymax, size_t chunk_size, int layout);
+
+	public:
+		size_t m_xmin, m_xmax;
+		size_t m_ymin, m_ymax;
+
+		std::vector<uint32_t> m_buffer;
+		std::vector<t_image_chunk> m_chunks;
+	};
+
+	// worker-thread loop, traces the thread's tile of every frame in
+	// lockstep with display()
+	void trace_frames(size_t worker);
+	// traces one frame of thread <worker>'s tile in the current mode, one
+	// chunk at a time, and queues each chunk once it is done
+	void trace_tile(size_t worker);
+
+	// these trace the pixels of <chunk>
+	void trace_rays(t_image_chunk& chunk);
+	void trace_ray_columns(t_image_chunk& chunk);
+	void trace_ray_slope_columns(t_image_chunk& chunk);
+	// traces per pixel in separate primary, shadow and shading passes, each
+	// recorded on the timeline; a different workload from the tracers above
+	// (rows of single rays, and lit shading even for scenes that are unlit
+	// otherwise), so only used if asked for by m_timeline_phases
+	void trace_ray_phases(size_t worker, t_image_chunk& chunk);
+	// traces per pixel into the cost-map instead of the image
+	void trace_ray_costs(const t_image_chunk& chunk);
+
+	// ray-cone spread for level-of-detail traversal, zero if disabled
+	float get_ray_spread() const;
 
 	int64_t m_epoch_tick;
 	int64_t m_frame_tick;
+	// end of the previous frame
+	int64_t m_frame_end_tick;
 
 	size_t m_thread_count;
+	size_t m_build_thread_count;
 	size_t m_frame_count;
 	size_t m_scene_type;
 
@@ -62,6 +116,61 @@ private:
 
 	volatile bool m_quit_tracing;
 	bool m_trace_columns;
+	// back the scene arena by (transparent) huge pages
+	bool m_huge_pages;
+
+	// level-of-detail tolerance in pixels, subtrees narrower than
+	// this many pixels are shaded as planes (0 = exact tracing)
+	float m_lod_error;
+
+	// store 16-bit heights instead of cells (kd-tree, BVH4 and cone-step scenes)
+	bool m_compact_heights;
+	// SPLIT_MODE_* for kd-tree scenes
+	int m_split_mode;
+	// t_sample_layout::LAYOUT_* of the heightmap (kd-tree, BVH4 and cone-step scenes)
+	int m_map_layout;
+	// cells per side of a tree-leaf (kd-tree and BVH4 scenes)
+	size_t m_leaf_size;
+	// height error of merged planar leaves (kd-tree scenes, 0 = none)
+	float m_planar_error;
+	// TRAVERSAL_MODE_* for kd-tree scenes
+	int m_traversal_mode;
+
+	// directory for persistent scene caches, disabled if empty
+	std::string m_scene_cache_dir;
+
+	// phase-times of the recent frames
+	t_frame_stats m_frame_stats;
+
+	// per-thread spans of the first <m_timeline_frames> frames, written as
+	// a Chrome trace to <m_timeline_file> on exit (disabled if empty)
+	t_timeline m_timeline;
+	std::string m_timeline_file;
+	size_t m_timeline_frames;
+	// trace with trace_ray_phases while recording, instead of the tracer
+	// of the current mode
+	bool m_timeline_phases;
+
+	// per-pixel costs of the frame, drawn instead of the image while
+	// m_heatmap_metric (t_cost_map::COST_METRIC_*) is not negative
+	t_cost_map m_cost_map;
+	int m_heatmap_metric;
+
+	// columns per image-chunk
+	size_t m_chunk_size;
+	// t_sample_layout::LAYOUT_* of each chunk's pixels
+	int m_image_layout;
+	// over all threads
+	size_t m_num_chunks;
+
+	// index 0 is traced by the main thread if there are no workers
+	std::vector<t_thread_state> m_thread_states;
+	// finished chunks, to be copied into the image by the main thread; it
+	// sleeps on m_chunk_cond (signalled after every push) when the queue
+	// stays empty for longer than a few yields
+	t_mpsc_queue<const t_image_chunk*> m_chunk_queue;
+	boost::mutex m_chunk_mutex;
+	boost::condition_variable m_chunk_cond;
 
 	// worker threads
 	std::vector<boost::thread*> m_threads;
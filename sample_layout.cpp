@@ -0,0 +1,80 @@
+#include <cstring>
+
+#include "sample_layout.hpp"
+
+static const char* LAYOUT_NAMES[t_sample_layout::LAYOUT_COUNT] = {
+	"linear",
+	"blocked",
+	"morton",
+};
+
+// spreads the bits of <n> apart, one zero between each
+static size_t spread_bits(size_t n) {
+	size_t bits = 0;
+
+	for (size_t b = 0; (n >> b) != 0; b++) {
+		bits |= (((n >> b) & 1) << (b * 2));
+	}
+
+	return bits;
+}
+
+static size_t round_up(size_t n, size_t m) {
+	return (((n + m - 1) / m) * m);
+}
+
+
+
+int t_sample_layout::parse_type(const char* name) {
+	for (int type = 0; type < LAYOUT_COUNT; type++) {
+		if (strcmp(name, LAYOUT_NAMES[type]) == 0) {
+			return type;
+		}
+	}
+
+	return -1;
+}
+
+const char* t_sample_layout::get_type_name(int type) {
+	if (type < 0 || type >= LAYOUT_COUNT)
+		return "unknown";
+
+	return LAYOUT_NAMES[type];
+}
+
+size_t t_sample_layout::get_num_samples(size_t xsize, size_t ysize, int type, size_t block_size) {
+	if (type == LAYOUT_LINEAR)
+		return (xsize * ysize);
+
+	return (round_up(xsize, block_size) * round_up(ysize, block_size));
+}
+
+
+void t_sample_layout::reset(size_t xsize, size_t ysize, int type, size_t block_size) {
+	m_type = type;
+	m_xsize = xsize;
+	m_block_size = (type == LAYOUT_LINEAR)? 1: block_size;
+
+	m_padded_xsize = round_up(xsize, m_block_size);
+	m_padded_ysize = round_up(ysize, m_block_size);
+
+	m_xoffsets.clear();
+	m_yoffsets.clear();
+
+	if (type == LAYOUT_LINEAR)
+		return;
+
+	const size_t b = m_block_size;
+
+	m_xoffsets.resize(m_padded_xsize);
+	m_yoffsets.resize(m_padded_ysize);
+
+	// blocks are b * b samples, a row of them is b * padded_xsize
+	for (size_t x = 0; x < m_padded_xsize; x++) {
+		m_xoffsets[x] = (x / b) * b * b + ((type == LAYOUT_MORTON)? spread_bits(x % b): (x % b));
+	}
+
+	for (size_t y = 0; y < m_padded_ysize; y++) {
+		m_yoffsets[y] = (y / b) * b * m_padded_xsize + ((type == LAYOUT_MORTON)? (spread_bits(y % b) << 1): ((y % b) * b));
+	}
+}
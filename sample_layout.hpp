@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// maps the coordinates of a 2D array of samples to their index in memory:
+// row-major (LAYOUT_LINEAR), or as square blocks of <block_size> samples a
+// side stored one after another (block-rows first), row-major within each
+// block (LAYOUT_BLOCKED) or in Z-order (LAYOUT_MORTON)
+//
+// blocks keep 2D neighbourhoods on a few cache-lines and pages, at the cost
+// of padding the array to whole blocks; their index is the sum of a column-
+// and a row-offset looked up in tables, rather than a multiply
+//
+class t_sample_layout {
+public:
+	enum {
+		LAYOUT_LINEAR  = 0,
+		LAYOUT_BLOCKED = 1,
+		LAYOUT_MORTON  = 2,
+		LAYOUT_COUNT   = 3,
+	};
+
+	t_sample_layout() { reset(0, 0, LAYOUT_LINEAR, 1); }
+
+	// returns LAYOUT_* for <name>, or -1
+	static int parse_type(const char* name);
+	static const char* get_type_name(int type);
+
+	// number of samples (including the padding) of an array laid out as
+	// reset(xsize, ysize, type, block_size) would
+	static size_t get_num_samples(size_t xsize, size_t ysize, int type, size_t block_size);
+
+	// <block_size> must be a power of two; linear layouts ignore it
+	void reset(size_t xsize, size_t ysize, int type, size_t block_size);
+
+	size_t get_index(size_t x, size_t y) const {
+		if (m_type == LAYOUT_LINEAR)
+			return (y * m_xsize + x);
+
+		return (m_xoffsets[x] + m_yoffsets[y]);
+	}
+
+	int type() const { return m_type; }
+	size_t block_size() const { return m_block_size; }
+
+	// size of the array, rounded up to whole blocks
+	size_t padded_xsize() const { return m_padded_xsize; }
+	size_t padded_ysize() const { return m_padded_ysize; }
+	size_t num_samples() const { return (m_padded_xsize * m_padded_ysize); }
+
+	// copies <xsize> x <ysize> samples from <src> (laid out by <src_layout>)
+	// to <dst> (by <dst_layout>); its padding repeats the last column and row
+	template<typename t_sample>
+	static void copy_samples(t_sample* dst, const t_sample_layout& dst_layout, const t_sample* src, const t_sample_layout& src_layout, size_t xsize, size_t ysize) {
+		for (size_t y = 0; y < dst_layout.padded_ysize(); y++) {
+			for (size_t x = 0; x < dst_layout.padded_xsize(); x++) {
+				dst[dst_layout.get_index(x, y)] = src[src_layout.get_index(std::min(x, xsize - 1), std::min(y, ysize - 1))];
+			}
+		}
+	}
+
+private:
+	int m_type;
+
+	size_t m_xsize;
+	size_t m_block_size;
+	size_t m_padded_xsize;
+	size_t m_padded_ysize;
+
+	std::vector<size_t> m_xoffsets;
+	std::vector<size_t> m_yoffsets;
+};
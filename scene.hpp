@@ -1,6 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
 #include "common.hpp"
+#include "arena.hpp"
+#include "cell.hpp"
 #include "color.hpp"
 #include "heightmap.hpp"
 #include "light.hpp"
@@ -9,6 +15,35 @@
 #include "ray_intersection.hpp"
 #include "slope_ray_column.hpp"
 
+// how tree builders choose their split planes
+enum {
+	SPLIT_MODE_EVEN = 0, // halve the region (along its longer side)
+	SPLIT_MODE_COST = 1, // minimize t_heightmap::get_opt_split_*, slower to build
+};
+
+// how tree traversals keep track of the subtrees they still have to visit
+enum {
+	TRAVERSAL_MODE_RECURSIVE = 0, // on the call-stack, one call per node
+	TRAVERSAL_MODE_STACK     = 1, // in a loop over a small fixed stack of far children
+};
+
+// shape of a built acceleration structure
+struct t_scene_stats {
+public:
+	t_scene_stats() {
+		m_num_nodes = 0;
+		m_num_leaves = 0;
+	}
+
+public:
+	// inner nodes plus leaves
+	size_t m_num_nodes;
+	size_t m_num_leaves;
+
+	// number of leaves at each depth (the root is at depth 0)
+	std::vector<size_t> m_leaf_depths;
+};
+
 // represents a heightmap with imposed subdivision structure
 // (e.g. a linear grid or a kd-tree) to accelerate raytracing
 //
@@ -16,26 +51,47 @@
 //
 class t_scene {
 public:
-	virtual ~t_scene() {}
+	t_scene() {
+		m_num_build_threads = 1;
+		m_compact_heights = false;
+		m_split_mode = SPLIT_MODE_EVEN;
+		m_heightmap_layout = t_sample_layout::LAYOUT_LINEAR;
+		m_leaf_size = 1;
+		m_planar_error = 0.0f;
+		m_traversal_mode = TRAVERSAL_MODE_STACK;
+	}
+	virtual ~t_scene() {
+		// scene owns its lights; acceleration structures are freed with the arena
+		for (size_t n = 0; n < m_light_sources.size(); n++) {
+			delete m_light_sources[n];
+		}
+	}
 
-	// assign a heightmap to this scene
+	// assign a heightmap to this scene (releases any previously built structure)
 	virtual void assign_heightmap(const t_heightmap&) = 0;
 
 
-	// assign a user-controlled light
-	virtual void assign_light_source(t_light*) {}
+	// assign a user-controlled light; the scene takes ownership
+	virtual void assign_light_source(t_light* light) { m_light_sources.push_back(light); }
 
 	// modify the user light
-	virtual void modify_light_source(size_t, float, float) {}
+	virtual void modify_light_source(size_t idx, float yaw, float pitch) {
+		if (idx < m_light_sources.size()) {
+			m_light_sources[idx]->rotate(yaw, pitch);
+		}
+	}
 
 
 	// traces a ray into the scene, returns the color
 	virtual t_color trace_ray(t_const_ray) const = 0;
 
+	// traces a ray into the scene, returns the nearest intersection
+	virtual t_ray_intersection intersect_ray(t_const_ray) const = 0;
+
 	// traces a ray-column into the scene
 	virtual void trace_ray_column(const t_ray_column& ray_column, t_color* results) const {
 		for (int i = 0; i < ray_column.num_rays(); i++) {
-			results[i] = trace_ray(t_ray(ray_column.pos(), ray_column.dirs()[i]));
+			results[i] = trace_ray(t_ray(ray_column.pos(), ray_column.dirs()[i], -1.0f, ray_column.spread()));
 		}
 	}
 
@@ -48,5 +104,187 @@ public:
 
 	// traces a shadow ray; returns true iff there is a collision
 	virtual bool trace_shadow_ray(t_const_ray) const = 0;
+
+	// as intersect_ray and trace_shadow_ray, also adding the nodes and cells
+	// they visit to <counters>; scenes that do not count leave them as-is
+	virtual t_ray_intersection intersect_counted_ray(t_const_ray ray, t_trace_counters& /*counters*/) const { return (intersect_ray(ray)); }
+	virtual bool trace_counted_shadow_ray(t_const_ray ray, t_trace_counters& /*counters*/) const { return (trace_shadow_ray(ray)); }
+
+
+	// hash of every setting that affects the built structure
+	virtual uint64_t get_build_key() const { return 0; }
+
+	// describes the built structure; scenes without one leave <stats> empty
+	virtual void get_stats(t_scene_stats& /*stats*/) const {}
+	// bytes of the scene's own copy of the heightmap, which is not part of
+	// the arena; 0 if the scene keeps none resident
+	virtual size_t num_heightmap_bytes() const { return 0; }
+
+	// (re)stores the built structure from/to a persistent cache-file keyed
+	// by <key>; return false if the scene does not support this or the file
+	// is missing, stale or unwritable
+	virtual bool supports_cache() const { return false; }
+	virtual bool read_cache(const char* /*file_name*/, uint64_t /*key*/) { return false; }
+	virtual bool write_cache(const char* /*file_name*/, uint64_t /*key*/) const { return false; }
+
+
+	const t_arena& get_arena() const { return m_arena; }
+	      t_arena& get_arena()       { return m_arena; }
+
+	// number of threads assign_heightmap may use to build the scene
+	void set_num_build_threads(size_t num_threads) { m_num_build_threads = std::max(num_threads, size_t(1)); }
+	// store 16-bit heights and rebuild cells while tracing, where supported
+	// (kd-trees, BVHs, cone-step maps)
+	void set_compact_heights(bool compact_heights) { m_compact_heights = compact_heights; }
+	// SPLIT_MODE_*, where supported (kd-trees)
+	void set_split_mode(int split_mode) { m_split_mode = split_mode; }
+	// t_sample_layout::LAYOUT_* of the scene's copy of the heightmap, where
+	// supported (kd-trees, BVHs, cone-step maps); the copy is reordered
+	// before the structure is built over it, not afterwards
+	void set_heightmap_layout(int layout) { m_heightmap_layout = layout; }
+	// maximum width and height in cells of a tree's leaves, where supported
+	// (kd-trees, BVHs)
+	void set_leaf_size(size_t leaf_size) { m_leaf_size = std::max(leaf_size, size_t(1)); }
+	// height error within which regions of the map are merged into single
+	// planar leaves, where supported (kd-trees); 0 disables merging
+	void set_planar_error(float planar_error) { m_planar_error = std::max(planar_error, 0.0f); }
+	// TRAVERSAL_MODE_*, where supported (kd-trees); takes effect immediately
+	void set_traversal_mode(int traversal_mode) { m_traversal_mode = traversal_mode; }
+
+protected:
+	// traversals only pass slim hits around, this expands the nearest one
+	// for <ray> (both in the frame of <heightmap>) once it is final
+	template<class t_cell_type>
+	static t_ray_intersection get_intersection(const t_heightmap& heightmap, t_const_ray ray, const t_ray_hit& hit) {
+		if (!hit.valid())
+			return (t_ray_intersection());
+
+		if (hit.is_plane()) {
+			const t_vector pos = ray.point(hit.time());
+			const t_vector gn = t_vector(-hit.u(), -hit.v(), 1.0f).normalize_xyz();
+
+			return (t_ray_intersection(pos, gn, t_cell_type::shading_normal(heightmap, pos), hit.time()));
+		}
+
+		return (t_cell_type::get_intersection(heightmap, ray, hit));
+	}
+
+	// shades a hit by every light source, tracing secondary shadow rays
+	// that start <bias> units toward the light (to step off approximated
+	// level-of-detail surfaces, whose error is at most that large)
+	t_color shade_lit_hit(const t_ray_intersection& hit, float bias = 0.0f) const {
+		// the mask lives on the stack unless there are unusually many lights
+		uint8_t stack_mask[MAX_STACK_LIGHTS];
+		std::vector<uint8_t> heap_mask;
+
+		uint8_t* light_mask = stack_mask;
+
+		if (m_light_sources.size() > MAX_STACK_LIGHTS) {
+			heap_mask.resize(m_light_sources.size());
+			light_mask = &heap_mask[0];
+		}
+
+		trace_light_mask(hit, light_mask, bias);
+		return (shade_masked_hit(hit, light_mask));
+	}
+
+public:
+	size_t num_light_sources() const { return m_light_sources.size(); }
+
+	// the two passes of shade_lit_hit, for callers that time them apart; the
+	// mask holds one flag per light source (num_light_sources() entries),
+	// set iff that light reaches a valid <hit>, and may be null if only the
+	// work matters, which is added to <counters> if not null
+	void trace_light_mask(const t_ray_intersection& hit, uint8_t* light_mask, float bias = 0.0f, t_trace_counters* counters = 0) const {
+		if (!hit.valid())
+			return;
+
+		for (size_t n = 0; n < m_light_sources.size(); n++) {
+			bool lit = false;
+
+			const t_vector light_dir = m_light_sources[n]->get_direction(hit.pos());
+			const t_vector shadow_pos = hit.pos() + light_dir * bias;
+
+			// calculate the strength of diffuse local illumination via dot(N, L)
+			const float obliquity_g = hit.gn() * light_dir;
+			const float obliquity_s = hit.sn() * light_dir;
+
+			if (obliquity_s > 0.0f) {
+				if (obliquity_g > 0.0f) {
+					lit = !is_shadow_ray_blocked(t_ray(shadow_pos, light_dir), counters);
+				} else {
+					// back-facing w.r.t. the geometric normal, start past our own cell
+					lit = !(intersect_shadow_ray(t_ray(shadow_pos + light_dir, light_dir), counters)).valid();
+				}
+			}
+
+			if (light_mask != 0)
+				light_mask[n] = lit;
+		}
+	}
+
+	t_color shade_masked_hit(const t_ray_intersection& hit, const uint8_t* light_mask) const {
+		t_color result;
+
+		if (hit.valid()) {
+			// convert the normal to a diffuse RGB color (TODO: read in a diffuse albedo texture)
+			const t_color albedo = t_color((0.5f * hit.sn().x() + 0.5f), (0.5f * hit.sn().y() + 0.5f), (0.5f * hit.sn().z() + 0.5f));
+
+			// we only trace shadow secondary rays, so fake global illumination
+			result += (albedo * 0.25f);
+
+			for (size_t n = 0; n < m_light_sources.size(); n++) {
+				if (light_mask[n] == 0)
+					continue;
+
+				const t_vector light_dir = m_light_sources[n]->get_direction(hit.pos());
+				const float obliquity_s = hit.sn() * light_dir;
+
+				result += (m_light_sources[n]->get_color() * albedo * obliquity_s);
+			}
+		}
+
+		return result;
+	}
+
+protected:
+	// trace a shadow ray through the counted traversals if <counters> is
+	// not null (adding the work to it), else through the plain ones
+	bool is_shadow_ray_blocked(t_const_ray ray, t_trace_counters* counters) const {
+		if (counters == 0)
+			return (trace_shadow_ray(ray));
+
+		counters->m_num_shadow_rays += 1;
+		return (trace_counted_shadow_ray(ray, *counters));
+	}
+	t_ray_intersection intersect_shadow_ray(t_const_ray ray, t_trace_counters* counters) const {
+		if (counters == 0)
+			return (intersect_ray(ray));
+
+		counters->m_num_shadow_rays += 1;
+		return (intersect_counted_ray(ray, *counters));
+	}
+
+protected:
+	// lights whose shade_lit_hit mask fits on the stack
+	static const size_t MAX_STACK_LIGHTS = 16;
+
+	// backing storage for all nodes and cells
+	t_arena m_arena;
+
+	size_t m_num_build_threads;
+
+	bool m_compact_heights;
+
+	int m_split_mode;
+	int m_heightmap_layout;
+
+	size_t m_leaf_size;
+
+	float m_planar_error;
+
+	int m_traversal_mode;
+
+	std::vector<t_light*> m_light_sources;
 };
 
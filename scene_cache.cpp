@@ -0,0 +1,196 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scene_cache.hpp"
+
+// bump on every change to the file layout or to any cached structure,
+// including the numbering of a scene's params and sections and the bits
+// of its nodes; build parameters are covered by the scene's build-key
+//
+// 2: reordered params and sections, block and planar kd-tree leaves
+static const uint32_t CACHE_FILE_VERSION = 2;
+static const uint64_t CACHE_SECTION_ALIGN = 4096;
+
+static const char CACHE_FILE_MAGIC[8] = {'P', 'R', 'A', 'Y', 'S', 'C', 'N', '\0'};
+
+struct t_cache_header {
+public:
+	char m_magic[8];
+
+	uint32_t m_version;
+	uint32_t m_num_sections;
+
+	uint64_t m_key;
+	uint64_t m_file_size;
+
+	uint64_t m_params[t_scene_cache::MAX_PARAMS];
+	uint64_t m_section_offsets[t_scene_cache::MAX_SECTIONS];
+	uint64_t m_section_sizes[t_scene_cache::MAX_SECTIONS];
+};
+
+
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+	for (size_t n = 0; n < size; n++) {
+		hash ^= bytes[n];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+uint64_t hash_file(const char* name, uint64_t hash) {
+	FILE* file = fopen(name, "rb");
+
+	if (file == 0)
+		return hash;
+
+	std::vector<uint8_t> buffer(1 << 20);
+
+	for (size_t num_bytes = 0; (num_bytes = fread(&buffer[0], 1, buffer.size(), file)) != 0; ) {
+		hash = hash_bytes(&buffer[0], num_bytes, hash);
+	}
+
+	fclose(file);
+	return hash;
+}
+
+
+
+bool t_scene_cache::write(const char* file_name, uint64_t key, const uint64_t* params, size_t num_params, const t_section* sections, size_t num_sections) {
+	if (num_params > MAX_PARAMS || num_sections > MAX_SECTIONS)
+		return false;
+
+	t_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.m_magic, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC));
+
+	header.m_version = CACHE_FILE_VERSION;
+	header.m_num_sections = num_sections;
+	header.m_key = key;
+
+	uint64_t offset = CACHE_SECTION_ALIGN;
+
+	for (size_t n = 0; n < num_params; n++) {
+		header.m_params[n] = params[n];
+	}
+	for (size_t n = 0; n < num_sections; n++) {
+		header.m_section_offsets[n] = offset;
+		header.m_section_sizes[n] = sections[n].m_size;
+
+		offset += ((sections[n].m_size + CACHE_SECTION_ALIGN - 1) / CACHE_SECTION_ALIGN) * CACHE_SECTION_ALIGN;
+	}
+
+	header.m_file_size = offset;
+
+	// write to a private temporary first, concurrent builders race harmlessly on the rename
+	const std::string temp_name = std::string(file_name) + ".tmp." + std::to_string(getpid());
+
+	FILE* file = fopen(temp_name.c_str(), "wb");
+
+	if (file == 0) {
+		printf("[%s] failed to create %s\n", __FUNCTION__, temp_name.c_str());
+		return false;
+	}
+
+	bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+	for (size_t n = 0; n < num_sections && ok; n++) {
+		ok = ok && (fseek(file, header.m_section_offsets[n], SEEK_SET) == 0);
+		ok = ok && (fwrite(sections[n].m_data, 1, sections[n].m_size, file) == sections[n].m_size);
+	}
+
+	// pad the last section so the file-size matches the header
+	ok = ok && (fflush(file) == 0);
+	ok = ok && (ftruncate(fileno(file), header.m_file_size) == 0);
+	ok = (fclose(file) == 0) && ok;
+	ok = ok && (rename(temp_name.c_str(), file_name) == 0);
+
+	if (!ok) {
+		printf("[%s] failed to write %s\n", __FUNCTION__, file_name);
+		unlink(temp_name.c_str());
+	}
+
+	return ok;
+}
+
+
+bool t_scene_cache::open(const char* file_name, uint64_t key) {
+	close();
+
+	const int fd = ::open(file_name, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	struct stat file_stat;
+
+	if (fstat(fd, &file_stat) != 0 || size_t(file_stat.st_size) < sizeof(t_cache_header)) {
+		::close(fd);
+		return false;
+	}
+
+	void* mapping = mmap(0, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	// the mapping stays valid without the descriptor
+	::close(fd);
+
+	if (mapping == MAP_FAILED)
+		return false;
+
+	const t_cache_header* header = reinterpret_cast<const t_cache_header*>(mapping);
+
+	bool valid = true;
+
+	valid = valid && (memcmp(header->m_magic, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC)) == 0);
+	valid = valid && (header->m_version == CACHE_FILE_VERSION);
+	valid = valid && (header->m_key == key);
+	valid = valid && (header->m_file_size == uint64_t(file_stat.st_size));
+	valid = valid && (header->m_num_sections <= MAX_SECTIONS);
+
+	for (size_t n = 0; n < MAX_SECTIONS && valid; n++) {
+		valid = valid && (header->m_section_offsets[n] + header->m_section_sizes[n] <= header->m_file_size);
+	}
+
+	if (!valid) {
+		munmap(mapping, file_stat.st_size);
+		return false;
+	}
+
+	m_mapping = mapping;
+	m_mapping_size = file_stat.st_size;
+	return true;
+}
+
+void t_scene_cache::close() {
+	if (m_mapping != 0)
+		munmap(m_mapping, m_mapping_size);
+
+	m_mapping = 0;
+	m_mapping_size = 0;
+}
+
+
+uint64_t t_scene_cache::get_param(size_t idx) const {
+	const t_cache_header* header = reinterpret_cast<const t_cache_header*>(m_mapping);
+	return (header->m_params[idx]);
+}
+
+t_scene_cache::t_section t_scene_cache::get_section(size_t idx) const {
+	const t_cache_header* header = reinterpret_cast<const t_cache_header*>(m_mapping);
+	const uint8_t* base = reinterpret_cast<const uint8_t*>(m_mapping);
+
+	if (idx >= header->m_num_sections)
+		return (t_section());
+
+	return (t_section(base + header->m_section_offsets[idx], header->m_section_sizes[idx]));
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit FNV-1a, used to key cache files
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull);
+// hashes a file's contents; returns <hash> unchanged if it can not be read
+uint64_t hash_file(const char* name, uint64_t hash = 14695981039346656037ull);
+
+template<typename t_type> uint64_t hash_value(const t_type& value, uint64_t hash) { return (hash_bytes(&value, sizeof(value), hash)); }
+
+
+
+// versioned binary file holding a built scene as a list of page-aligned
+// sections (e.g. flattened nodes, cells and heightmap samples) plus a few
+// scene-defined parameters; written once after a build and mapped read-only
+// on later runs so that processes on the same host share its pages
+//
+class t_scene_cache {
+public:
+	enum {
+		MAX_PARAMS   = 16,
+		MAX_SECTIONS =  8,
+	};
+
+	struct t_section {
+	public:
+		t_section(const void* data = 0, size_t size = 0) {
+			m_data = data;
+			m_size = size;
+		}
+
+		const void* m_data;
+		size_t m_size;
+	};
+
+public:
+	t_scene_cache() { m_mapping = 0; m_mapping_size = 0; }
+	t_scene_cache(const t_scene_cache&) = delete;
+	~t_scene_cache() { close(); }
+
+	t_scene_cache& operator = (const t_scene_cache&) = delete;
+
+	// writes atomically (temporary file + rename) so readers never see partial data
+	static bool write(const char* file_name, uint64_t key, const uint64_t* params, size_t num_params, const t_section* sections, size_t num_sections);
+
+	// maps <file_name> if it exists, is of the current version and matches <key>
+	bool open(const char* file_name, uint64_t key);
+	void close();
+
+	bool is_open() const { return (m_mapping != 0); }
+
+	uint64_t get_param(size_t idx) const;
+	t_section get_section(size_t idx) const;
+
+private:
+	void* m_mapping;
+	size_t m_mapping_size;
+};
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "terrain_generator.hpp"
+#include "heightmap.hpp"
+#include "parallel.hpp"
+#include "scene_cache.hpp"
+
+// pseudo-random value in [-1, 1] at a lattice point, a stateless integer
+// hash so rows can be evaluated in any order (and vectorized)
+static inline float lattice_value(int32_t x, int32_t y, uint32_t seed) {
+	uint32_t h = uint32_t(x) * 0x8da6b343u + uint32_t(y) * 0xd8163841u + seed * 0xcb1ab31fu;
+
+	h = (h ^ (h >> 16)) * 0x7feb352du;
+	h = (h ^ (h >> 15)) * 0x846ca68bu;
+	h = (h ^ (h >> 16));
+
+	return (int32_t(h) * (1.0f / 2147483648.0f));
+}
+
+// quintic-interpolated value noise at <p> and its partial derivatives
+static inline float value_noise(float px, float py, uint32_t seed, float& dndx, float& dndy) {
+	// floor without a library call (coordinates can be negative)
+	const int32_t ix = int32_t(px) - (px < float(int32_t(px)));
+	const int32_t iy = int32_t(py) - (py < float(int32_t(py)));
+
+	const float rx = px - ix;
+	const float ry = py - iy;
+
+	const float ux = rx * rx * rx * (rx * (rx * 6.0f - 15.0f) + 10.0f);
+	const float uy = ry * ry * ry * (ry * (ry * 6.0f - 15.0f) + 10.0f);
+	const float dux = 30.0f * rx * rx * (rx * (rx - 2.0f) + 1.0f);
+	const float duy = 30.0f * ry * ry * (ry * (ry - 2.0f) + 1.0f);
+
+	const float a = lattice_value(ix,     iy,     seed);
+	const float b = lattice_value(ix + 1, iy,     seed);
+	const float c = lattice_value(ix,     iy + 1, seed);
+	const float d = lattice_value(ix + 1, iy + 1, seed);
+
+	const float k1 = b - a;
+	const float k2 = c - a;
+	const float k3 = a - b - c + d;
+
+	dndx = dux * (k1 + k3 * uy);
+	dndy = duy * (k2 + k3 * ux);
+
+	return (a + k1 * ux + k2 * uy + k3 * ux * uy);
+}
+
+
+
+void t_terrain_generator::generate(t_heightmap& heightmap, size_t xsize, size_t ysize, float scale, size_t num_threads) const {
+	float* heights = new float[xsize * ysize];
+
+	std::vector<float> row_min_heights(ysize);
+	std::vector<float> row_max_heights(ysize);
+
+	for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+		std::vector<float> weights(xsize);
+		std::vector<float> dzdx(xsize);
+		std::vector<float> dzdy(xsize);
+
+		for (size_t y = ymin; y < ymax; y++) {
+			float* row = heights + y * xsize;
+
+			generate_row(row, &weights[0], &dzdx[0], &dzdy[0], xsize, y);
+
+			row_min_heights[y] = *std::min_element(row, row + xsize);
+			row_max_heights[y] = *std::max_element(row, row + xsize);
+		}
+	});
+
+	const float min_height = *std::min_element(row_min_heights.begin(), row_min_heights.end());
+	const float max_height = *std::max_element(row_max_heights.begin(), row_max_heights.end());
+	const float norm_scale = scale / std::max(max_height - min_height, 1e-6f);
+
+	for_each_band(ysize, num_threads, [&](size_t ymin, size_t ymax) {
+		for (size_t n = ymin * xsize; n < ymax * xsize; n++) {
+			heights[n] = (heights[n] - min_height) * norm_scale;
+		}
+	});
+
+	heightmap.adopt_data(heights, xsize, ysize);
+}
+
+void t_terrain_generator::generate_row(float* heights, float* weights, float* dzdx, float* dzdy, size_t xsize, size_t y) const {
+	for (size_t x = 0; x < xsize; x++) {
+		heights[x] = 0.0f;
+		weights[x] = 1.0f;
+		dzdx[x] = 0.0f;
+		dzdy[x] = 0.0f;
+	}
+
+	// octave o samples the map at (M^o / feature_size) * (x, y), where M doubles
+	// the frequency and rotates by ~37 degrees to hide the lattice directions
+	double m00 = 1.0 / m_feature_size, m01 = 0.0;
+	double m10 = 0.0, m11 = 1.0 / m_feature_size;
+
+	float amplitude = 0.5f;
+
+	for (size_t octave = 0; octave < m_num_octaves; octave++) {
+		const float x0 = m01 * y, dx = m00;
+		const float y0 = m11 * y, dy = m10;
+
+		const uint32_t seed = m_seed + octave;
+
+		switch (m_type) {
+			case TERRAIN_TYPE_RIDGED: {
+				for (size_t x = 0; x < xsize; x++) {
+					float dndx, dndy;
+					float r = 1.0f - std::fabs(value_noise(x0 + x * dx, y0 + x * dy, seed, dndx, dndy));
+
+					// creases get sharper where the previous octaves had them
+					r *= r;
+					r *= weights[x];
+
+					weights[x] = std::min(1.0f, r * 2.0f);
+					heights[x] += (r * amplitude);
+				}
+			} break;
+
+			case TERRAIN_TYPE_ERODED: {
+				for (size_t x = 0; x < xsize; x++) {
+					float dndx, dndy;
+					const float n = value_noise(x0 + x * dx, y0 + x * dy, seed, dndx, dndy);
+
+					// finer octaves are suppressed on steep slopes
+					dzdx[x] += dndx;
+					dzdy[x] += dndy;
+					heights[x] += (n * amplitude / (1.0f + dzdx[x] * dzdx[x] + dzdy[x] * dzdy[x]));
+				}
+			} break;
+
+			default: {
+				for (size_t x = 0; x < xsize; x++) {
+					float dndx, dndy;
+					heights[x] += (value_noise(x0 + x * dx, y0 + x * dy, seed, dndx, dndy) * amplitude);
+				}
+			} break;
+		}
+
+		// M = 2 * [0.8 -0.6; 0.6 0.8]
+		const double n00 = 1.6 * m00 - 1.2 * m10, n01 = 1.6 * m01 - 1.2 * m11;
+		const double n10 = 1.2 * m00 + 1.6 * m10, n11 = 1.2 * m01 + 1.6 * m11;
+
+		m00 = n00; m01 = n01;
+		m10 = n10; m11 = n11;
+
+		amplitude *= 0.5f;
+	}
+}
+
+
+uint64_t t_terrain_generator::get_hash(uint64_t hash) const {
+	hash = hash_value(m_seed, hash);
+	hash = hash_value(m_type, hash);
+	hash = hash_value(m_num_octaves, hash);
+	hash = hash_value(m_feature_size, hash);
+	return hash;
+}
+
+int t_terrain_generator::parse_type(const char* name) {
+	if (strcmp(name, "fbm") == 0)
+		return TERRAIN_TYPE_FBM;
+	if (strcmp(name, "ridged") == 0)
+		return TERRAIN_TYPE_RIDGED;
+	if (strcmp(name, "eroded") == 0)
+		return TERRAIN_TYPE_ERODED;
+
+	return -1;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class t_heightmap;
+
+// fills heightmaps of any size with multi-octave value-noise terrain, so
+// scenes can be benchmarked on maps far larger than the shipped image;
+// the result depends only on the settings (seed, type, ...) and never on
+// the number of threads
+//
+class t_terrain_generator {
+public:
+	enum {
+		TERRAIN_TYPE_FBM    = 0, // plain fractal sum, rolling hills
+		TERRAIN_TYPE_RIDGED = 1, // ridged multifractal, sharp crests
+		TERRAIN_TYPE_ERODED = 2, // octaves damped by the accumulated slope, eroded valleys
+	};
+
+	t_terrain_generator(uint32_t seed = 1, int type = TERRAIN_TYPE_FBM) {
+		m_seed = seed;
+		m_type = type;
+		m_num_octaves = 10;
+		m_feature_size = 512.0f;
+	}
+
+	// writes <xsize> x <ysize> samples normalized to [0, scale]
+	void generate(t_heightmap& heightmap, size_t xsize, size_t ysize, float scale, size_t num_threads = 1) const;
+
+	void set_seed(uint32_t seed) { m_seed = seed; }
+	void set_type(int type) { m_type = type; }
+	void set_num_octaves(size_t num_octaves) { m_num_octaves = num_octaves; }
+	// wavelength of the first octave, in samples
+	void set_feature_size(float feature_size) { m_feature_size = feature_size; }
+
+	// hash of all settings, e.g. to key scene-caches
+	uint64_t get_hash(uint64_t hash) const;
+
+	// "fbm", "ridged" or "eroded"; returns -1 for anything else
+	static int parse_type(const char* name);
+
+private:
+	// evaluates row <y> of the map into <heights> (unnormalized)
+	void generate_row(float* heights, float* weights, float* dzdx, float* dzdy, size_t xsize, size_t y) const;
+
+private:
+	uint32_t m_seed;
+	int m_type;
+
+	size_t m_num_octaves;
+	float m_feature_size;
+};
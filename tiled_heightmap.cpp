@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tiled_heightmap.hpp"
+
+// bump on every change to the file layout
+static const uint32_t TILE_FILE_VERSION = 2;
+
+static const char TILE_FILE_MAGIC[8] = {'P', 'R', 'A', 'Y', 'T', 'I', 'L', '\0'};
+
+struct t_tile_file_header {
+public:
+	char m_magic[8];
+
+	uint32_t m_version;
+	uint32_t m_tile_size;
+
+	uint32_t m_xsize;
+	uint32_t m_ysize;
+
+	uint32_t m_num_tiles_x;
+	uint32_t m_num_tiles_y;
+
+	// bytes per sample, 2 (quantized) or 4 (float)
+	uint32_t m_sample_size;
+	uint32_t m_padding;
+};
+
+
+
+// writes the tiles one row of tiles at a time, each from the band of map
+// rows it covers (incl. aprons), which read_band(ymin, ymax, band) stores
+// as rows 0 to (ymax - ymin - 1) of <band>; the table of tiles is written
+// last, once the height ranges are known
+template<typename t_read_band>
+static bool write_tile_rows(const char* file_name, size_t xsize, size_t ysize, size_t tile_size, bool quantized, const t_read_band& read_band) {
+	typedef t_tiled_heightmap::t_tile_info t_tile_info;
+
+	if (xsize < 2 || ysize < 2 || tile_size == 0)
+		return false;
+
+	const size_t num_cells_x = xsize - 1;
+	const size_t num_cells_y = ysize - 1;
+
+	t_tile_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.m_magic, TILE_FILE_MAGIC, sizeof(TILE_FILE_MAGIC));
+
+	header.m_version = TILE_FILE_VERSION;
+	header.m_tile_size = tile_size;
+	header.m_xsize = xsize;
+	header.m_ysize = ysize;
+	header.m_num_tiles_x = (num_cells_x + tile_size - 1) / tile_size;
+	header.m_num_tiles_y = (num_cells_y + tile_size - 1) / tile_size;
+	header.m_sample_size = quantized? sizeof(uint16_t): sizeof(float);
+
+	std::vector<t_tile_info> tiles(header.m_num_tiles_x * header.m_num_tiles_y);
+
+	uint64_t offset = sizeof(header) + tiles.size() * sizeof(t_tile_info);
+
+	for (size_t ty = 0; ty < header.m_num_tiles_y; ty++) {
+		for (size_t tx = 0; tx < header.m_num_tiles_x; tx++) {
+			t_tile_info& tile = tiles[ty * header.m_num_tiles_x + tx];
+
+			const size_t xmin = tx * tile_size, xmax = std::min(xmin + tile_size, num_cells_x);
+			const size_t ymin = ty * tile_size, ymax = std::min(ymin + tile_size, num_cells_y);
+
+			// cells read one sample past their far corner for normals
+			const size_t apron_x0 = (xmin > 0), apron_x1 = (xmax < num_cells_x);
+			const size_t apron_y0 = (ymin > 0), apron_y1 = (ymax < num_cells_y);
+
+			tile.m_offset = offset;
+			tile.m_xorg = xmin - apron_x0;
+			tile.m_yorg = ymin - apron_y0;
+			tile.m_xsize = (xmax + apron_x1) - tile.m_xorg + 1;
+			tile.m_ysize = (ymax + apron_y1) - tile.m_yorg + 1;
+			tile.m_cell_xmin = apron_x0;
+			tile.m_cell_ymin = apron_y0;
+			tile.m_cell_xsize = xmax - xmin;
+			tile.m_cell_ysize = ymax - ymin;
+			tile.m_min_height =  FLT_MAX;
+			tile.m_max_height = -FLT_MAX;
+			tile.m_qscale = 0.0f;
+			tile.m_qoffset = 0.0f;
+
+			offset += (tile.m_xsize * tile.m_ysize * header.m_sample_size);
+		}
+	}
+
+	// same protocol as the scene-cache, readers never see partial data
+	const std::string temp_name = std::string(file_name) + ".tmp." + std::to_string(getpid());
+
+	FILE* file = fopen(temp_name.c_str(), "wb");
+
+	if (file == 0) {
+		printf("[%s] failed to create %s\n", __FUNCTION__, temp_name.c_str());
+		return false;
+	}
+
+	bool ok = true;
+
+	// the table is a placeholder until all tiles are written
+	ok = ok && (fwrite(&header, sizeof(header), 1, file) == 1);
+	ok = ok && (fwrite(&tiles[0], sizeof(t_tile_info), tiles.size(), file) == tiles.size());
+
+	t_heightmap band;
+
+	std::vector<float> row;
+	std::vector<uint16_t> qrow;
+
+	for (size_t ty = 0; ty < header.m_num_tiles_y && ok; ty++) {
+		t_tile_info* tile_row = &tiles[ty * header.m_num_tiles_x];
+
+		// all tiles of a row store the same rows of samples
+		const size_t band_ymin = tile_row[0].m_yorg;
+		const size_t band_ymax = tile_row[0].m_yorg + tile_row[0].m_ysize;
+
+		if (!(ok = read_band(band_ymin, band_ymax, band)))
+			break;
+
+		for (size_t tx = 0; tx < header.m_num_tiles_x && ok; tx++) {
+			t_tile_info& tile = tile_row[tx];
+
+			const size_t xmin = tile.m_xorg + tile.m_cell_xmin, xmax = xmin + tile.m_cell_xsize;
+			const size_t ymin = tile.m_cell_ymin, ymax = ymin + tile.m_cell_ysize;
+
+			for (size_t y = ymin; y <= ymax; y++) {
+				for (size_t x = xmin; x <= xmax; x++) {
+					tile.m_min_height = std::min(tile.m_min_height, band.at(x, y));
+					tile.m_max_height = std::max(tile.m_max_height, band.at(x, y));
+				}
+			}
+
+			if (quantized) {
+				// the range has to include the aprons
+				float min_height =  FLT_MAX;
+				float max_height = -FLT_MAX;
+
+				for (size_t y = 0; y < tile.m_ysize; y++) {
+					for (size_t x = 0; x < tile.m_xsize; x++) {
+						min_height = std::min(min_height, band.at(tile.m_xorg + x, y));
+						max_height = std::max(max_height, band.at(tile.m_xorg + x, y));
+					}
+				}
+
+				tile.m_qscale = std::max(max_height - min_height, FLT_MIN) / 65535.0f;
+				tile.m_qoffset = min_height;
+
+				// rounding moves samples by up to half a step
+				tile.m_min_height -= tile.m_qscale;
+				tile.m_max_height += tile.m_qscale;
+			}
+
+			row.resize(tile.m_xsize);
+			qrow.resize(tile.m_xsize);
+
+			for (size_t y = 0; y < tile.m_ysize && ok; y++) {
+				for (size_t x = 0; x < tile.m_xsize; x++) {
+					row[x] = band.at(tile.m_xorg + x, y);
+				}
+
+				if (!quantized) {
+					ok = ok && (fwrite(&row[0], sizeof(float), tile.m_xsize, file) == tile.m_xsize);
+					continue;
+				}
+
+				for (size_t x = 0; x < tile.m_xsize; x++) {
+					qrow[x] = std::min(65535.0f, (row[x] - tile.m_qoffset) / tile.m_qscale + 0.5f);
+				}
+
+				ok = ok && (fwrite(&qrow[0], sizeof(uint16_t), tile.m_xsize, file) == tile.m_xsize);
+			}
+		}
+	}
+
+	ok = ok && (fseek(file, sizeof(header), SEEK_SET) == 0);
+	ok = ok && (fwrite(&tiles[0], sizeof(t_tile_info), tiles.size(), file) == tiles.size());
+
+	ok = (fclose(file) == 0) && ok;
+	ok = ok && (rename(temp_name.c_str(), file_name) == 0);
+
+	if (!ok) {
+		printf("[%s] failed to write %s\n", __FUNCTION__, file_name);
+		unlink(temp_name.c_str());
+	}
+
+	return ok;
+}
+
+
+bool t_tiled_heightmap::write(const char* file_name, const t_heightmap& heightmap, size_t tile_size, bool quantized) {
+	return (write_tile_rows(file_name, heightmap.width(), heightmap.height(), tile_size, quantized, [&](size_t ymin, size_t ymax, t_heightmap& band) {
+		float* samples = new float[heightmap.width() * (ymax - ymin)];
+
+		for (size_t y = ymin; y < ymax; y++) {
+			for (size_t x = 0; x < heightmap.width(); x++) {
+				samples[(y - ymin) * heightmap.width() + x] = heightmap.at(x, y);
+			}
+		}
+
+		band.adopt_data(samples, heightmap.width(), ymax - ymin);
+		return true;
+	}));
+}
+
+bool t_tiled_heightmap::write(const char* file_name, const char* map_name, float scale, size_t tile_size, bool quantized, size_t num_threads) {
+	t_heightmap_reader reader;
+
+	// prints the reason if it fails
+	if (!reader.open(map_name, scale))
+		return false;
+
+	return (write_tile_rows(file_name, reader.width(), reader.height(), tile_size, quantized, [&](size_t ymin, size_t ymax, t_heightmap& band) {
+		return (reader.read_rows(band, ymin, ymax, num_threads));
+	}));
+}
+
+
+bool t_tiled_heightmap::open(const char* file_name) {
+	close();
+
+	const int fd = ::open(file_name, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	t_tile_file_header header;
+
+	bool valid = true;
+
+	valid = valid && (pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)));
+	valid = valid && (memcmp(header.m_magic, TILE_FILE_MAGIC, sizeof(TILE_FILE_MAGIC)) == 0);
+	valid = valid && (header.m_version == TILE_FILE_VERSION);
+	valid = valid && (header.m_xsize > 1 && header.m_ysize > 1 && header.m_tile_size > 0);
+	valid = valid && (header.m_sample_size == sizeof(uint16_t) || header.m_sample_size == sizeof(float));
+	valid = valid && (header.m_num_tiles_x == ((header.m_xsize - 1 + header.m_tile_size - 1) / header.m_tile_size));
+	valid = valid && (header.m_num_tiles_y == ((header.m_ysize - 1 + header.m_tile_size - 1) / header.m_tile_size));
+
+	if (!valid) {
+		::close(fd);
+		return false;
+	}
+
+	m_tiles.resize(header.m_num_tiles_x * header.m_num_tiles_y);
+
+	const ssize_t table_size = m_tiles.size() * sizeof(t_tile_info);
+
+	if (pread(fd, &m_tiles[0], table_size, sizeof(header)) != table_size) {
+		m_tiles.clear();
+		::close(fd);
+		return false;
+	}
+
+	m_fd = fd;
+	m_xsize = header.m_xsize;
+	m_ysize = header.m_ysize;
+	m_tile_size = header.m_tile_size;
+	m_num_tiles_x = header.m_num_tiles_x;
+	m_num_tiles_y = header.m_num_tiles_y;
+	m_quantized = (header.m_sample_size == sizeof(uint16_t));
+	return true;
+}
+
+void t_tiled_heightmap::close() {
+	if (m_fd >= 0)
+		::close(m_fd);
+
+	m_tiles.clear();
+
+	m_fd = -1;
+	m_xsize = 0;
+	m_ysize = 0;
+	m_tile_size = 0;
+	m_num_tiles_x = 0;
+	m_num_tiles_y = 0;
+	m_quantized = false;
+}
+
+
+bool t_tiled_heightmap::read_tile(size_t idx, t_heightmap& heightmap) const {
+	const t_tile_info& tile = m_tiles[idx];
+	const size_t num_samples = tile.m_xsize * tile.m_ysize;
+
+	// pread does not move a shared file position, so workers need no lock
+	if (m_quantized) {
+		uint16_t* samples = new uint16_t[num_samples];
+		const ssize_t num_bytes = num_samples * sizeof(uint16_t);
+
+		if (pread(m_fd, samples, num_bytes, tile.m_offset) != num_bytes) {
+			delete[] samples;
+			return false;
+		}
+
+		heightmap.adopt_quantized_data(samples, tile.m_xsize, tile.m_ysize, tile.m_qscale, tile.m_qoffset);
+		return true;
+	}
+
+	float* samples = new float[num_samples];
+	const ssize_t num_bytes = num_samples * sizeof(float);
+
+	if (pread(m_fd, samples, num_bytes, tile.m_offset) != num_bytes) {
+		delete[] samples;
+		return false;
+	}
+
+	heightmap.adopt_data(samples, tile.m_xsize, tile.m_ysize);
+	return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "heightmap.hpp"
+
+// on-disk heightmap split into square tiles of cells that are read on demand,
+// so maps need not fit in memory; only the per-tile header (bounds and height
+// range, which doubles as a coarse culling structure) stays resident
+//
+// every tile also stores an apron of one sample on each side that has a
+// neighbour, so cells built from a single tile get the same shading normals
+// as when built from the full map
+//
+class t_tiled_heightmap {
+public:
+	struct t_tile_info {
+	public:
+		// file offset of the samples
+		uint64_t m_offset;
+
+		// first stored sample and the number of stored samples (incl. aprons)
+		uint32_t m_xorg, m_yorg;
+		uint32_t m_xsize, m_ysize;
+
+		// cells covered by the tile, relative to (m_xorg, m_yorg)
+		uint32_t m_cell_xmin, m_cell_ymin;
+		uint32_t m_cell_xsize, m_cell_ysize;
+
+		// height range over the covered cells
+		float m_min_height;
+		float m_max_height;
+
+		// dequantization parameters of 16-bit samples (unused for float ones)
+		float m_qscale;
+		float m_qoffset;
+	};
+
+public:
+	t_tiled_heightmap() { m_fd = -1; m_xsize = 0; m_ysize = 0; m_tile_size = 0; m_num_tiles_x = 0; m_num_tiles_y = 0; m_quantized = false; }
+	t_tiled_heightmap(const t_tiled_heightmap&) = delete;
+	~t_tiled_heightmap() { close(); }
+
+	t_tiled_heightmap& operator = (const t_tiled_heightmap&) = delete;
+
+	// converts <heightmap> to a tile-file with <tile_size> x <tile_size> cells per tile;
+	// <quantized> stores 16-bit samples over the height range of each tile instead of
+	// floats, so tiles load as quantized heightmaps
+	static bool write(const char* file_name, const t_heightmap& heightmap, size_t tile_size, bool quantized = false);
+	// as above for the map in <map_name> (any file t_heightmap::load reads),
+	// which is read a band of rows at a time (see t_heightmap_reader), so
+	// float samples are only held for one row of tiles
+	static bool write(const char* file_name, const char* map_name, float scale, size_t tile_size, bool quantized = false, size_t num_threads = 1);
+
+	bool open(const char* file_name);
+	void close();
+
+	bool is_open() const { return (m_fd >= 0); }
+
+	// reads the samples of a tile into <heightmap>; safe to call concurrently
+	bool read_tile(size_t idx, t_heightmap& heightmap) const;
+
+	const t_tile_info& get_tile(size_t idx) const { return m_tiles[idx]; }
+	const t_tile_info& get_tile(size_t x, size_t y) const { return m_tiles[y * m_num_tiles_x + x]; }
+
+	// size in samples, as for t_heightmap
+	size_t width() const { return m_xsize; }
+	size_t height() const { return m_ysize; }
+
+	size_t tile_size() const { return m_tile_size; }
+	size_t num_tiles_x() const { return m_num_tiles_x; }
+	size_t num_tiles_y() const { return m_num_tiles_y; }
+	size_t num_tiles() const { return m_tiles.size(); }
+
+	bool is_quantized() const { return m_quantized; }
+
+private:
+	std::vector<t_tile_info> m_tiles;
+
+	int m_fd;
+
+	size_t m_xsize;
+	size_t m_ysize;
+
+	size_t m_tile_size;
+	size_t m_num_tiles_x;
+	size_t m_num_tiles_y;
+
+	bool m_quantized;
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "kdtree_cell_scene.hpp"
+#include "lru_cache.hpp"
+#include "tiled_heightmap.hpp"
+
+// out-of-core variant of the kd-tree scene: the map lives in a tile-file
+// and every tile gets its own small kd-tree, built when a ray first reaches
+// the tile and kept in a bounded LRU cache; rays walk the tile-grid front
+// to back and skip tiles whose (always resident) height range they pass over
+//
+template <class t_cell_type>
+class t_tiled_kdtree_cell_scene: public t_scene {
+public:
+	static_assert(t_cell_interface<t_cell_type>::value, "not a cell-type");
+
+	typedef t_kdtree_cell_scene_node<t_cell_type> t_node;
+
+	t_tiled_kdtree_cell_scene() {
+		m_xmax = 0;
+		m_ymax = 0;
+		m_tile_size = 256;
+
+		m_tile_cache.set_max_bytes(size_t(256) << 20);
+	}
+
+	// converts <heightmap> to an anonymous tile-file; only useful for maps
+	// that fit in memory, larger ones should be passed to open_tiles
+	void assign_heightmap(const t_heightmap& heightmap) {
+		std::string file_name = std::string(P_tmpdir) + "/prayground.tiles.XXXXXX";
+
+		const int fd = mkstemp(&file_name[0]);
+
+		if (fd < 0) {
+			printf("[%s] failed to create a tile-file in %s\n", __FUNCTION__, P_tmpdir);
+			return;
+		}
+
+		::close(fd);
+
+		if (t_tiled_heightmap::write(file_name.c_str(), heightmap, m_tile_size, m_compact_heights)) {
+			open_tiles(file_name.c_str());
+		}
+
+		// the open descriptor keeps the data around
+		unlink(file_name.c_str());
+	}
+
+	bool open_tiles(const char* file_name) {
+		m_tile_cache.clear();
+
+		if (!m_tiles.open(file_name))
+			return false;
+
+		m_xmax = m_tiles.width() - 1;
+		m_ymax = m_tiles.height() - 1;
+		return true;
+	}
+
+	void set_tile_size(size_t tile_size) { m_tile_size = std::max(tile_size, size_t(1)); }
+	void set_tile_cache_size(size_t num_bytes) { m_tile_cache.set_max_bytes(num_bytes); }
+
+	const t_tiled_heightmap& get_tiles() const { return m_tiles; }
+
+
+	t_color trace_ray(t_const_ray ray) const {
+		const t_ray_intersection hit = intersect_ray(ray);
+		return (shade_lit_hit(hit, hit.time() * ray.spread()));
+	}
+
+	t_ray_intersection intersect_ray(t_const_ray ray) const {
+		t_ray_intersection result;
+
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!m_tiles.is_open())
+			return result;
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return result;
+
+		walk_tiles(ray, tmin, tmax, [&](size_t idx, float t0, float t1) {
+			const float z0 = ray.pos().z() + t0 * ray.dir().z();
+			const float z1 = ray.pos().z() + t1 * ray.dir().z();
+			const float zmin = std::min(z0, z1);
+
+			if (zmin > m_tiles.get_tile(idx).m_max_height)
+				return false;
+
+			const t_tile_ptr tile = get_tile(idx);
+
+			if (tile == nullptr)
+				return false;
+
+			const t_ray tile_ray(ray.pos() - tile->m_origin, ray.dir(), ray.tmax(), ray.spread());
+			const t_ray_hit hit = (tile->m_cells != 0)?
+				tile->m_nodes->traverse_ray(m_traversal_mode, tile->get_cells(), tile->m_lods, tile_ray, t0, t1, zmin):
+				tile->m_nodes->traverse_ray(m_traversal_mode, t_heightmap_cells<t_cell_type>(&tile->m_heightmap), tile->m_lods, tile_ray, t0, t1, zmin);
+
+			if (!hit.valid())
+				return false;
+
+			const t_ray_intersection tile_hit = get_intersection<t_cell_type>(tile->m_heightmap, tile_ray, hit);
+
+			result = t_ray_intersection(tile_hit.pos() + tile->m_origin, tile_hit.gn(), tile_hit.sn(), tile_hit.time());
+			return true;
+		});
+
+		return result;
+	}
+
+	bool trace_shadow_ray(t_const_ray ray) const {
+		float tmin = 0.0f;
+		float tmax = 0.0f;
+
+		if (!m_tiles.is_open())
+			return false;
+		if (!ray.time_in_rect(tmin, tmax, 0, m_xmax, 0, m_ymax))
+			return false;
+
+		return (walk_tiles(ray, tmin, tmax, [&](size_t idx, float t0, float t1) {
+			float zmin = ray.pos().z() + t0 * ray.dir().z();
+			float zmax = ray.pos().z() + t1 * ray.dir().z();
+
+			if (zmin > zmax)
+				std::swap(zmin, zmax);
+
+			// same early-outs as the root of a tile-tree, without paging it in
+			if (zmin > (m_tiles.get_tile(idx).m_max_height - RAY_TEST_EPSILON))
+				return false;
+			if (zmax < (m_tiles.get_tile(idx).m_min_height + RAY_TEST_EPSILON))
+				return true;
+
+			const t_tile_ptr tile = get_tile(idx);
+
+			if (tile == nullptr)
+				return false;
+
+			const t_ray tile_ray(ray.pos() - tile->m_origin, ray.dir(), ray.tmax());
+
+			if (tile->m_cells == 0)
+				return (tile->m_nodes->traverse_shadow_ray(m_traversal_mode, t_heightmap_cells<t_cell_type>(&tile->m_heightmap), tile->m_lods, tile_ray, t0, t1, zmin, zmax));
+
+			return (tile->m_nodes->traverse_shadow_ray(m_traversal_mode, tile->get_cells(), tile->m_lods, tile_ray, t0, t1, zmin, zmax));
+		}));
+	}
+
+private:
+	// kd-tree over the cells of one tile, in tile-local coordinates
+	struct t_tile {
+	public:
+		t_tile(size_t num_bytes, bool huge_pages): m_arena(num_bytes, huge_pages) {
+			m_nodes = 0;
+			m_lods = 0;
+			m_cells = 0;
+		}
+
+		size_t num_bytes() const { return (m_arena.num_bytes_reserved() + m_heightmap.num_bytes()); }
+
+		t_cell_grid<t_cell_type> get_cells() const { return (t_cell_grid<t_cell_type>(m_cells, m_heightmap.width() - 1)); }
+
+		t_arena m_arena;
+
+		// samples incl. aprons, for expanding hits (and the cells
+		// if those are not stored, i.e. for quantized tiles)
+		t_heightmap m_heightmap;
+
+		const t_node* m_nodes;
+		const t_kdtree_cell_scene_lod* m_lods;
+		const t_cell_type* m_cells;
+
+		// map-space position of the first stored sample
+		t_vector m_origin;
+	};
+
+	typedef typename t_lru_cache<t_tile>::t_value_ptr t_tile_ptr;
+
+	t_tile_ptr get_tile(size_t idx) const {
+		return (m_tile_cache.get(idx, [this](size_t key) { return (load_tile(key)); }));
+	}
+
+	t_tile_ptr load_tile(size_t idx) const {
+		const t_tiled_heightmap::t_tile_info& info = m_tiles.get_tile(idx);
+
+		const size_t cells_xsize = info.m_xsize - 1;
+		const size_t cells_ysize = info.m_ysize - 1;
+		const size_t rect[4] = {0, info.m_cell_xsize, 0, info.m_cell_ysize};
+		const size_t num_nodes = t_node::num_subtree_nodes(rect, m_leaf_size);
+
+		// quantized tiles rebuild their cells from the samples while tracing
+		const bool compact = m_tiles.is_quantized();
+
+		// the tile gets a single block that fits its cells, nodes and lods (exactly
+		// unless leaves cover several cells, the arena grows if the tree does not)
+		const size_t num_cell_bytes = compact? 0: (cells_xsize * cells_ysize * sizeof(t_cell_type));
+		const size_t num_bytes = num_cell_bytes + num_nodes * (sizeof(t_node) + sizeof(t_kdtree_cell_scene_lod)) + 3 * 64;
+
+		std::shared_ptr<t_tile> tile(new t_tile(num_bytes, m_arena.use_huge_pages()));
+		std::vector<t_node> nodes;
+
+		const t_heightmap& heightmap = tile->m_heightmap;
+
+		if (!m_tiles.read_tile(idx, tile->m_heightmap))
+			return nullptr;
+
+		nodes.reserve(num_nodes);
+
+		if (m_split_mode == SPLIT_MODE_COST)
+			tile->m_heightmap.build_range_index();
+
+		// aprons only feed the normals, cells outside the tile stay unset
+		t_cell_type* cells = compact? 0: tile->m_arena.template create_array<t_cell_type>(cells_xsize * cells_ysize);
+
+		t_node::create_from_heightmap(
+			nodes, cells, cells_xsize, heightmap,
+			info.m_cell_xmin, info.m_cell_xmin + info.m_cell_xsize,
+			info.m_cell_ymin, info.m_cell_ymin + info.m_cell_ysize,
+			m_split_mode, m_leaf_size, m_planar_error
+		);
+
+		tile->m_heightmap.clear_range_index();
+
+		t_node* flat_nodes = tile->m_arena.template create_array<t_node>(nodes.size());
+		std::copy(nodes.begin(), nodes.end(), flat_nodes);
+
+		t_kdtree_cell_scene_lod* lods = tile->m_arena.template create_array<t_kdtree_cell_scene_lod>(nodes.size());
+		t_kdtree_cell_scene_lod::create_from_nodes(lods, flat_nodes, nodes.size(), cells_xsize, heightmap);
+
+		tile->m_nodes = flat_nodes;
+		tile->m_lods = lods;
+		tile->m_cells = cells;
+		tile->m_origin = t_vector(info.m_xorg, info.m_yorg, 0.0f);
+		return tile;
+	}
+
+	// calls func(tile_index, t0, t1) for every tile overlapped by the
+	// ray-segment [tmin, tmax] in front-to-back order (2D-DDA) until it
+	// returns true; returns whether it did
+	template<typename t_func>
+	bool walk_tiles(t_const_ray ray, float tmin, float tmax, const t_func& func) const {
+		const float tile_size = m_tiles.tile_size();
+		const t_vector start = ray.point(tmin);
+
+		const int num_tiles_x = m_tiles.num_tiles_x();
+		const int num_tiles_y = m_tiles.num_tiles_y();
+
+		int tx = std::max(0, std::min(num_tiles_x - 1, int(start.x() / tile_size)));
+		int ty = std::max(0, std::min(num_tiles_y - 1, int(start.y() / tile_size)));
+
+		const int step_x = (ray.dir().x() > 0.0f)? 1: -1;
+		const int step_y = (ray.dir().y() > 0.0f)? 1: -1;
+
+		for (float t0 = tmin; t0 <= tmax; ) {
+			const float t_next_x = (ray.dir().x() != 0.0f)? ray.time_to_x((tx + (step_x > 0)) * tile_size): FLT_MAX;
+			const float t_next_y = (ray.dir().y() != 0.0f)? ray.time_to_y((ty + (step_y > 0)) * tile_size): FLT_MAX;
+			const float t1 = std::min(tmax, std::min(t_next_x, t_next_y));
+
+			if (func(ty * num_tiles_x + tx, t0, t1))
+				return true;
+
+			if (t_next_x < t_next_y) {
+				tx += step_x;
+				t0 = t_next_x;
+			} else {
+				ty += step_y;
+				t0 = t_next_y;
+			}
+
+			if (tx < 0 || tx >= num_tiles_x)
+				break;
+			if (ty < 0 || ty >= num_tiles_y)
+				break;
+		}
+
+		return false;
+	}
+
+private:
+	// bounds of the map, in cells
+	size_t m_xmax;
+	size_t m_ymax;
+
+	// cells per tile side for assign_heightmap
+	size_t m_tile_size;
+
+	t_tiled_heightmap m_tiles;
+
+	// filled in lazily by the (const) tracing threads
+	mutable t_lru_cache<t_tile> m_tile_cache;
+};
@@ -0,0 +1,54 @@
+#include <cstdio>
+
+#include "timeline.hpp"
+
+void t_timeline::reset(size_t num_threads, size_t max_spans) {
+	m_max_spans = max_spans;
+	m_threads.clear();
+	m_threads.resize(num_threads);
+
+	for (size_t n = 0; n < num_threads; n++) {
+		m_threads[n].m_spans.reserve(max_spans);
+	}
+}
+
+bool t_timeline::write(const char* file_name, int64_t epoch) const {
+	FILE* file = fopen(file_name, "w");
+
+	if (file == 0) {
+		printf("[%s] failed to create %s\n", __FUNCTION__, file_name);
+		return false;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	const char* sep = "";
+
+	for (size_t n = 0; n < m_threads.size(); n++) {
+		const t_thread& thread = m_threads[n];
+
+		if (!thread.m_name.empty()) {
+			fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lu, \"args\": {\"name\": \"%s\"}}", sep, n, thread.m_name.c_str());
+			sep = ",\n";
+		}
+
+		// complete events, in us
+		for (size_t i = 0; i < thread.m_spans.size(); i++) {
+			const t_span& span = thread.m_spans[i];
+
+			fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f}", sep, span.m_name, n, (span.m_begin - epoch) * 1e-3, (span.m_end - span.m_begin) * 1e-3);
+			sep = ",\n";
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+
+	const bool ok = (ferror(file) == 0);
+
+	if ((fclose(file) != 0) || !ok) {
+		printf("[%s] failed to write %s\n", __FUNCTION__, file_name);
+		return false;
+	}
+
+	return true;
+}
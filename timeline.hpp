@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// records named time-spans per thread and writes them as a Chrome trace
+// (JSON, loadable in chrome://tracing and Perfetto) for viewing frames on a
+// per-thread timeline
+//
+// every thread appends to its own span-buffer, which is preallocated and
+// stops recording when full, so recording takes no locks; the buffers may
+// only be written out once the recording threads are parked or joined
+//
+class t_timeline {
+public:
+	t_timeline() { m_max_spans = 0; }
+
+	// disables the timeline if <max_spans> (per thread) is 0
+	void reset(size_t num_threads, size_t max_spans);
+
+	bool enabled() const { return (m_max_spans != 0); }
+
+	void set_thread_name(size_t thread, const std::string& name) { m_threads[thread].m_name = name; }
+
+	// <name> must outlive the timeline (e.g. be a literal); times in ns
+	void add_span(size_t thread, const char* name, int64_t begin, int64_t end) {
+		if (m_max_spans == 0)
+			return;
+
+		std::vector<t_span>& spans = m_threads[thread].m_spans;
+
+		if (spans.size() < m_max_spans) {
+			spans.push_back(t_span(name, begin, end));
+		}
+	}
+
+	// timestamps are written relative to <epoch> (ns)
+	bool write(const char* file_name, int64_t epoch) const;
+
+private:
+	struct t_span {
+	public:
+		t_span(const char* name, int64_t begin, int64_t end) {
+			m_name = name;
+			m_begin = begin;
+			m_end = end;
+		}
+
+		const char* m_name;
+
+		int64_t m_begin;
+		int64_t m_end;
+	};
+
+	struct t_thread {
+	public:
+		std::string m_name;
+		std::vector<t_span> m_spans;
+	};
+
+private:
+	size_t m_max_spans;
+
+	std::vector<t_thread> m_threads;
+};
@@ -1,8 +1,34 @@
+#include <algorithm>
+
 #include "tri_cell.hpp"
 
-t_vector t_tri_cell::shading_normal(float relx, float rely) const {
-	const t_vector x_s0 = (1.0f - rely) * m_sn00 + rely * m_sn01;
-	const t_vector x_s1 = (1.0f - rely) * m_sn10 + rely * m_sn11;
+// normalized (1, 0, dx) x (0, 1, dy) for a pair of height-deltas
+static t_vector surface_normal(float dx, float dy) {
+	const t_vector vx = t_vector(1.0f, 0.0f, dx);
+	const t_vector vy = t_vector(0.0f, 1.0f, dy);
+
+	t_vector result = vx ^ vy;
+	result.normalize_xyz();
+	return result;
+}
+
+// normal at sample (x, y) from central differences (one-sided on the border)
+static t_vector vertex_normal(const t_heightmap& heightmap, size_t x, size_t y) {
+	const size_t x0 = (x > 0)? (x - 1): x;
+	const size_t y0 = (y > 0)? (y - 1): y;
+	const size_t x1 = std::min(x + 1, heightmap.width() - 1);
+	const size_t y1 = std::min(y + 1, heightmap.height() - 1);
+
+	const float dx = (heightmap.at(x1, y) - heightmap.at(x0, y)) / (x1 - x0);
+	const float dy = (heightmap.at(x, y1) - heightmap.at(x, y0)) / (y1 - y0);
+
+	return (surface_normal(dx, dy));
+}
+
+// vertex normals of cell (x, y) interpolated at (relx, rely)
+static t_vector interpolated_normal(const t_heightmap& heightmap, size_t x, size_t y, float relx, float rely) {
+	const t_vector x_s0 = (1.0f - rely) * vertex_normal(heightmap, x,     y) + rely * vertex_normal(heightmap, x,     y + 1);
+	const t_vector x_s1 = (1.0f - rely) * vertex_normal(heightmap, x + 1, y) + rely * vertex_normal(heightmap, x + 1, y + 1);
 
 	t_vector result = (1.0f - relx) * x_s0 + relx * x_s1;
 	result.normalize_xyz();
@@ -11,11 +37,43 @@ t_vector t_tri_cell::shading_normal(float relx, float rely) const {
 
 
 
-t_ray_intersection t_tri_cell::trace_negative(t_const_ray ray) const {
+// shading normals only matter for the hit that ends up being shaded, so
+// they are derived from the samples around it rather than stored per cell
+t_ray_intersection t_tri_cell::get_intersection(const t_heightmap& heightmap, t_const_ray ray, const t_ray_hit& hit) {
+	const size_t index = hit.id() >> 1;
+	const size_t x = index % (heightmap.width() - 1);
+	const size_t y = index / (heightmap.width() - 1);
+
+	const float z00 = heightmap.at(x,     y    );
+	const float z10 = heightmap.at(x + 1, y    );
+	const float z01 = heightmap.at(x,     y + 1);
+	const float z11 = heightmap.at(x + 1, y + 1);
+
+	const t_vector gn = ((hit.id() & 1) == 0)?
+		surface_normal(z10 - z00, z01 - z00):
+		surface_normal(z11 - z01, z11 - z10);
+
+	return (t_ray_intersection(ray.point(hit.time()), gn, interpolated_normal(heightmap, x, y, hit.u(), hit.v()), hit.time()));
+}
+
+t_vector t_tri_cell::shading_normal(const t_heightmap& heightmap, t_const_vec pos) {
+	const size_t x = std::max(0.0f, std::min(pos.x(), heightmap.width() - 2.0f));
+	const size_t y = std::max(0.0f, std::min(pos.y(), heightmap.height() - 2.0f));
+
+	const float relx = std::max(0.0f, std::min(pos.x() - x, 1.0f));
+	const float rely = std::max(0.0f, std::min(pos.y() - y, 1.0f));
+
+	return (interpolated_normal(heightmap, x, y, relx, rely));
+}
+
+
+
+t_ray_hit t_tri_cell::trace_negative(t_const_ray ray, uint32_t index) const {
 	const t_vector diff = ray.pos() - t_vector(m_x, m_y, m_z00);
+	const t_vector gn = t_vector(-m_dx0, -m_dy0, 1.0f);
 
-	const float dist = diff * m_gn0;
-	const float d = (m_gn0 * ray.dir());
+	const float dist = diff * gn;
+	const float d = (gn * ray.dir());
 
 	if (d < 0.0f) {
 		const float t = -dist / d;
@@ -27,19 +85,20 @@ t_ray_intersection t_tri_cell::trace_negative(t_const_ray ray) const {
 			const float rely = hit.y() - m_y;
 
 			if (relx >= 0.0f && rely >= 0.0f && relx + rely <= 1.0f) {
-				return (t_ray_intersection(hit, m_gn0, shading_normal(relx, rely), t));
+				return (t_ray_hit(t, index * 2 + 0, relx, rely));
 			}
 		}
 	}
 
-	return (t_ray_intersection());
+	return (t_ray_hit());
 }
 
-t_ray_intersection t_tri_cell::trace_positive(t_const_ray ray) const {
+t_ray_hit t_tri_cell::trace_positive(t_const_ray ray, uint32_t index) const {
 	const t_vector diff = ray.pos() - t_vector(m_x + 1.0f, m_y + 1.0f, m_z11);
+	const t_vector gn = t_vector(-m_dx1, -m_dy1, 1.0f);
 
-	const float dist = diff * m_gn1;
-	const float d = (m_gn1 * ray.dir());
+	const float dist = diff * gn;
+	const float d = (gn * ray.dir());
 
 	if (d < 0.0f) {
 		const float t = -dist / d;
@@ -51,21 +110,21 @@ t_ray_intersection t_tri_cell::trace_positive(t_const_ray ray) const {
 			const float rely = hit.y() - m_y;
 
 			if (relx <= 1.0f && rely <= 1.0f && relx + rely >= 1.0f) {
-				return (t_ray_intersection(hit, m_gn1, shading_normal(relx, rely), t));
+				return (t_ray_hit(t, index * 2 + 1, relx, rely));
 			}
 		}
 	}
 
-	return (t_ray_intersection());
+	return (t_ray_hit());
 }
 
 
 
-t_ray_intersection t_tri_cell::trace_negative_slope(t_const_ray ray) const {
+t_ray_hit t_tri_cell::trace_negative_slope(t_const_ray ray, uint32_t index) const {
 	const float dz = ray.dir().z() - ray.dir().x() * m_dx0 - ray.dir().y() * m_dy0;
 
 	if (dz > 0.0f)
-		return (t_ray_intersection());
+		return (t_ray_hit());
 
 	const float diffz = m_z00 - ray.pos().z();
 	const float t = diffz / dz;
@@ -77,18 +136,18 @@ t_ray_intersection t_tri_cell::trace_negative_slope(t_const_ray ray) const {
 		const float rely = hit.y() - m_y;
 
 		if (relx >= 0.0f && rely >= 0.0f && (relx + rely) <= 1.0f) {
-			return (t_ray_intersection(hit, m_gn0, shading_normal(relx, rely), t));
+			return (t_ray_hit(t, index * 2 + 0, relx, rely));
 		}
 	}
 
-	return (t_ray_intersection());
+	return (t_ray_hit());
 }
 
-t_ray_intersection t_tri_cell::trace_positive_slope(t_const_ray ray) const {
+t_ray_hit t_tri_cell::trace_positive_slope(t_const_ray ray, uint32_t index) const {
 	const float dz = ray.dir().z() - ray.dir().x() * m_dx1 - ray.dir().y() * m_dy1;
 
 	if (dz > 0.0f)
-		return (t_ray_intersection());
+		return (t_ray_hit());
 
 	const float diffz = m_z11 - ray.pos().z();
 	const float t = diffz / dz;
@@ -99,54 +158,54 @@ t_ray_intersection t_tri_cell::trace_positive_slope(t_const_ray ray) const {
 		const float rely = hit.y() - m_y;
 
 		if (relx <= 1.0f && rely <= 1.0f && (relx + rely) >= 1.0f) {
-			return (t_ray_intersection(hit, m_gn1, shading_normal(relx, rely), t));
+			return (t_ray_hit(t, index * 2 + 1, relx, rely));
 		}
 	}
 
-	return (t_ray_intersection());
+	return (t_ray_hit());
 }
 
 
 
-t_ray_intersection t_tri_cell::trace_ray(t_const_ray ray) const {
+t_ray_hit t_tri_cell::trace_ray(t_const_ray ray, uint32_t index) const {
 	if ((ray.dir().x() + ray.dir().y()) > 0.0f) {
-		const t_ray_intersection result = trace_negative(ray);
+		const t_ray_hit result = trace_negative(ray, index);
 
 		if (result.valid())
 			return result;
 
-		return (trace_positive(ray));
+		return (trace_positive(ray, index));
 	} else {
-		const t_ray_intersection result = trace_positive(ray);
+		const t_ray_hit result = trace_positive(ray, index);
 
 		if (result.valid())
 			return result;
 
-		return (trace_negative(ray));
+		return (trace_negative(ray, index));
 	}
 }
 
-t_ray_intersection t_tri_cell::trace_slope_ray(t_const_ray slope_ray) const {
+t_ray_hit t_tri_cell::trace_slope_ray(t_const_ray slope_ray, uint32_t index) const {
 	if ((slope_ray.dir().x() + slope_ray.dir().y()) > 0.0f) {
-		const t_ray_intersection result = trace_negative_slope(slope_ray);
+		const t_ray_hit result = trace_negative_slope(slope_ray, index);
 
 		if (result.valid())
 			return result;
 
-		return (trace_positive_slope(slope_ray));
+		return (trace_positive_slope(slope_ray, index));
 	} else {
-		const t_ray_intersection result = trace_positive_slope(slope_ray);
+		const t_ray_hit result = trace_positive_slope(slope_ray, index);
 
 		if (result.valid())
 			return result;
 
-		return (trace_negative_slope(slope_ray));
+		return (trace_negative_slope(slope_ray, index));
 	}
 }
 
 bool t_tri_cell::trace_shadow_ray(t_const_ray ray) const {
 	// TODO: optimize?
-	return ((trace_ray(ray)).valid());
+	return ((trace_ray(ray, 0)).valid());
 }
 
 void t_tri_cell::set_from_heightmap(const t_heightmap& heightmap, size_t x, size_t y) {
@@ -167,96 +226,4 @@ void t_tri_cell::set_from_heightmap(const t_heightmap& heightmap, size_t x, size
 	m_dx1 = m_z11 - m_z01;
 	m_dy0 = m_z01 - m_z00;
 	m_dy1 = m_z11 - m_z10;
-
-	const t_vector x0 = t_vector(1.0f, 0.0f, m_dx0);
-	const t_vector y0 = t_vector(0.0f, 1.0f, m_dy0);
-	const t_vector x1 = t_vector(1.0f, 0.0f, m_dx1);
-	const t_vector y1 = t_vector(0.0f, 1.0f, m_dy1);
-
-	m_gn0 = x0 ^ y0;
-	m_gn1 = x1 ^ y1;
-	m_gn0.normalize_xyz();
-	m_gn1.normalize_xyz();
-
-	float dx = m_dx0;
-	float dy = m_dy0;
-
-	t_vector vx;
-	t_vector vy;
-
-	// n_s00
-	if (x > 0) {
-		dx = (heightmap.at(x + 1, y) - heightmap.at(x - 1, y)) * 0.5f;
-	} else {
-		dx = m_dx0;
-	}
-
-	if (y > 0) {
-		dy = (heightmap.at(x, y + 1) - heightmap.at(x, y - 1)) * 0.5f;
-	} else {
-		dy = m_dy0;
-	}
-
-	vx = t_vector(1.0f, 0.0f, dx);
-	vy = t_vector(0.0f, 1.0f, dy);
-	m_sn00 = vx ^ vy;
-	m_sn00.normalize_xyz();
-
-
-	// n_s10
-	if (m_x < heightmap.width() - 2) {
-		dx = (heightmap.at(x + 2, y) - heightmap.at(x, y)) * 0.5f;
-	} else {
-		dx = m_dx0;
-	}
-
-	if (y > 0) {
-		dy = (heightmap.at(x + 1, y + 1) - heightmap.at(x + 1, y - 1)) * 0.5f;
-	} else {
-		dy = m_dy1;
-	}
-
-	vx = t_vector(1.0f, 0.0f, dx);
-	vy = t_vector(0.0f, 1.0f, dy);
-	m_sn10 = vx ^ vy;
-	m_sn10.normalize_xyz();
-
-
-	// n _s01
-	if (x > 0) {
-		dx = (heightmap.at(x + 1, y + 1) - heightmap.at(x - 1, y + 1)) * 0.5f;
-	} else {
-		dx = m_dx1;
-	}
-
-	if (y < heightmap.height() - 2) {
-		dy = (heightmap.at(x, y + 2) - heightmap.at(x, y)) * 0.5f;
-	} else {
-		dy = m_dy0;
-	}
-
-	vx = t_vector(1.0f, 0.0f, dx);
-	vy = t_vector(0.0f, 1.0f, dy);
-	m_sn01 = vx ^ vy;
-	m_sn01.normalize_xyz();
-
-
-	// n_s11
-	if (x < heightmap.width() - 2) {
-		dx = (heightmap.at(x + 2, y + 1) - heightmap.at(x, y + 1)) * 0.5f;
-	} else {
-		dx = m_dx1;
-	}
-
-	if (y < heightmap.height() - 2) {
-		dy = (heightmap.at(x + 1, y + 2) - heightmap.at(x + 1, y)) * 0.5f;
-	} else {
-		dy = m_dy1;
-	}
-
-	vx = t_vector(1.0f, 0.0f, dx);
-	vy = t_vector(0.0f, 1.0f, dy);
-	m_sn11 = vx ^ vy;
-	m_sn11.normalize_xyz();
 }
-
@@ -2,46 +2,43 @@
 #include "cell.hpp"
 
 // represents a two-triangle quad with fixed tesellation direction
-class t_tri_cell: public t_cell {
+class t_tri_cell {
 public:
 	float get_max_height() const { return m_max_height; }
 	float get_min_height() const { return m_min_height; }
 
-	t_ray_intersection trace_ray(t_const_ray ray) const;
-	t_ray_intersection trace_slope_ray(t_const_ray slope_ray) const;
+	// hit-ids are (index * 2 + triangle), with (u, v) the position
+	// relative to the cell's (x, y) corner
+	t_ray_hit trace_ray(t_const_ray ray, uint32_t index) const;
+	t_ray_hit trace_slope_ray(t_const_ray slope_ray, uint32_t index) const;
 
 	bool trace_shadow_ray(t_const_ray ray) const;
 
 	void set_from_heightmap(const t_heightmap& heightmap, size_t x, size_t y);
 
+	static t_ray_intersection get_intersection(const t_heightmap& heightmap, t_const_ray ray, const t_ray_hit& hit);
+	static t_vector shading_normal(const t_heightmap& heightmap, t_const_vec pos);
+
 private:
-	t_vector shading_normal(float relx, float rely) const;
 
-	t_ray_intersection trace_negative(t_const_ray ray) const;
-	t_ray_intersection trace_positive(t_const_ray ray) const;
+	t_ray_hit trace_negative(t_const_ray ray, uint32_t index) const;
+	t_ray_hit trace_positive(t_const_ray ray, uint32_t index) const;
 
-	t_ray_intersection trace_negative_slope(t_const_ray ray) const;
-	t_ray_intersection trace_positive_slope(t_const_ray ray) const;
+	t_ray_hit trace_negative_slope(t_const_ray ray, uint32_t index) const;
+	t_ray_hit trace_positive_slope(t_const_ray ray, uint32_t index) const;
 
 private:
 	float m_min_height;
 	float m_max_height;
 
-	// geometric normals
-	t_vector m_gn0;
-	t_vector m_gn1;
-
-	// shading normals
-	t_vector m_sn00;
-	t_vector m_sn10;
-	t_vector m_sn01;
-	t_vector m_sn11;
-
 	// grid coordinates
 	float m_x, m_y;
 	// corner heights
 	float m_z00, m_z10, m_z01, m_z11;
-	// delta heights
+	// delta heights, which also define the (unnormalized) geometric
+	// normals (-m_dx0, -m_dy0, 1) and (-m_dx1, -m_dy1, 1)
 	float m_dx0, m_dx1, m_dy0, m_dy1;
 };
 
+static_assert(t_cell_interface<t_tri_cell>::value, "not a cell-type");
+